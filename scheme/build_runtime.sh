@@ -1,17 +1,17 @@
 #!/usr/bin/sh
 
+# Builds the runtime once into a static library that compiled modules
+# link against. The objects carry LTO bytecode as well as machine code,
+# so modules built with -flto (see SLY_CFLAGS) can inline the runtime.
+
 warnings='-Wmissing-prototypes -Wextra -pedantic -Wall -Wswitch-enum'
-cflags="-ggdb -std=c11 $warnings"
+cflags="-ggdb -std=c11 -fPIC -O2 -flto -ffat-lto-objects $warnings"
 cdir=$(dirname "$0")
 runtime="$cdir/scm_runtime.c"
-target="$cdir/scm_runtime.o"
-
-# gcc -c -ggdb -o scheme/scm_runtime.o scheme/scm_runtime.c
+object="$cdir/scm_runtime.o"
+target="$cdir/libscm_runtime.a"
 
-if [ "$1" = "-s" ]; then
-	# shellcheck disable=SC2086 # Intended splitting of cflags
-	gcc -fPIC -c $cflags -o "$target" "$runtime"
-else
-	# shellcheck disable=SC2086 # Intended splitting of cflags
-	gcc -c $cflags -o "$target" "$runtime"
-fi
+# shellcheck disable=SC2086 # Intended splitting of cflags
+gcc -c $cflags -o "$object" "$runtime" \
+	&& rm -f "$target" \
+	&& gcc-ar rcs "$target" "$object"
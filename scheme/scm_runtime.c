@@ -1,3 +1,4 @@
+#define _DEFAULT_SOURCE
 #include <assert.h>
 #include <stdio.h>
 #include <wchar.h>
@@ -6,6 +7,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include "../common/common_def.h"
 #include "scm_types.h"
@@ -20,22 +22,88 @@ struct shared_buf {
 	u8 bytes[];
 };
 
-#define ARG_STACK_LEN 512LU
+/* The argument stack is a mapping of len slots followed by a guard
+ * page, pages are only backed once they are pushed to. The size can
+ * be set with SCM_ARG_STACK_SIZE (in bytes).
+ */
+#define ARG_STACK_SZ (1LU << 27)
 static struct {
 	size_t top;
-	scm_value stk[ARG_STACK_LEN];
+	size_t len;
+	scm_value *stk;
 } arg_stack;
 
 #define module_entry(name, fn) _cons((scm_value)(name), make_function(fn))
 
+/* Everything is allocated in the nursery. A minor collection
+ * promotes whatever is live in the nursery to the old space,
+ * old objects holding nursery pointers are found through the
+ * remembered set kept by the write barrier. Once the old space
+ * has grown past the threshold a major collection copies both
+ * into the other old semispace.
+ * Heap values are 32bit offsets into their space (OLD_SPACE_BIT
+ * tells which one). Each space is reserved up front and never
+ * moves, strings keep direct pointers to their buffers.
+ * The old space size (heap_working->sz) is one of the classes
+ * initial_sz * growth^k. It is the smallest class holding the live
+ * data times the trigger ratio, it grows right away but only
+ * shrinks after shrink_after major collections in a row asked for
+ * a smaller class. After a major collection the from-space keeps
+ * the pages the next copy of the live data will need, the rest are
+ * given back to the OS.
+ * The policy can be tuned with the environment variables
+ * SCM_NURSERY_SIZE, SCM_HEAP_SIZE (initial size in bytes),
+ * SCM_HEAP_GROWTH, SCM_GC_TRIGGER and SCM_HEAP_SHRINK_AFTER.
+ * SCM_HEAP_MAX (bytes) is how much address space each space
+ * reserves, the nursery and either old space can never grow past
+ * it. It defaults to, and can not be raised above, the 4GiB that
+ * 32bit offsets reach.
+ */
 #define HEAP_PAGE_SZ (1LU << 12)
+#define HEAP_RESERVE_SZ (1LU << 32)
+#define NURSERY_SZ (1LU << 18)
+#define HEAP_INITIAL_SZ (1LU << 20)
+static struct {
+	size_t max_sz;
+	size_t nursery_sz;
+	size_t initial_sz;
+	double growth;
+	double trigger;
+	size_t shrink_after;
+} heap_policy = {
+	.max_sz = HEAP_RESERVE_SZ,
+	.nursery_sz = NURSERY_SZ,
+	.initial_sz = HEAP_INITIAL_SZ,
+	.growth = 2.0,
+	.trigger = 1.5,
+	.shrink_after = 4,
+};
+static Mem_Pool nursery = {0};
 static Mem_Pool mp0 = {0};
 static Mem_Pool mp1 = {0};
-static Mem_Pool *heap_working = &mp0;
+Mem_Pool *heap_nursery = &nursery;
+Mem_Pool *heap_working = &mp0;
 static Mem_Pool *heap_free = &mp1;
-static size_t gc_threashold = 0;
+static Mem_Pool *heap_to_space = &mp0;
+static int gc_major = 0;
+static size_t gc_low_residency = 0;
 static size_t bytes_allocated = 0;
 static size_t gc_cycles = 0;
+static size_t gc_minor_cycles = 0;
+/* Offsets into heap_working of slots written with a nursery
+ * pointer. The low bit marks a string's buffer pointer.
+ */
+#define REMEMBERED_SB 1
+static struct {
+	size_t len;
+	size_t cap;
+	u32 *slots;
+} remembered;
+/* Direct calls between compiled procedures nest on the C stack,
+ * after SCM_CALL_DEPTH of them a call goes through the trampoline
+ * again which unwinds the stack.
+ */
+static size_t call_depth = 0;
 static jmp_buf exit_point;
 static scm_value exception_handler;
 static scm_value **intern_tbl;
@@ -65,13 +133,104 @@ _tail_call(scm_value proc)
 	return proc;
 }
 
+static void
+heap_reserve(Mem_Pool *mp)
+{
+	mp->buf = mmap(NULL, heap_policy.max_sz, PROT_READ|PROT_WRITE,
+				   MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	scm_assert(mp->buf != MAP_FAILED, "OS is too greedy :(");
+	mp->idx = sizeof(scm_value);
+}
+
+static void
+heap_release(Mem_Pool *mp, size_t from, size_t to)
+{ // pages given back read as zero when they are used again
+	from = (from + HEAP_PAGE_SZ - 1) & ~(HEAP_PAGE_SZ - 1);
+	if (to > from) {
+		madvise(mp->buf + from, to - from, MADV_DONTNEED);
+	}
+}
+
+static size_t
+heap_env_count(char *name, size_t dflt, size_t min, size_t max)
+{ // a setting outside of [min, max] is ignored with a warning
+	char *str = getenv(name);
+	if (str == NULL) {
+		return dflt;
+	}
+	char *end;
+	errno = 0;
+	size_t n = strtoul(str, &end, 0);
+	if (end == str || *end != '\0' || errno || n < min || n > max) {
+		fprintf(stderr, "Warning: ignoring %s=%s\n", name, str);
+		return dflt;
+	}
+	return n;
+}
+
+static size_t
+heap_env_size(char *name, size_t dflt)
+{
+	return heap_env_count(name, dflt, HEAP_PAGE_SZ, heap_policy.max_sz);
+}
+
+static double
+heap_env_ratio(char *name, double dflt)
+{
+	char *str = getenv(name);
+	if (str == NULL) {
+		return dflt;
+	}
+	char *end;
+	double r = strtod(str, &end);
+	if (end == str || !(r > 1.0 && r < 64.0)) {
+		fprintf(stderr, "Warning: ignoring %s=%s\n", name, str);
+		return dflt;
+	}
+	return r;
+}
+
 void
 scm_heap_init(void)
 {
-	mp0.sz = HEAP_PAGE_SZ;
-	mp0.buf = malloc(HEAP_PAGE_SZ);
-	scm_assert(mp0.buf != NULL, "OS is too greedy :(");
-	mp0.idx = sizeof(scm_value);
+	heap_policy.max_sz = heap_env_size("SCM_HEAP_MAX", heap_policy.max_sz);
+	heap_policy.max_sz &= ~(HEAP_PAGE_SZ - 1);
+	heap_policy.nursery_sz =
+		heap_env_size("SCM_NURSERY_SIZE", heap_policy.nursery_sz);
+	heap_policy.initial_sz =
+		heap_env_size("SCM_HEAP_SIZE", heap_policy.initial_sz);
+	heap_policy.growth = heap_env_ratio("SCM_HEAP_GROWTH", heap_policy.growth);
+	heap_policy.trigger = heap_env_ratio("SCM_GC_TRIGGER", heap_policy.trigger);
+	heap_policy.shrink_after = heap_env_count("SCM_HEAP_SHRINK_AFTER",
+											  heap_policy.shrink_after,
+											  1, 1LU << 20);
+	heap_reserve(&nursery);
+	heap_reserve(&mp0);
+	heap_reserve(&mp1);
+	nursery.sz = heap_policy.nursery_sz;
+	mp0.sz = heap_policy.initial_sz;
+	mp1.sz = heap_policy.initial_sz;
+	size_t sz = heap_env_count("SCM_ARG_STACK_SIZE", ARG_STACK_SZ,
+							   HEAP_PAGE_SZ, HEAP_RESERVE_SZ);
+	sz = (sz + HEAP_PAGE_SZ - 1) & ~(HEAP_PAGE_SZ - 1);
+	u8 *stk = mmap(NULL, sz + HEAP_PAGE_SZ, PROT_READ|PROT_WRITE,
+				   MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	scm_assert(stk != MAP_FAILED, "OS is too greedy :(");
+	mprotect(stk + sz, HEAP_PAGE_SZ, PROT_NONE);
+	arg_stack.stk = (scm_value *)stk;
+	arg_stack.len = sz / sizeof(scm_value);
+	arg_stack.top = 0;
+}
+
+static size_t
+heap_size_class(size_t live)
+{
+	double want = live * heap_policy.trigger;
+	double sz = heap_policy.initial_sz;
+	while (sz < want) {
+		sz *= heap_policy.growth;
+	}
+	return sz < heap_policy.max_sz ? sz : heap_policy.max_sz;
 }
 
 size_t
@@ -82,123 +241,121 @@ mem_align_offset(size_t addr)
 
 size_t
 scm_heap_alloc(size_t sz)
-{
+{ /* The nursery may run past its size here, it is
+   * collected at the next scm_chk_heap. */
 	sz += mem_align_offset(sz);
-	if (sz >= (heap_working->sz - heap_working->idx)) {
-		heap_working->sz *= 2;
-		heap_working->buf = realloc(heap_working->buf,
-									heap_working->sz);
-	}
-	size_t i = heap_working->idx;
-	heap_working->idx += sz;
+	scm_assert(sz < heap_policy.max_sz - heap_nursery->idx, "out of memory");
+	size_t i = heap_nursery->idx;
+	heap_nursery->idx += sz;
 	bytes_allocated += sz;
 	return i;
 }
 
-static void *
-scm_copy_mem(scm_value *vptr, u32 fref, size_t sz)
+static inline int
+heap_value_p(scm_value value)
 {
-	void *ptr = &heap_free->buf[fref];
-	memcpy(ptr, GET_WORKING_PTR(*vptr), sz);
-	*((u32 *)GET_WORKING_PTR(*vptr)) = fref;
-	*vptr = (*vptr ^ (*vptr & ((1LU << 32) - 1))) | fref;
-	heap_free->idx += sz;
-	return ptr;
+	return !(NUMBER_P(value) || BOOLEAN_P(value)
+			 || CHAR_P(value) || NULL_P(value)
+			 || VOID_P(value) || FUNCTION_P(value));
 }
 
 static void
-scm_collect_value(scm_value *vptr)
+remember(void *slot, u32 flags)
 {
-	if (NUMBER_P(*vptr) || BOOLEAN_P(*vptr)
-		|| CHAR_P(*vptr) || NULL_P(*vptr)
-		|| VOID_P(*vptr) || FUNCTION_P(*vptr)) {
+	u32 off = ((u8 *)slot - heap_working->buf) | flags;
+	if (remembered.len && remembered.slots[remembered.len-1] == off) {
 		return;
 	}
-	u32 fref;
-	if ((fref = *((u32 *)GET_WORKING_PTR(*vptr)))) {
-		*vptr = (*vptr ^ (*vptr & ((1LU << 32) - 1))) | fref;
-		return;
+	if (remembered.len == remembered.cap) {
+		remembered.cap = remembered.cap ? remembered.cap * 2 : 256;
+		remembered.slots = realloc(remembered.slots,
+								   remembered.cap * sizeof(u32));
+		scm_assert(remembered.slots != NULL, "OS is too greedy :(");
+	}
+	remembered.slots[remembered.len++] = off;
+}
+
+static inline void
+write_barrier(scm_value obj, scm_value *slot, scm_value value)
+{
+	*slot = value;
+	if (OLD_P(obj) && heap_value_p(value) && !OLD_P(value)) {
+		remember(slot, 0);
+	}
+}
+
+void
+scm_write_barrier(scm_value obj, scm_value *slot, scm_value value)
+{
+	write_barrier(obj, slot, value);
+}
+
+static inline void
+write_barrier_sb(scm_value str, struct shared_buf **slot,
+				 struct shared_buf *sb)
+{
+	*slot = sb;
+	if (OLD_P(str)) {
+		remember(slot, REMEMBERED_SB);
 	}
+}
+
+static inline int
+pool_p(Mem_Pool *mp, void *ptr)
+{
+	return (u8 *)ptr >= mp->buf && (u8 *)ptr < mp->buf + mp->idx;
+}
+
+static inline int
+from_space_p(scm_value value)
+{
+	return gc_major || !OLD_P(value);
+}
+
+/* Collection is a Cheney scan: scm_collect_value only copies an
+ * object to the end of to-space, the scan pointer then walks
+ * to-space fixing the fields of each copied object until it catches
+ * up. Nothing records an object's type in the heap, so while a copy
+ * waits to be scanned its fref holds the type tag (SB_TAG for a
+ * string buffer). The from-space object's fref is the forwarding
+ * offset as before.
+ */
+#define SB_TAG TT_COUNT
+
+static size_t
+heap_object_size(enum type_tag tt, void *obj)
+{
 	size_t sz = 0;
-	fref = heap_free->idx;
-	switch ((enum type_tag)(TYPEOF(*vptr) & 0xf)) {
-	case tt_bigint: {
-		scm_assert(0, "unimplemented");
-	} break;
+	switch (tt) {
 	case tt_pair: {
-		Pair *p = GET_WORKING_PTR(*vptr);
-		sz = sizeof(*p);
-		p = scm_copy_mem(vptr, fref, sz);
-		scm_collect_value(&p->car);
-		scm_collect_value(&p->cdr);
+		sz = sizeof(Pair);
 	} break;
 	case tt_symbol: {
-		Symbol *s = GET_WORKING_PTR(*vptr);
-		sz = sizeof(*s) + s->len;
-		sz += mem_align_offset(sz);
-		scm_copy_mem(vptr, fref, sz);
+		sz = sizeof(Symbol) + ((Symbol *)obj)->len;
 	} break;
 	case tt_bytevector: {
-		Bytevector *b = GET_WORKING_PTR(*vptr);
-		sz = sizeof(*b) + b->len;
-		sz += mem_align_offset(sz);
-		scm_copy_mem(vptr, fref, sz);
+		sz = sizeof(Bytevector) + ((Bytevector *)obj)->len;
 	} break;
 	case tt_string: {
-		String *s = GET_WORKING_PTR(*vptr);
-		sz = sizeof(*s);
-		sz += mem_align_offset(sz);
-		s = scm_copy_mem(vptr, fref, sz);
-		fref += sz;
-		if (s->buf->fref) {
-			s->buf = GET_FREE_PTR(s->buf->fref);
-			s->buf->rc++;
-		} else {
-			sz = sizeof(*s->buf) + s->buf->len;
-			sz += mem_align_offset(sz);
-			struct shared_buf *prev = s->buf;
-			void *ptr = &heap_free->buf[fref];
-			size_t len = sizeof(*s->buf)
-				+ (s->buf->len * (s->buf->wc ? sizeof(scm_wchar) : 1));
-			memcpy(ptr, s->buf, len);
-			prev->fref = fref;
-			heap_free->idx += sz;
-			s->buf = ptr;
-			s->buf->rc = 1;
-			s->buf->fref = 0;
-			fref += sz;
-		}
+		sz = sizeof(String);
 	} break;
 	case tt_vector: {
-		Vector *v = GET_WORKING_PTR(*vptr);
-		sz = sizeof(*v) + (v->len * sizeof(scm_value));
-		v = scm_copy_mem(vptr, fref, sz);
-		for (u32 i = 0; i < v->len; ++i) {
-			scm_collect_value(&v->elems[i]);
-		}
+		sz = sizeof(Vector) + (((Vector *)obj)->len * sizeof(scm_value));
 	} break;
 	case tt_record: {
-		Record *rec = GET_WORKING_PTR(*vptr);
-		sz = sizeof(*rec) + (rec->len * sizeof(scm_value));
-		rec = scm_copy_mem(vptr, fref, sz);
-		scm_collect_value(&rec->meta);
-		for (u32 i = 0; i < rec->len; ++i) {
-			scm_collect_value(&rec->elems[i]);
-		}
+		sz = sizeof(Record) + (((Record *)obj)->len * sizeof(scm_value));
 	} break;
 	case tt_box: {
-		Box *box = GET_WORKING_PTR(*vptr);
-		box = scm_copy_mem(vptr, fref, sizeof(*box));
-		scm_collect_value(&box->value);
+		sz = sizeof(Box);
 	} break;
 	case tt_closure: {
-		Closure *clos = GET_WORKING_PTR(*vptr);
-		sz = sizeof(*clos) + (clos->nfree_vars * sizeof(scm_value));
-		clos = scm_copy_mem(vptr, fref, sz);
-		for (u32 i = 0; i < clos->nfree_vars; ++i) {
-			scm_collect_value(&clos->free_vars[i]);
-		}
+		sz = sizeof(Closure)
+			+ (((Closure *)obj)->nfree_vars * sizeof(scm_value));
+	} break;
+	case SB_TAG: {
+		sz = sizeof(struct shared_buf) + ((struct shared_buf *)obj)->len;
 	} break;
+	case tt_bigint:
 	case tt_inf:
 	case tt_nan:
 	case tt_void:
@@ -206,20 +363,128 @@ scm_collect_value(scm_value *vptr)
 	case tt_char:
 	case tt_int:
 	case tt_function:
-	case TT_COUNT:
 	case tt_float:
 	default: {
 		scm_assert(0, "Unreachable");
 	} break;
 	}
+	return sz + mem_align_offset(sz);
 }
 
 static void
-scm_gc(scm_value *cc)
+scm_collect_buf(struct shared_buf **bp)
+{
+	struct shared_buf *sb = *bp;
+	if (!pool_p(heap_nursery, sb)
+		&& !(gc_major && pool_p(heap_working, sb))) {
+		return;
+	}
+	if (sb->fref) {
+		*bp = GET_TO_SPACE_PTR(sb->fref);
+		(*bp)->rc++;
+		return;
+	}
+	size_t sz = heap_object_size(SB_TAG, sb);
+	scm_assert(sz < heap_policy.max_sz - heap_to_space->idx, "out of memory");
+	u32 fref = heap_to_space->idx;
+	struct shared_buf *ptr = (void *)&heap_to_space->buf[fref];
+	memcpy(ptr, sb, sizeof(*sb) + sb->len);
+	sb->fref = fref;
+	heap_to_space->idx += sz;
+	ptr->rc = 1;
+	ptr->fref = SB_TAG;
+	*bp = ptr;
+}
+
+static void
+scm_collect_value(scm_value *vptr)
+{
+	if (!heap_value_p(*vptr) || !from_space_p(*vptr)) {
+		return;
+	}
+	u32 *obj = GET_WORKING_PTR(*vptr);
+	u32 fref = *obj;
+	if (fref == 0) {
+		enum type_tag tt = TYPEOF(*vptr) & 0xf;
+		if (tt == tt_bigint) {
+			scm_assert(0, "unimplemented");
+		}
+		size_t sz = heap_object_size(tt, obj);
+		scm_assert(sz < heap_policy.max_sz - heap_to_space->idx, "out of memory");
+		fref = heap_to_space->idx;
+		u32 *ptr = (void *)&heap_to_space->buf[fref];
+		memcpy(ptr, obj, sz);
+		*ptr = tt;
+		*obj = fref;
+		heap_to_space->idx += sz;
+	}
+	*vptr = (*vptr ^ (*vptr & ((1LU << 33) - 1))) | OLD_SPACE_BIT | fref;
+}
+
+static void
+scm_scan_to_space(size_t scan)
+{
+	while (scan < heap_to_space->idx) {
+		u32 *obj = (void *)&heap_to_space->buf[scan];
+		enum type_tag tt = *obj;
+		switch (tt) {
+		case tt_pair: {
+			Pair *p = (void *)obj;
+			scm_collect_value(&p->car);
+			scm_collect_value(&p->cdr);
+		} break;
+		case tt_string: {
+			String *s = (void *)obj;
+			scm_collect_buf(&s->buf);
+		} break;
+		case tt_vector: {
+			Vector *v = (void *)obj;
+			for (u32 i = 0; i < v->len; ++i) {
+				scm_collect_value(&v->elems[i]);
+			}
+		} break;
+		case tt_record: {
+			Record *rec = (void *)obj;
+			scm_collect_value(&rec->meta);
+			for (u32 i = 0; i < rec->len; ++i) {
+				scm_collect_value(&rec->elems[i]);
+			}
+		} break;
+		case tt_box: {
+			Box *box = (void *)obj;
+			scm_collect_value(&box->value);
+		} break;
+		case tt_closure: {
+			Closure *clos = (void *)obj;
+			for (u32 i = 0; i < clos->nfree_vars; ++i) {
+				scm_collect_value(&clos->free_vars[i]);
+			}
+		} break;
+		case tt_symbol:
+		case tt_bytevector:
+		case SB_TAG:
+			break;
+		case tt_bigint:
+		case tt_inf:
+		case tt_nan:
+		case tt_void:
+		case tt_bool:
+		case tt_char:
+		case tt_int:
+		case tt_function:
+		case tt_float:
+		default: {
+			scm_assert(0, "Unreachable");
+		} break;
+		}
+		scan += heap_object_size(tt, obj);
+		*obj = 0;
+	}
+}
+
+static void
+scm_collect_roots(scm_value *cc)
 {
-	heap_free->idx = sizeof(scm_value);
-	heap_free->sz = heap_working->sz;
-	heap_free->buf = malloc(heap_free->sz);
 	for (size_t i = 0; i < intern_tbl_len; ++i) {
 		scm_value *interned = intern_tbl[i];
 		size_t len = interned[0];
@@ -230,23 +495,85 @@ scm_gc(scm_value *cc)
 	for (size_t i = 0; i < arg_stack.top; ++i) {
 		scm_collect_value(&arg_stack.stk[i]);
 	}
+	scm_collect_value(&exception_handler);
 	scm_collect_value(cc);
-	void *tmp = heap_working;
+}
+
+static void
+scm_minor_gc(scm_value *cc)
+{
+	heap_to_space = heap_working;
+	size_t scan = heap_to_space->idx;
+	for (size_t i = 0; i < remembered.len; ++i) {
+		u32 off = remembered.slots[i];
+		void *slot = &heap_working->buf[off & ~REMEMBERED_SB];
+		if (off & REMEMBERED_SB) {
+			scm_collect_buf(slot);
+		} else {
+			scm_collect_value(slot);
+		}
+	}
+	remembered.len = 0;
+	scm_collect_roots(cc);
+	scm_scan_to_space(scan);
+	heap_release(heap_nursery, heap_nursery->sz, heap_nursery->idx);
+	heap_nursery->idx = sizeof(scm_value);
+}
+
+static void
+scm_gc(scm_value *cc)
+{
+	gc_major = 1;
+	heap_to_space = heap_free;
+	heap_free->idx = sizeof(scm_value);
+	scm_collect_roots(cc);
+	scm_scan_to_space(sizeof(scm_value));
+	gc_major = 0;
+	remembered.len = 0;
+	heap_release(heap_nursery, heap_nursery->sz, heap_nursery->idx);
+	heap_nursery->idx = sizeof(scm_value);
+	size_t top = arg_stack.top * sizeof(scm_value);
+	top = (top + HEAP_PAGE_SZ - 1) & ~(HEAP_PAGE_SZ - 1);
+	madvise((u8 *)arg_stack.stk + top,
+			(arg_stack.len * sizeof(scm_value)) - top, MADV_DONTNEED);
+	Mem_Pool *tmp = heap_working;
 	heap_working = heap_free;
 	heap_free = tmp;
-	free(heap_free->buf);
-	heap_free->buf = NULL;
+	size_t sz = heap_size_class(heap_working->idx);
+	/* the next copy of the live data only needs this much */
+	heap_release(heap_free, sz, heap_free->idx > heap_free->sz
+				 ? heap_free->idx : heap_free->sz);
+	if (sz >= heap_free->sz) {
+		gc_low_residency = 0;
+	} else if (++gc_low_residency < heap_policy.shrink_after) {
+		sz = heap_free->sz;
+	} else {
+		gc_low_residency = 0;
+		sz = heap_free->sz / heap_policy.growth;
+		heap_release(heap_working, sz, heap_working->sz);
+	}
+	heap_working->sz = sz;
+	heap_free->sz = sz;
 	heap_free->idx = 0;
-	heap_free->sz = 0;
-	====gc_threashold = heap_working->idx;
+}
+
+int
+scm_gc_pending(void)
+{
+	return heap_nursery->idx > heap_nursery->sz;
 }
 
 void
 scm_chk_heap(scm_value *cc)
 {
-	if (heap_working->idx > (gc_threashold + (gc_threashold / 2))) {
-		gc_cycles++;
-		scm_gc(cc);
+	if (heap_nursery->idx > heap_nursery->sz) {
+		if (heap_working->idx + heap_nursery->idx > heap_working->sz) {
+			gc_cycles++;
+			scm_gc(cc);
+		} else {
+			gc_minor_cycles++;
+			scm_minor_gc(cc);
+		}
 	}
 }
 
@@ -456,6 +783,9 @@ make_record(u32 len, scm_value meta)
 	rec->fref = 0;
 	rec->len = len;
 	rec->meta = meta;
+	for (u32 i = 0; i < len; ++i) {
+		rec->elems[i] = SCM_VOID;
+	}
 	return (NB_RECORD << 48)|value;
 }
 
@@ -474,7 +804,7 @@ record_set(scm_value r, u32 idx, scm_value v)
 	scm_assert(RECORD_P(r), "type error, expected <record>");
 	Record *rec = GET_PTR(r);
 	scm_assert(idx < rec->len, "error index out of bounds");
-	rec->elems[idx] = v;
+	write_barrier(r, &rec->elems[idx], v);
 	return SCM_VOID;
 }
 
@@ -483,7 +813,7 @@ record_meta_set(scm_value value, scm_value v)
 {
 	scm_assert(RECORD_P(value), "type error, expected <record>");
 	Record *rec = GET_PTR(value);
-	rec->meta = v;
+	write_barrier(value, &rec->meta, v);
 	return SCM_VOID;
 }
 
@@ -709,6 +1039,13 @@ closure_ref(scm_value clos, i32 idx)
 	return c->free_vars[idx];
 }
 
+void
+closure_set(scm_value clos, i32 idx, scm_value value)
+{
+	Closure *c = GET_PTR(clos);
+	write_barrier(clos, &c->free_vars[idx], value);
+}
+
 scm_value
 make_box(void)
 {
@@ -728,7 +1065,7 @@ box_set(scm_value b, scm_value value)
 	if (BOX_P(value)) {
 		box_set(b, box_ref(value));
 	} else {
-		box->value = value;
+		write_barrier(b, &box->value, value);
 	}
 }
 
@@ -775,7 +1112,7 @@ get_float(scm_value x)
 void
 push_arg(scm_value x)
 {
-	if (arg_stack.top < ARG_STACK_LEN) {
+	if (arg_stack.top < arg_stack.len) {
 		arg_stack.stk[arg_stack.top++] = x;
 	} else {
 		scm_assert(0, "ARG STACK OVERFLOW");
@@ -791,6 +1128,34 @@ push_ref(scm_value x)
 	push_arg(x);
 }
 
+scm_value
+scm_ref(scm_value x)
+{
+	if (BOX_P(x)) {
+		x = box_ref(x);
+	}
+	return x;
+}
+
+int
+scm_code_p(scm_value proc, klabel_t code)
+{
+	if (FUNCTION_P(proc)) {
+		return GET_FN_PTR(proc) == code;
+	}
+	return CLOSURE_P(proc) && ((Closure *)GET_PTR(proc))->code == code;
+}
+
+int
+scm_direct_call_p(scm_value proc, klabel_t code)
+{
+	if (call_depth >= SCM_CALL_DEPTH || !scm_code_p(proc, code)) {
+		return 0;
+	}
+	call_depth++;
+	return 1;
+}
+
 scm_value
 pop_arg(void)
 {
@@ -884,7 +1249,7 @@ primop_set_car(void)
 	scm_value val = pop_arg();
 	scm_assert(PAIR_P(pair), "type error expected <pair>");
 	Pair *p = GET_PTR(pair);
-	p->car = val;
+	write_barrier(pair, &p->car, val);
 	return SCM_VOID;
 }
 
@@ -904,7 +1269,7 @@ primop_set_cdr(void)
 	scm_value val = pop_arg();
 	scm_assert(PAIR_P(pair), "type error expected <pair>");
 	Pair *p = GET_PTR(pair);
-	p->cdr = val;
+	write_barrier(pair, &p->cdr, val);
 	return SCM_VOID;
 }
 
@@ -917,16 +1282,23 @@ prim_set_cdr(UNUSED_ATTR scm_value self)
 }
 
 scm_value
-prim_list(UNUSED_ATTR scm_value self)
+primop_list(void)
 {
-	scm_assert(chk_args(1, 1), "arity error");
-	scm_value k = pop_arg();
 	scm_value lst = SCM_NULL;
 	size_t n = arg_stack.top;
 	for (size_t i = 0; i < n; ++i) {
 		lst = _cons(arg_stack.stk[i], lst);
 	}
 	arg_stack.top = 0;
+	return lst;
+}
+
+scm_value
+prim_list(UNUSED_ATTR scm_value self)
+{
+	scm_assert(chk_args(1, 1), "arity error");
+	scm_value k = pop_arg();
+	push_arg(primop_list());
 	TAIL_CALL(k);
 }
 
@@ -998,6 +1370,9 @@ make_vector(u32 len)
 	vec = GET_PTR(value);
 	vec->fref = 0;
 	vec->len = len;
+	for (u32 i = 0; i < len; ++i) {
+		vec->elems[i] = SCM_VOID;
+	}
 	return (NB_VECTOR << 48)|value;
 }
 
@@ -1087,7 +1462,7 @@ primop_vector_ref(void)
 	Vector *vec = GET_PTR(v);
 	u32 idx = GET_INTEGRAL(i);
 	scm_assert(idx < vec->len, "error index out of bounds");
-	return make_int(vec->elems[idx]);
+	return vec->elems[idx];
 }
 
 scm_value
@@ -1105,12 +1480,12 @@ primop_vector_set(void)
 	scm_value v = pop_arg();
 	scm_value i = pop_arg();
 	scm_value x = pop_arg();
-	scm_assert(BYTEVECTOR_P(v), "type error, expected <bytevector>");
+	scm_assert(VECTOR_P(v), "type error, expected <vector>");
 	scm_assert(INTEGER_P(i), "type error, expected <integer>");
 	Vector *vec = GET_PTR(v);
 	u32 idx = GET_INTEGRAL(i);
 	scm_assert(idx < vec->len, "error index out of bounds");
-	vec->elems[idx] = x;
+	write_barrier(v, &vec->elems[idx], x);
 	return SCM_VOID;
 }
 
@@ -1846,18 +2221,23 @@ prim_call_with_values(UNUSED_ATTR scm_value self)
 	TAIL_CALL(producer);
 }
 
-static inline void
+static void
 push_list_args(scm_value lst)
-{
-	if (NULL_P(lst)) {
-		return;
-	} else if (PAIR_P(lst)) {
-		Pair *p = GET_PTR(lst);
-		push_list_args(p->cdr);
-		push_arg(p->car);
-	} else {
-		scm_assert(0, "type error expected <pair>");
+{ /* Push the elements of lst so that its first element ends up on
+   * top. Lists may be millions of elements long, so this is a loop
+   * over the list and not a recursion on the C stack.
+   */
+	size_t n = 0;
+	for (scm_value l = lst; !NULL_P(l); l = ((Pair *)GET_PTR(l))->cdr) {
+		scm_assert(PAIR_P(l), "type error expected <pair>");
+		n++;
+	}
+	scm_assert(n <= arg_stack.len - arg_stack.top, "ARG STACK OVERFLOW");
+	size_t i = arg_stack.top + n;
+	for (scm_value l = lst; !NULL_P(l); l = ((Pair *)GET_PTR(l))->cdr) {
+		arg_stack.stk[--i] = ((Pair *)GET_PTR(l))->car;
 	}
+	arg_stack.top += n;
 }
 
 scm_value
@@ -1892,7 +2272,7 @@ primop_add(void)
 		sum = make_int(0);
 	} break;
 	case 1: {
-		sum = make_int(pop_arg());
+		sum = addxx(make_int(0), pop_arg());
 	} break;
 	case 2: {
 		scm_value x = pop_arg();
@@ -1978,7 +2358,7 @@ primop_mul(void)
 		total = make_int(1);
 	} break;
 	case 1: {
-		total = make_int(pop_arg());
+		total = mulxx(make_int(1), pop_arg());
 	} break;
 	case 2: {
 		scm_value x = pop_arg();
@@ -2034,6 +2414,191 @@ prim_div(UNUSED_ATTR scm_value self)
 	TAIL_CALL(k);
 }
 
+scm_value
+primop_idiv(void)
+{
+	scm_assert(chk_args(1, 1), "arity error");
+	scm_value fst = make_int(1);
+	if (arg_stack.top > 1) {
+		fst = pop_arg();
+	}
+	f64 d = get_float(divxx(fst, primop_mul()));
+	i64 q = (i64)d;
+	return make_int(q > d ? q - 1 : q);
+}
+
+scm_value
+prim_idiv(UNUSED_ATTR scm_value self)
+{
+	scm_value k = pop_arg();
+	push_arg(primop_idiv());
+	TAIL_CALL(k);
+}
+
+static i64
+pop_integer(void)
+{
+	scm_value x = pop_arg();
+	scm_assert(INTEGER_P(x), "type error expected <integer>");
+	return GET_INTEGRAL(x);
+}
+
+scm_value
+primop_mod(void)
+{
+	scm_assert(chk_args(2, 0), "arity error");
+	i64 x = pop_integer();
+	i64 y = pop_integer();
+	scm_assert(y != 0, "error division by zero");
+	return make_int(x % y);
+}
+
+scm_value
+prim_mod(UNUSED_ATTR scm_value self)
+{
+	scm_value k = pop_arg();
+	push_arg(primop_mod());
+	TAIL_CALL(k);
+}
+
+scm_value
+primop_bitwise_and(void)
+{
+	scm_assert(chk_args(2, 0), "arity error");
+	i64 x = pop_integer();
+	i64 y = pop_integer();
+	return make_int(x & y);
+}
+
+scm_value
+prim_bitwise_and(UNUSED_ATTR scm_value self)
+{
+	scm_value k = pop_arg();
+	push_arg(primop_bitwise_and());
+	TAIL_CALL(k);
+}
+
+scm_value
+primop_bitwise_ior(void)
+{
+	scm_assert(chk_args(2, 0), "arity error");
+	i64 x = pop_integer();
+	i64 y = pop_integer();
+	return make_int(x | y);
+}
+
+scm_value
+prim_bitwise_ior(UNUSED_ATTR scm_value self)
+{
+	scm_value k = pop_arg();
+	push_arg(primop_bitwise_ior());
+	TAIL_CALL(k);
+}
+
+scm_value
+primop_bitwise_xor(void)
+{
+	scm_assert(chk_args(2, 0), "arity error");
+	i64 x = pop_integer();
+	i64 y = pop_integer();
+	return make_int(x ^ y);
+}
+
+scm_value
+prim_bitwise_xor(UNUSED_ATTR scm_value self)
+{
+	scm_value k = pop_arg();
+	push_arg(primop_bitwise_xor());
+	TAIL_CALL(k);
+}
+
+scm_value
+primop_bitwise_eqv(void)
+{
+	scm_assert(chk_args(2, 0), "arity error");
+	i64 x = pop_integer();
+	i64 y = pop_integer();
+	return make_int(~(x ^ y));
+}
+
+scm_value
+prim_bitwise_eqv(UNUSED_ATTR scm_value self)
+{
+	scm_value k = pop_arg();
+	push_arg(primop_bitwise_eqv());
+	TAIL_CALL(k);
+}
+
+scm_value
+primop_bitwise_nor(void)
+{
+	scm_assert(chk_args(2, 0), "arity error");
+	i64 x = pop_integer();
+	i64 y = pop_integer();
+	return make_int(~(x | y));
+}
+
+scm_value
+prim_bitwise_nor(UNUSED_ATTR scm_value self)
+{
+	scm_value k = pop_arg();
+	push_arg(primop_bitwise_nor());
+	TAIL_CALL(k);
+}
+
+scm_value
+primop_bitwise_nand(void)
+{
+	scm_assert(chk_args(2, 0), "arity error");
+	i64 x = pop_integer();
+	i64 y = pop_integer();
+	return make_int(~(x & y));
+}
+
+scm_value
+prim_bitwise_nand(UNUSED_ATTR scm_value self)
+{
+	scm_value k = pop_arg();
+	push_arg(primop_bitwise_nand());
+	TAIL_CALL(k);
+}
+
+scm_value
+primop_bitwise_not(void)
+{
+	scm_assert(chk_args(1, 0), "arity error");
+	return make_int(~pop_integer());
+}
+
+scm_value
+prim_bitwise_not(UNUSED_ATTR scm_value self)
+{
+	scm_value k = pop_arg();
+	push_arg(primop_bitwise_not());
+	TAIL_CALL(k);
+}
+
+scm_value
+primop_arithmetic_shift(void)
+{
+	scm_assert(chk_args(2, 0), "arity error");
+	i64 i = pop_integer();
+	i64 c = pop_integer();
+	if (c >= 0) {
+		scm_assert(c < 32 || i == 0, "bigint unimplemented");
+		return make_int(i == 0 ? 0 : i * ((i64)1 << c));
+	}
+	return make_int(c <= -32 ? (i < 0 ? -1 : 0) : i >> -c);
+}
+
+scm_value
+prim_arithmetic_shift(UNUSED_ATTR scm_value self)
+{
+	scm_value k = pop_arg();
+	push_arg(primop_arithmetic_shift());
+	TAIL_CALL(k);
+}
+
 scm_value
 primop_num_eq(void)
 {
@@ -2245,7 +2810,7 @@ make_string(size_t len, int wc, int ro)
 	return (NB_STRING << 48)|value;
 }
 
-static inline void string_set(String *s, size_t i, scm_wchar ch);
+static inline void string_set(scm_value string, size_t i, scm_wchar ch);
 
 scm_value
 primop_string(void)
@@ -2265,7 +2830,7 @@ primop_string(void)
 	for (size_t i = 0; i < len; ++i) {
 		scm_value v = pop_arg();
 		scm_wchar ch = GET_INTEGRAL(v);
-		string_set(GET_PTR(string), i, ch);
+		string_set(string, i, ch);
 	}
 	return string;
 }
@@ -2297,7 +2862,7 @@ primop_make_string(void)
 	scm_value string = make_string(l, wc, 0);
 	if (CHAR_P(ch)) {
 		for (size_t i = 0; i < l; ++i) {
-			string_set(GET_PTR(string), i, GET_INTEGRAL(ch));
+			string_set(string, i, GET_INTEGRAL(ch));
 		}
 	}
 	return string;
@@ -2380,13 +2945,15 @@ sb_copy(struct shared_buf *sb, u32 off, u32 len)
 }
 
 static inline void
-string_set(String *s, size_t i, scm_wchar ch)
+string_set(scm_value string, size_t i, scm_wchar ch)
 {
+	String *s = GET_PTR(string);
 	scm_assert(s->buf->ro == 0, "Error string is read-only");
 	if (ch > CHAR_MAX && (s->buf->wc == 0)) {
-		s->buf = sb_narrow_to_wide(s->buf, s->off, s->len);
+		write_barrier_sb(string, &s->buf,
+						 sb_narrow_to_wide(s->buf, s->off, s->len));
 	} else if (s->buf->rc > 1) {
-		s->buf = sb_copy(s->buf, s->off, s->len);
+		write_barrier_sb(string, &s->buf, sb_copy(s->buf, s->off, s->len));
 	}
 	if (s->buf->wc) {
 		scm_wchar *c = sb_ref(s->buf, s->off, i);
@@ -2458,7 +3025,7 @@ primop_string_set(void)
 	scm_wchar c = GET_INTEGRAL(ch);
 	scm_assert(i >= 0, "value error, index expected to be non-negative integer");
 	scm_assert(i < s->len, "value error, index out of bounds");
-	string_set(s, i, c);
+	string_set(str, i, c);
 	return SCM_VOID;
 }
 
@@ -3075,6 +3642,15 @@ scm_runtime_load_dynamic(void)
 	return primop_vector();
 }
 
+static void
+bounce(scm_value cc)
+{ // only leaves through longjmp(exit_point)
+	for (;;) {
+		call_depth = 0;
+		cc = procedure_fn(cc)(cc);
+	}
+}
+
 int
 trampoline(scm_value cc)
 {
@@ -3086,13 +3662,14 @@ trampoline(scm_value cc)
 	push_arg(module);
 	push_arg(kexit);
 	int ext = setjmp(exit_point);
-	while (ext == 0) {
-		cc = procedure_fn(cc)(cc);
+	if (ext == 0) {
+		bounce(cc);
 	}
 	printf("\n====================================\n");
 	printf("DEBUG:\n");
 	printf("bytes-allocated = %zu\n", bytes_allocated);
-	printf("bytes-used = %zu\n", heap_working->idx);
+	printf("bytes-used = %zu\n", heap_working->idx + heap_nursery->idx);
 	printf("gc-cycles = %zu\n", gc_cycles);
+	printf("minor-gc-cycles = %zu\n", gc_minor_cycles);
 	return ext;
 }
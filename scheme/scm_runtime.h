@@ -2,12 +2,14 @@
 #define SCM_RUNTIME_H_
 
 #define scm_assert(p, msg) _scm_assert(p, msg, __func__)
+#define SCM_CALL_DEPTH 128
 
 scm_value scm_runtime_load_dynamic(void);
 scm_value scm_module_lookup(char *name, scm_value module);
 int trampoline(scm_value cc);
 scm_value _tail_call(scm_value proc);
 void scm_heap_init(void);
+int scm_gc_pending(void);
 void scm_chk_heap(scm_value *cc);
 size_t mem_align_offset(size_t addr);
 size_t scm_heap_alloc(size_t sz);
@@ -29,12 +31,17 @@ klabel_t procedure_fn(scm_value value);
 klabel_t function_fn(scm_value value);
 klabel_t closure_fn(scm_value value);
 scm_value closure_ref(scm_value clos, i32 idx);
+void closure_set(scm_value clos, i32 idx, scm_value value);
 void push_arg(scm_value x);
 void push_ref(scm_value x);
+scm_value scm_ref(scm_value x);
+int scm_code_p(scm_value proc, klabel_t code);
+int scm_direct_call_p(scm_value proc, klabel_t code);
 scm_value pop_arg(void);
 scm_value make_box(void);
 void box_set(scm_value b, scm_value value);
 scm_value box_ref(scm_value b);
+void scm_write_barrier(scm_value obj, scm_value *slot, scm_value value);
 scm_value make_int(i64 x);
 scm_value make_char(i64 x);
 scm_value make_float(f64 x);
@@ -50,6 +57,7 @@ scm_value primop_set_car(void);
 scm_value prim_set_car(scm_value self);
 scm_value primop_set_cdr(void);
 scm_value prim_set_cdr(scm_value self);
+scm_value primop_list(void);
 scm_value prim_list(scm_value self);
 scm_value prim_list_p(scm_value self);
 scm_value prim_length(scm_value self);
@@ -121,6 +129,26 @@ scm_value primop_mul(void);
 scm_value prim_mul(scm_value self);    // (* x ...)
 scm_value primop_div(void);
 scm_value prim_div(scm_value self);    // (/ x y ...)
+scm_value primop_idiv(void);
+scm_value prim_idiv(scm_value self);   // (div x y ...)
+scm_value primop_mod(void);
+scm_value prim_mod(scm_value self);    // (% x y)
+scm_value primop_bitwise_and(void);
+scm_value prim_bitwise_and(scm_value self);
+scm_value primop_bitwise_ior(void);
+scm_value prim_bitwise_ior(scm_value self);
+scm_value primop_bitwise_xor(void);
+scm_value prim_bitwise_xor(scm_value self);
+scm_value primop_bitwise_eqv(void);
+scm_value prim_bitwise_eqv(scm_value self);
+scm_value primop_bitwise_nor(void);
+scm_value prim_bitwise_nor(scm_value self);
+scm_value primop_bitwise_nand(void);
+scm_value prim_bitwise_nand(scm_value self);
+scm_value primop_bitwise_not(void);
+scm_value prim_bitwise_not(scm_value self);
+scm_value primop_arithmetic_shift(void);
+scm_value prim_arithmetic_shift(scm_value self);
 scm_value primop_num_eq(void);
 scm_value prim_num_eq(scm_value self); // (= x ...)
 scm_value primop_less(void);
@@ -172,4 +200,193 @@ scm_value primop_newline(void);
 scm_value prim_newline(scm_value self);
 void print_stk(void);
 
+/* Fast paths the C backend emits in place of a primop call. They
+ * handle fixnums, pairs and vectors inline and otherwise push the
+ * arguments and call the primop, which does the checking.
+ */
+extern Mem_Pool *heap_nursery;
+extern Mem_Pool *heap_working;
+
+#define SCM_REF(x) (BOX_P(x) ? box_ref(x) : (x))
+#define FIXNUM2_P(x, y) (INTEGER_P(x) && INTEGER_P(y))
+
+static inline scm_value
+slow_primop2(scm_value (*primop)(void), scm_value x, scm_value y)
+{
+	push_arg(y);
+	push_arg(x);
+	return primop();
+}
+
+static inline scm_value
+fast_add(scm_value x, scm_value y)
+{
+	if (FIXNUM2_P(x, y)) {
+		i64 r = (i64)GET_INTEGRAL(x) + GET_INTEGRAL(y);
+		if (r >= INT32_MIN && r <= INT32_MAX) {
+			return TAG_VALUE(NB_INT, (u32)r);
+		}
+	}
+	return slow_primop2(primop_add, x, y);
+}
+
+static inline scm_value
+fast_sub(scm_value x, scm_value y)
+{
+	if (FIXNUM2_P(x, y)) {
+		i64 r = (i64)GET_INTEGRAL(x) - GET_INTEGRAL(y);
+		if (r >= INT32_MIN && r <= INT32_MAX) {
+			return TAG_VALUE(NB_INT, (u32)r);
+		}
+	}
+	return slow_primop2(primop_sub, x, y);
+}
+
+static inline scm_value
+fast_num_eq(scm_value x, scm_value y)
+{
+	if (FIXNUM2_P(x, y)) {
+		return ITOBOOL(x == y);
+	}
+	return slow_primop2(primop_num_eq, x, y);
+}
+
+static inline scm_value
+fast_less(scm_value x, scm_value y)
+{
+	if (FIXNUM2_P(x, y)) {
+		return ITOBOOL(GET_INTEGRAL(x) < GET_INTEGRAL(y));
+	}
+	return slow_primop2(primop_less, x, y);
+}
+
+static inline scm_value
+fast_gr(scm_value x, scm_value y)
+{
+	if (FIXNUM2_P(x, y)) {
+		return ITOBOOL(GET_INTEGRAL(x) > GET_INTEGRAL(y));
+	}
+	return slow_primop2(primop_gr, x, y);
+}
+
+static inline scm_value
+fast_leq(scm_value x, scm_value y)
+{
+	if (FIXNUM2_P(x, y)) {
+		return ITOBOOL(GET_INTEGRAL(x) <= GET_INTEGRAL(y));
+	}
+	return slow_primop2(primop_leq, x, y);
+}
+
+static inline scm_value
+fast_geq(scm_value x, scm_value y)
+{
+	if (FIXNUM2_P(x, y)) {
+		return ITOBOOL(GET_INTEGRAL(x) >= GET_INTEGRAL(y));
+	}
+	return slow_primop2(primop_geq, x, y);
+}
+
+static inline scm_value
+fast_eq(scm_value x, scm_value y)
+{
+	if (x == y) {
+		return SCM_TRUE;
+	}
+	if (SYMBOL_P(x) && SYMBOL_P(y)) {
+		return slow_primop2(primop_eq, x, y);
+	}
+	return SCM_FALSE;
+}
+
+static inline scm_value
+fast_car(scm_value p)
+{
+	if (PAIR_P(p)) {
+		return ((Pair *)GET_PTR(p))->car;
+	}
+	push_arg(p);
+	return primop_car();
+}
+
+static inline scm_value
+fast_cdr(scm_value p)
+{
+	if (PAIR_P(p)) {
+		return ((Pair *)GET_PTR(p))->cdr;
+	}
+	push_arg(p);
+	return primop_cdr();
+}
+
+static inline scm_value
+fast_vector_ref(scm_value v, scm_value i)
+{
+	if (VECTOR_P(v) && INTEGER_P(i)) {
+		Vector *vec = GET_PTR(v);
+		if ((u32)GET_INTEGRAL(i) < vec->len) {
+			return vec->elems[(u32)GET_INTEGRAL(i)];
+		}
+	}
+	return slow_primop2(primop_vector_ref, v, i);
+}
+
+static inline scm_value
+fast_vector_length(scm_value v)
+{
+	if (VECTOR_P(v)) {
+		return make_int(((Vector *)GET_PTR(v))->len);
+	}
+	push_arg(v);
+	return primop_vector_len();
+}
+
+static inline scm_value
+fast_vector_set(scm_value v, scm_value i, scm_value x)
+{
+	if (VECTOR_P(v) && INTEGER_P(i)) {
+		Vector *vec = GET_PTR(v);
+		if ((u32)GET_INTEGRAL(i) < vec->len) {
+			scm_write_barrier(v, &vec->elems[(u32)GET_INTEGRAL(i)], x);
+			return SCM_VOID;
+		}
+	}
+	push_arg(x);
+	return slow_primop2(primop_vector_set, v, i);
+}
+
+/* Conversions for the arithmetic the C backend emits on numbers whose
+ * type it inferred, these keep the value in an i64 or f64 local and
+ * only box it when it is used as a scm_value.
+ */
+static inline scm_value
+box_fixnum(i64 x)
+{
+	return TAG_VALUE(NB_INT, (u32)x);
+}
+
+static inline scm_value
+box_flonum(f64 x)
+{
+	union f2u n = {.f = x};
+	return n.u;
+}
+
+static inline f64
+unbox_flonum(scm_value x)
+{
+	union f2u n = {.u = x};
+	return n.f;
+}
+
+static inline f64
+to_flonum(scm_value x)
+{
+	if (INTEGER_P(x)) {
+		return GET_INTEGRAL(x);
+	}
+	scm_assert(FLOAT_P(x), "Type error");
+	return unbox_flonum(x);
+}
+
 #endif /* SCM_RUNTIME_H_ */
@@ -31,10 +31,13 @@
 #define TYPEOF(value) ((value) >> 48)
 #define GET_FN_PTR(value) ((klabel_t)((value) & ((1LU << 48) - 1)))
 #define GET_INTEGRAL(value)  ((i32)((value) & ((1LU << 32) - 1)))
+#define OLD_SPACE_BIT (1LU << 32)
+#define OLD_P(value) ((value) & OLD_SPACE_BIT)
 #define GET_WORKING_PTR(value) \
-	((void *)((u32)GET_INTEGRAL(value) + heap_working->buf))
-#define GET_FREE_PTR(value) \
-	((void *)((u32)GET_INTEGRAL(value) + heap_free->buf))
+	((void *)((u32)GET_INTEGRAL(value) \
+			  + (OLD_P(value) ? heap_working->buf : heap_nursery->buf)))
+#define GET_TO_SPACE_PTR(value) \
+	((void *)((u32)GET_INTEGRAL(value) + heap_to_space->buf))
 #define GET_PTR(value) GET_WORKING_PTR(value)
 #define NULL_P(value) ((value) == SCM_NULL)
 #define VOID_P(value) ((value) == SCM_VOID)
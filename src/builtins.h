@@ -7,12 +7,17 @@
  * Include once in sly_compile.c
  */
 
+/* fn is either a cfunc or a cfunc_argv */
+#define MAKE_CCLOSURE(fn, nargs, has_vargs)						\
+	_Generic((fn),												\
+			 cfunc: make_cclosure,								\
+			 cfunc_argv: make_cclosure_argv)(ss, fn, nargs, has_vargs)
 #define ADD_BUILTIN(name, fn, nargs, has_vargs)							\
 	do {																\
 		sym = make_symbol(ss, name, strlen(name));						\
 		dictionary_set(ss, symtable, sym, st_prop.v);					\
 		sly_value entry = cons(ss, sym,									\
-							   make_cclosure(ss, fn, nargs, has_vargs)); \
+							   MAKE_CCLOSURE(fn, nargs, has_vargs));	\
 		dictionary_set(ss, cc->globals, car(entry), cdr(entry));		\
 		cc->builtins = cons(ss, entry, cc->builtins);					\
 	} while (0)
@@ -28,45 +33,37 @@
 
 
 static sly_value
-cadd(Sly_State *ss, sly_value args)
+cadd(Sly_State *ss, sly_value *args, size_t nargs)
 {
-	sly_value vargs = vector_ref(args, 0);
 	sly_value total = make_int(ss, 0);
-	while (!null_p(vargs)) {
-		total = sly_add(ss, total, car(vargs));
-		vargs = cdr(vargs);
+	for (size_t i = 0; i < nargs; ++i) {
+		total = sly_add(ss, total, args[i]);
 	}
 	return total;
 }
 
 static sly_value
-csub(Sly_State *ss, sly_value args)
+csub(Sly_State *ss, sly_value *args, size_t nargs)
 {
-	sly_value vargs = vector_ref(args, 0);
 	sly_value total = make_int(ss, 0);
-	if (null_p(vargs)) {
+	if (nargs == 0) {
 		return total;
 	}
-	sly_value head = car(vargs);
-	vargs = cdr(vargs);
-	if (null_p(vargs)) {
-		return sly_sub(ss, total, head);
+	if (nargs == 1) {
+		return sly_sub(ss, total, args[0]);
 	}
-	while (!null_p(vargs)) {
-		total = sly_add(ss, total, car(vargs));
-		vargs = cdr(vargs);
+	for (size_t i = 1; i < nargs; ++i) {
+		total = sly_add(ss, total, args[i]);
 	}
-	return sly_sub(ss, head, total);
+	return sly_sub(ss, args[0], total);
 }
 
 static sly_value
-cmul(Sly_State *ss, sly_value args)
+cmul(Sly_State *ss, sly_value *args, size_t nargs)
 {
-	sly_value vargs = vector_ref(args, 0);
 	sly_value total = make_int(ss, 1);
-	while (!null_p(vargs)) {
-		total = sly_mul(ss, total, car(vargs));
-		vargs = cdr(vargs);
+	for (size_t i = 0; i < nargs; ++i) {
+		total = sly_mul(ss, total, args[i]);
 	}
 	return total;
 }
@@ -225,10 +222,11 @@ cchar_to_int(Sly_State *ss, sly_value args)
 }
 
 static sly_value
-cnot(Sly_State *ss, sly_value args)
+cnot(Sly_State *ss, sly_value *args, size_t nargs)
 {
 	UNUSED(ss);
-	if (vector_ref(args, 0) == SLY_FALSE) {
+	UNUSED(nargs);
+	if (args[0] == SLY_FALSE) {
 		return SLY_TRUE;
 	} else {
 		return SLY_FALSE;
@@ -236,17 +234,19 @@ cnot(Sly_State *ss, sly_value args)
 }
 
 static sly_value
-cnull_p(Sly_State *ss, sly_value args)
+cnull_p(Sly_State *ss, sly_value *args, size_t nargs)
 {
 	UNUSED(ss);
-	return ctobool(null_p(vector_ref(args, 0)));
+	UNUSED(nargs);
+	return ctobool(null_p(args[0]));
 }
 
 static sly_value
-cpair_p(Sly_State *ss, sly_value args)
+cpair_p(Sly_State *ss, sly_value *args, size_t nargs)
 {
 	UNUSED(ss);
-	return ctobool(pair_p(vector_ref(args, 0)));
+	UNUSED(nargs);
+	return ctobool(pair_p(args[0]));
 }
 
 static sly_value
@@ -477,21 +477,19 @@ csymbol_to_string(Sly_State *ss, sly_value args)
 }
 
 static sly_value
-ceq_p(Sly_State *ss, sly_value args)
+ceq_p(Sly_State *ss, sly_value *args, size_t nargs)
 {
 	UNUSED(ss);
-	sly_value v1 = vector_ref(args, 0);
-	sly_value v2 = vector_ref(args, 1);
-	return ctobool(sly_eq(v1, v2));
+	UNUSED(nargs);
+	return ctobool(sly_eq(args[0], args[1]));
 }
 
 static sly_value
-ceqv_p(Sly_State *ss, sly_value args)
+ceqv_p(Sly_State *ss, sly_value *args, size_t nargs)
 {
 	UNUSED(ss);
-	sly_value v1 = vector_ref(args, 0);
-	sly_value v2 = vector_ref(args, 1);
-	return ctobool(sly_eqv(v1, v2));
+	UNUSED(nargs);
+	return ctobool(sly_eqv(args[0], args[1]));
 }
 
 static sly_value
@@ -506,21 +504,22 @@ cequal_p(Sly_State *ss, sly_value args)
 static sly_value
 cnum_noteq(Sly_State *ss, sly_value args)
 {
-	vector_set(args, 0, cnum_eq(ss, args));
-	return cnot(ss, args);
+	UNUSED(ss);
+	return ctobool(!sly_num_eq(vector_ref(args, 0), vector_ref(args, 1)));
 }
 
 static sly_value
-ccons(Sly_State *ss, sly_value args)
+ccons(Sly_State *ss, sly_value *args, size_t nargs)
 {
-	UNUSED(ss);
-	return cons(ss, vector_ref(args, 0), vector_ref(args, 1));
+	UNUSED(nargs);
+	return cons(ss, args[0], args[1]);
 }
 
 static sly_value
-ccar(Sly_State *ss, sly_value args)
+ccar(Sly_State *ss, sly_value *args, size_t nargs)
 {
-	sly_value p = vector_ref(args, 0);
+	UNUSED(nargs);
+	sly_value p = args[0];
 	if (!pair_p(p)) {
 		printf("Error (ccar) not a pair\n");
 		sly_displayln(p);
@@ -530,9 +529,10 @@ ccar(Sly_State *ss, sly_value args)
 }
 
 static sly_value
-ccdr(Sly_State *ss, sly_value args)
+ccdr(Sly_State *ss, sly_value *args, size_t nargs)
 {
-	sly_value p = vector_ref(args, 0);
+	UNUSED(nargs);
+	sly_value p = args[0];
 	if (!pair_p(p)) {
 		printf("Error (ccdr) not a pair\n");
 		vm_bt(ss->frame);
@@ -669,30 +669,27 @@ cmake_vector(Sly_State *ss, sly_value args)
 }
 
 static sly_value
-cvector_ref(Sly_State *ss, sly_value args)
+cvector_ref(Sly_State *ss, sly_value *args, size_t nargs)
 {
 	UNUSED(ss);
-	sly_value vec = vector_ref(args, 0);
-	sly_value idx = vector_ref(args, 1);
-	return vector_ref(vec, get_int(idx));
+	UNUSED(nargs);
+	return vector_ref(args[0], get_int(args[1]));
 }
 
 static sly_value
-cvector_set(Sly_State *ss, sly_value args)
+cvector_set(Sly_State *ss, sly_value *args, size_t nargs)
 {
 	UNUSED(ss);
-	sly_value vec = vector_ref(args, 0);
-	sly_value idx = vector_ref(args, 1);
-	sly_value val = vector_ref(args, 2);
-	vector_set(vec, get_int(idx), val);
-	return val;
+	UNUSED(nargs);
+	vector_set(args[0], get_int(args[1]), args[2]);
+	return args[2];
 }
 
 static sly_value
-cvector_length(Sly_State *ss, sly_value args)
+cvector_length(Sly_State *ss, sly_value *args, size_t nargs)
 {
-	sly_value vec = vector_ref(args, 0);
-	return make_int(ss, vector_len(vec));
+	UNUSED(nargs);
+	return make_int(ss, vector_len(args[0]));
 }
 
 static sly_value
@@ -773,11 +770,7 @@ cdictionary_ref(Sly_State *ss, sly_value args)
 	if (!null_p(vargs)) {
 		dv = car(vargs);
 	}
-	sly_value entry = dictionary_entry_ref(dict, key);
-	if (slot_is_free(entry)) {
-		return dv;
-	}
-	return cdr(entry);
+	return dictionary_ref(dict, key, dv);
 }
 
 static sly_value
@@ -794,9 +787,7 @@ static sly_value
 cdictionary_length(Sly_State *ss, sly_value args)
 {
 	sly_value dict = vector_ref(args, 0);
-	sly_assert(dictionary_p(dict), "Type Error expected dictionary");
-	vector *v = GET_PTR(dict);
-	return make_int(ss, v->len);
+	return make_int(ss, dictionary_len(dict));
 }
 
 
@@ -806,7 +797,7 @@ cdictionary_has_key(Sly_State *ss, sly_value args)
 	UNUSED(ss);
 	sly_value dict = vector_ref(args, 0);
 	sly_value key = vector_ref(args, 1);
-	if (slot_is_free(dictionary_entry_ref(dict, key))) {
+	if (!dictionary_has(dict, key)) {
 		return SLY_FALSE;
 	} else {
 		return SLY_TRUE;
@@ -1232,7 +1223,7 @@ init_builtins(Sly_State *ss)
 	union symbol_properties st_prop = {0};
 	sly_value sym;
 	st_prop.p.type = sym_global;
-	cc->globals = make_dictionary(ss);
+	cc->globals = make_cell_dictionary(ss);
 	cc->builtins = SLY_NULL;
 	ADD_BUILTIN("+", cadd, 0, 1);
 	ADD_BUILTIN("-", csub, 0, 1);
@@ -1254,6 +1245,11 @@ init_builtins(Sly_State *ss)
 	ADD_BUILTIN("<=", cnum_leq, 2, 0);
 	ADD_BUILTIN(">=", cnum_geq, 2, 0);
 	ADD_BUILTIN("/=", cnum_noteq, 2, 0);
+	for (int i = 0; i < VMOP_COUNT; ++i) {
+		sym = make_symbol(ss, primop_info[i].name, strlen(primop_info[i].name));
+		primop_symbols[i] = sym;
+		cc->primops[i] = dictionary_ref(cc->globals, sym, SLY_VOID);
+	}
 	ADD_BUILTIN("not", cnot, 1, 0);
 	ADD_BUILTIN("integer->char", cint_to_char, 1, 0);
 	ADD_BUILTIN("char->integer", cchar_to_int, 1, 0);
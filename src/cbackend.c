@@ -1,11 +1,15 @@
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <gc.h>
 #include <ctype.h>
 #include <dlfcn.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "sly_types.h"
 #include "cps.h"
+#include "image.h"
 #include "cbackend.h"
 
 static const char closure_tmpl[] = "scm_value %s%s(scm_value self) // %s\n{\n";
@@ -30,6 +34,20 @@ static const char main_tmpl[] =
 	"}\n";
 
 static size_t const_idx = 0;
+/* The kproc whose direct entry is being emitted, calls to it from
+ * inside that C function become a jump back to its top. */
+static sly_value loop_kproc = SLY_VOID;
+static int loop_used = 0;
+/* Loop invariant variables of each kproc (see cps_collect_loop_invariants)
+ * and those of loop_kproc. Each is computed once per entry into the
+ * loop and kept in <var>_h. */
+static sly_value loop_invariants = SLY_VOID;
+static sly_value loop_hoisted = SLY_NULL;
+/* Types of the variables (see cps_infer_types), and the variables of
+ * the C function being emitted that also have an unboxed copy in
+ * <var>_i (fixnum) or <var>_d (flonum). */
+static sly_value var_types = SLY_VOID;
+static sly_value typed_locals = SLY_VOID;
 
 static char *
 intern_constant(Sly_State *ss, sly_value constants, sly_value value)
@@ -62,8 +80,8 @@ intern_constant(Sly_State *ss, sly_value constants, sly_value value)
 		return buf;
 	}
 	size_t idx;
-	sly_value entry = dictionary_entry_ref(constants, value);
-	if (slot_is_free(entry)) {
+	sly_value entry;
+	if (!dictionary_lookup(constants, value, &entry)) {
 		idx = const_idx++;
 		if (pair_p(value)) {
 			sly_value lst = value;
@@ -80,7 +98,7 @@ intern_constant(Sly_State *ss, sly_value constants, sly_value value)
 		}
 		dictionary_set(ss, constants, value, (sly_value)idx);
 	} else {
-		idx = (size_t)cdr(entry);
+		idx = (size_t)entry;
 	}
 	snprintf(buf, sizeof(buf), "interned[%zu]", idx);
 	return buf;
@@ -153,10 +171,56 @@ emit_c_unpack_self(sly_value lst, int i, FILE *file)
 			symbol_to_cid(elem), i);
 }
 
+/* How each primop is emitted. A call with exactly nargs arguments
+ * goes through the inline fast path from scm_runtime.h when there is
+ * one, anything else pushes the arguments and calls the slow primop.
+ * fn is the procedure used when the primop is taken as a value.
+ */
+static struct c_primop {
+	char *fast;
+	size_t nargs;
+	char *slow;
+	char *fn;
+} c_primops[] = {
+	[tt_prim_void]			= {NULL, 0, NULL, "prim_void"},
+	[tt_prim_add]			= {"fast_add", 2, "primop_add", "prim_add"},
+	[tt_prim_sub]			= {"fast_sub", 2, "primop_sub", "prim_sub"},
+	[tt_prim_mul]			= {NULL, 0, "primop_mul", "prim_mul"},
+	[tt_prim_div]			= {NULL, 0, "primop_div", "prim_div"},
+	[tt_prim_idiv]			= {NULL, 0, "primop_idiv", "prim_idiv"},
+	[tt_prim_mod]			= {NULL, 0, "primop_mod", "prim_mod"},
+	[tt_prim_bw_and]		= {NULL, 0, "primop_bitwise_and", "prim_bitwise_and"},
+	[tt_prim_bw_ior]		= {NULL, 0, "primop_bitwise_ior", "prim_bitwise_ior"},
+	[tt_prim_bw_xor]		= {NULL, 0, "primop_bitwise_xor", "prim_bitwise_xor"},
+	[tt_prim_bw_eqv]		= {NULL, 0, "primop_bitwise_eqv", "prim_bitwise_eqv"},
+	[tt_prim_bw_nor]		= {NULL, 0, "primop_bitwise_nor", "prim_bitwise_nor"},
+	[tt_prim_bw_nand]		= {NULL, 0, "primop_bitwise_nand", "prim_bitwise_nand"},
+	[tt_prim_bw_not]		= {NULL, 0, "primop_bitwise_not", "prim_bitwise_not"},
+	[tt_prim_bw_shift]		= {NULL, 0, "primop_arithmetic_shift", "prim_arithmetic_shift"},
+	[tt_prim_eq]			= {"fast_eq", 2, "primop_eq", "prim_eq"},
+	[tt_prim_eqv]			= {NULL, 0, "primop_eqv", "prim_eqv"},
+	[tt_prim_equal]			= {NULL, 0, "primop_equal", "prim_equal"},
+	[tt_prim_num_eq]		= {"fast_num_eq", 2, "primop_num_eq", "prim_num_eq"},
+	[tt_prim_less]			= {"fast_less", 2, "primop_less", "prim_less"},
+	[tt_prim_gr]			= {"fast_gr", 2, "primop_gr", "prim_gr"},
+	[tt_prim_leq]			= {"fast_leq", 2, "primop_leq", "prim_leq"},
+	[tt_prim_geq]			= {"fast_geq", 2, "primop_geq", "prim_geq"},
+	[tt_prim_cons]			= {"_cons", 2, "primop_cons", "prim_cons"},
+	[tt_prim_car]			= {"fast_car", 1, "primop_car", "prim_car"},
+	[tt_prim_cdr]			= {"fast_cdr", 1, "primop_cdr", "prim_cdr"},
+	[tt_prim_list]			= {NULL, 0, "primop_list", "prim_list"},
+	[tt_prim_vector]		= {NULL, 0, "primop_vector", "prim_vector"},
+	[tt_prim_vector_ref]	= {"fast_vector_ref", 2, "primop_vector_ref", "prim_vector_ref"},
+	[tt_prim_vector_set]	= {"fast_vector_set", 3, "primop_vector_set", "prim_vector_set"},
+	[tt_prim_vector_length]	= {"fast_vector_length", 1, "primop_vector_len", "prim_vector_len"},
+};
+
 static char *
 emit_c_visit_expr(Sly_State *ss, CPS_Expr *expr, sly_value graph,
-				  sly_value free_vars, sly_value constants, FILE *file)
+				  sly_value free_vars, sly_value constants, sly_value unboxed,
+				  FILE *file)
 {
+	static char buf[0x400];
 	switch (expr->type) {
 	case tt_cps_call: {
 		sly_assert(0, "unimplemented");
@@ -171,61 +235,42 @@ emit_c_visit_expr(Sly_State *ss, CPS_Expr *expr, sly_value graph,
 	case tt_cps_proc: {
 		sly_value code = expr->u.proc.k;
 		sly_value vars = dictionary_ref(free_vars, code, SLY_NULL);
+		if (null_p(vars)) {
+			snprintf(buf, sizeof(buf), "make_function(%s)", symbol_to_cid(code));
+			return buf;
+		}
 		emit_c_push_list(SLY_VOID, vars, file);
 		fprintf(file, push_tmpl, "(scm_value)", symbol_to_cid(code));
 		return "make_closure()";
 	} break;
 	case tt_cps_prim: {
-		sly_assert(0, "unimplemented");
+		int op = primop_p(expr->u.prim.name);
+		sly_assert(op >= 0 && op < (int)ARR_LEN(c_primops), "invalid primop");
+		snprintf(buf, sizeof(buf), "make_function(%s)", c_primops[op].fn);
+		return buf;
 	} break;
 	case tt_cps_primcall: {
 		sly_value args = expr->u.primcall.args;
-		emit_c_push_refs(SLY_VOID, args, file);
-		switch (primop_p(expr->u.primcall.prim)) {
-		case tt_prim_void: sly_assert(0, "unimplemented"); break;
-		case tt_prim_add: {
-			return "primop_add()";
-		} break;
-		case tt_prim_sub: {
-			return "primop_sub()";
-		} break;
-		case tt_prim_mul: {
-			return "primop_mul()";
-		} break;
-		case tt_prim_div: {
-			return "primop_div()";
-		} break;
-		case tt_prim_idiv: sly_assert(0, "unimplemented"); break;
-		case tt_prim_mod: sly_assert(0, "unimplemented"); break;
-		case tt_prim_bw_and: sly_assert(0, "unimplemented"); break;
-		case tt_prim_bw_ior: sly_assert(0, "unimplemented"); break;
-		case tt_prim_bw_xor: sly_assert(0, "unimplemented"); break;
-		case tt_prim_bw_eqv: sly_assert(0, "unimplemented"); break;
-		case tt_prim_bw_nor: sly_assert(0, "unimplemented"); break;
-		case tt_prim_bw_nand: sly_assert(0, "unimplemented"); break;
-		case tt_prim_bw_not: sly_assert(0, "unimplemented"); break;
-		case tt_prim_bw_shift: sly_assert(0, "unimplemented"); break;
-		case tt_prim_eq: sly_assert(0, "unimplemented"); break;
-		case tt_prim_eqv: sly_assert(0, "unimplemented"); break;
-		case tt_prim_equal: sly_assert(0, "unimplemented"); break;
-		case tt_prim_num_eq: sly_assert(0, "unimplemented"); break;
-		case tt_prim_less: {
-			return "primop_less()";
-		} break;
-		case tt_prim_gr: sly_assert(0, "unimplemented"); break;
-		case tt_prim_leq: sly_assert(0, "unimplemented"); break;
-		case tt_prim_geq: sly_assert(0, "unimplemented"); break;
-		case tt_prim_cons: {
-			return "primop_cons()";
-		} break;
-		case tt_prim_car: sly_assert(0, "unimplemented"); break;
-		case tt_prim_cdr: sly_assert(0, "unimplemented"); break;
-		case tt_prim_list: sly_assert(0, "unimplemented"); break;
-		case tt_prim_vector: sly_assert(0, "unimplemented"); break;
-		case tt_prim_vector_ref: sly_assert(0, "unimplemented"); break;
-		case tt_prim_vector_set: sly_assert(0, "unimplemented"); break;
-		default: sly_assert(0, "invalid primop");
+		int op = primop_p(expr->u.primcall.prim);
+		sly_assert(op >= 0 && op < (int)ARR_LEN(c_primops), "invalid primop");
+		if (op == tt_prim_void) {
+			return "SCM_VOID";
+		}
+		struct c_primop *cp = &c_primops[op];
+		if (cp->fast && list_len(args) == cp->nargs) {
+			int n = snprintf(buf, sizeof(buf), "%s(", cp->fast);
+			while (!null_p(args)) {
+				n += snprintf(buf + n, sizeof(buf) - n, "SCM_REF(%s)%s",
+							  symbol_to_cid(car(args)),
+							  null_p(cdr(args)) ? ")" : ", ");
+				args = cdr(args);
+			}
+			sly_assert((size_t)n < sizeof(buf), "primcall too long");
+			return buf;
 		}
+		emit_c_push_refs(SLY_VOID, args, file);
+		snprintf(buf, sizeof(buf), "%s()", cp->slow);
+		return buf;
 	} break;
 	case tt_cps_values: {
 		sly_value args = list_reverse(ss, expr->u.values.args);
@@ -260,17 +305,31 @@ emit_c_visit_expr(Sly_State *ss, CPS_Expr *expr, sly_value graph,
 		sly_assert(0, "unimplemented");
 	} break;
 	case tt_cps_set: {
+		if (dictionary_has(unboxed, expr->u.set.var)) {
+			fprintf(file, "\t%s = %s;\n",
+					symbol_to_cid(expr->u.set.var),
+					symbol_to_cid(expr->u.set.val));
+			return NULL;
+		}
 		fprintf(file, "\tbox_set(%s, %s);\n",
 				symbol_to_cid(expr->u.set.var),
 				symbol_to_cid(expr->u.set.val));
 		return NULL;
 	} break;
 	case tt_cps_fix: {
+		/* Procedures that are never set! are bound directly instead
+		 * of through a box. Their closures start out with #<void> in
+		 * place of the other unboxed procedures of the group and are
+		 * patched once all of them exist. */
 		sly_value names = expr->u.fix.names;
 		sly_value procs = expr->u.fix.procs;
 		while (!null_p(names)) {
 			sly_value name = car(names);
-			fprintf(file, "\tscm_value %s = make_box();\n", symbol_to_cid(name));
+			if (dictionary_has(unboxed, name)) {
+				fprintf(file, "\tscm_value %s = SCM_VOID;\n", symbol_to_cid(name));
+			} else {
+				fprintf(file, "\tscm_value %s = make_box();\n", symbol_to_cid(name));
+			}
 			names = cdr(names);
 		}
 		names = expr->u.fix.names;
@@ -282,9 +341,40 @@ emit_c_visit_expr(Sly_State *ss, CPS_Expr *expr, sly_value graph,
 				CPS_Kont *kproc = cps_graph_ref(graph, code);
 				kproc->u.kproc.binding = name;
 				sly_value vars = dictionary_ref(free_vars, code, SLY_NULL);
-				emit_c_push_list(name, vars, file);
-				fprintf(file, push_tmpl, "(scm_value)", symbol_to_cid(code));
-				fprintf(file, "\tbox_set(%s, make_closure());\n", symbol_to_cid(name));
+				char *value = "make_closure()";
+				if (null_p(list_remove(ss, vars, name))) {
+					snprintf(buf, sizeof(buf), "make_function(%s)", symbol_to_cid(code));
+					value = buf;
+				} else {
+					emit_c_push_list(name, vars, file);
+					fprintf(file, push_tmpl, "(scm_value)", symbol_to_cid(code));
+				}
+				if (dictionary_has(unboxed, name)) {
+					fprintf(file, "\t%s = %s;\n", symbol_to_cid(name), value);
+				} else {
+					fprintf(file, "\tbox_set(%s, %s);\n", symbol_to_cid(name), value);
+				}
+			}
+			procs = cdr(procs);
+			names = cdr(names);
+		}
+		names = expr->u.fix.names;
+		procs = expr->u.fix.procs;
+		while (!null_p(procs)) {
+			CPS_Expr *p = GET_PTR(car(procs));
+			sly_value name = car(names);
+			if (p->type == tt_cps_proc
+				&& dictionary_has(unboxed, name)) {
+				sly_value vars = dictionary_ref(free_vars, p->u.proc.k, SLY_NULL);
+				vars = list_remove(ss, vars, name);
+				for (int i = 0; !null_p(vars); ++i, vars = cdr(vars)) {
+					sly_value var = car(vars);
+					if (list_member(var, expr->u.fix.names)
+						&& dictionary_has(unboxed, var)) {
+						fprintf(file, "\tclosure_set(%s, %d, %s);\n",
+								symbol_to_cid(name), i, symbol_to_cid(var));
+					}
+				}
 			}
 			procs = cdr(procs);
 			names = cdr(names);
@@ -297,8 +387,329 @@ emit_c_visit_expr(Sly_State *ss, CPS_Expr *expr, sly_value graph,
 }
 
 static void
-_cps_emit_c(Sly_State *ss, sly_value graph, sly_value k,
-			sly_value free_vars, sly_value constants, FILE *file)
+emit_c_direct_header(sly_value k, sly_value vars, FILE *file)
+{
+	fprintf(file, "scm_value %s_d(scm_value self, scm_value k",
+			symbol_to_cid(k));
+	while (!null_p(vars)) {
+		fprintf(file, ", scm_value %s_a", symbol_to_cid(car(vars)));
+		vars = cdr(vars);
+	}
+	fprintf(file, ")");
+}
+
+static int
+direct_kproc_p(CPS_Kont *kont)
+{
+	return kont->type == tt_cps_kproc && !booltoc(kont->u.kproc.arity.rest);
+}
+
+/* Calls through a variable that only ever holds one procedure can
+ * jump straight to its code, passing the arguments as C parameters.
+ * known maps such variables to the kproc label. The call still
+ * checks the closure's code at runtime and goes through the
+ * trampoline when the guess is wrong.
+ */
+static sly_value
+collect_known_procs(Sly_State *ss, sly_value graph)
+{
+	sly_value known = make_dictionary(ss);
+	sly_value sets = make_dictionary(ss);
+	sly_value k;
+	for (size_t i = 0; dictionary_next(graph, &i, &k, NULL);) {
+		CPS_Kont *kont = cps_graph_ref(graph, k);
+		if (kont->type != tt_cps_kargs
+			|| kont->u.kargs.term->type != tt_cps_continue) {
+			continue;
+		}
+		CPS_Term *term = kont->u.kargs.term;
+		CPS_Expr *expr = term->u.cont.expr;
+		if (expr->type == tt_cps_proc) {
+			CPS_Kont *next = cps_graph_ref(graph, term->u.cont.k);
+			if (next->type == tt_cps_kargs && pair_p(next->u.kargs.vars)) {
+				dictionary_set(ss, known, car(next->u.kargs.vars),
+							   expr->u.proc.k);
+			}
+		} else if (expr->type == tt_cps_fix) {
+			sly_value names = expr->u.fix.names;
+			sly_value procs = expr->u.fix.procs;
+			while (!null_p(names)) {
+				CPS_Expr *p = GET_PTR(car(procs));
+				if (p->type == tt_cps_proc) {
+					dictionary_set(ss, known, car(names), p->u.proc.k);
+				}
+				names = cdr(names);
+				procs = cdr(procs);
+			}
+		} else if (expr->type == tt_cps_set) {
+			sly_value var = expr->u.set.var;
+			sly_value val = expr->u.set.val;
+			/* a variable set more than once is not known */
+			val = dictionary_has(sets, var) ? SLY_FALSE : val;
+			dictionary_set(ss, sets, var, val);
+		}
+	}
+	sly_value var, val;
+	for (size_t i = 0; dictionary_next(sets, &i, &var, &val);) {
+		if (val != SLY_FALSE) {
+			sly_value code = dictionary_ref(known, val, SLY_FALSE);
+			if (code != SLY_FALSE) {
+				dictionary_set(ss, known, var, code);
+			}
+		}
+	}
+	return known;
+}
+
+/* Parameters are kept in boxes only when they are both set! and
+ * captured by some other continuation or closure. Everything else is
+ * a plain C local; unboxed maps those parameters to #t, along with
+ * the procedures bound by fix that are never set!.
+ */
+static sly_value
+collect_unboxed_params(Sly_State *ss, sly_value graph, sly_value var_info,
+					   sly_value free_vars)
+{
+	sly_value captured = make_dictionary(ss);
+	sly_value vars;
+	for (size_t i = 0; dictionary_next(free_vars, &i, NULL, &vars);) {
+		while (!null_p(vars)) {
+			dictionary_set(ss, captured, car(vars), SLY_TRUE);
+			vars = cdr(vars);
+		}
+	}
+	sly_value unboxed = make_dictionary(ss);
+	sly_value k;
+	for (size_t i = 0; dictionary_next(graph, &i, &k, NULL);) {
+		CPS_Kont *kont = cps_graph_ref(graph, k);
+		if (kont->type == tt_cps_kargs
+			&& kont->u.kargs.term->type == tt_cps_continue
+			&& kont->u.kargs.term->u.cont.expr->type == tt_cps_fix) {
+			CPS_Fix *fix = &kont->u.kargs.term->u.cont.expr->u.fix;
+			sly_value names = fix->names;
+			sly_value procs = fix->procs;
+			while (!null_p(names)) {
+				CPS_Expr *p = GET_PTR(car(procs));
+				CPS_Var_Info *vi = GET_PTR(dictionary_ref(var_info, car(names), SLY_VOID));
+				if (p->type == tt_cps_proc && (vi == NULL || vi->updates == 0)) {
+					dictionary_set(ss, unboxed, car(names), SLY_TRUE);
+				}
+				names = cdr(names);
+				procs = cdr(procs);
+			}
+			continue;
+		}
+		if (kont->type != tt_cps_kproc) {
+			continue;
+		}
+		CPS_Kont *body = cps_graph_ref(graph, kont->u.kproc.body);
+		vars = body->u.kargs.vars;
+		while (!null_p(vars)) {
+			sly_value var = car(vars);
+			CPS_Var_Info *vi = GET_PTR(dictionary_ref(var_info, var, SLY_VOID));
+			if (vi == NULL || vi->updates == 0
+				|| !dictionary_has(captured, var)) {
+				dictionary_set(ss, unboxed, var, SLY_TRUE);
+			}
+			vars = cdr(vars);
+		}
+	}
+	return unboxed;
+}
+
+static void
+emit_c_param(sly_value unboxed, sly_value var, char *init, FILE *file)
+{
+	char *id = symbol_to_cid(var);
+	if (dictionary_has(unboxed, var)) {
+		fprintf(file, "\tscm_value %s = %s;\n", id, init);
+	} else {
+		fprintf(file, "\tscm_value %s = make_box();\n", id);
+		fprintf(file, "\tbox_set(%s, %s);\n", id, init);
+	}
+}
+
+static CPS_Type
+var_type(sly_value var)
+{
+	sly_value p = dictionary_ref(var_types, var, SLY_VOID);
+	if (void_p(p)) {
+		CPS_Type top = {tt_type_top, 0, 0};
+		return top;
+	}
+	return ((CPS_Type_Info *)GET_PTR(p))->type;
+}
+
+static int
+typed_local_p(sly_value var)
+{
+	return dictionary_has(typed_locals, var);
+}
+
+/* Give a fixnum or flonum variable its unboxed copy. */
+static void
+emit_c_unbox_var(Sly_State *ss, sly_value var, FILE *file)
+{
+	char *id = symbol_to_cid(var);
+	CPS_Type t = var_type(var);
+	switch (t.tag) {
+	case tt_type_fixnum: {
+		if (t.lo == t.hi) {
+			fprintf(file, "\ti64 %s_i = %ld;\n", id, t.lo);
+		} else {
+			fprintf(file, "\ti64 %s_i = GET_INTEGRAL(%s);\n", id, id);
+		}
+	} break;
+	case tt_type_flonum: {
+		fprintf(file, "\tf64 %s_d = unbox_flonum(%s);\n", id, id);
+	} break;
+	default: return;
+	}
+	dictionary_set(ss, typed_locals, var, SLY_TRUE);
+}
+
+/* var as an operand of C arithmetic on a tag (fixnum or flonum) */
+static char *
+emit_c_operand(sly_value var, int tag, char *buf, size_t len)
+{
+	char *id = symbol_to_cid(var);
+	int local = typed_local_p(var);
+	switch (var_type(var).tag) {
+	case tt_type_fixnum: {
+		if (tag == tt_type_fixnum) {
+			snprintf(buf, len, local ? "%s_i" : "(i64)GET_INTEGRAL(%s)", id);
+		} else {
+			snprintf(buf, len, local ? "(f64)%s_i" : "(f64)GET_INTEGRAL(%s)", id);
+		}
+	} break;
+	case tt_type_flonum: {
+		snprintf(buf, len, local ? "%s_d" : "unbox_flonum(%s)", id);
+	} break;
+	default: {
+		snprintf(buf, len, "to_flonum(SCM_REF(%s))", id);
+	} break;
+	}
+	return buf;
+}
+
+/* Arithmetic and comparisons whose operand types are known are done
+ * directly on C numbers. Returns 0 when the primcall needs the
+ * generic path.
+ */
+static int
+emit_c_typed_primcall(Sly_State *ss, CPS_Expr *expr, sly_value binding,
+					  FILE *file)
+{
+	sly_value p = dictionary_ref(var_types, binding, SLY_VOID);
+	sly_value args = expr->u.primcall.args;
+	if (void_p(p) || list_len(args) != 2) {
+		return 0;
+	}
+	CPS_Type_Info *info = GET_PTR(p);
+	int tx = info->args[0].tag;
+	int ty = info->args[1].tag;
+	int tag;
+	if (tx == tt_type_fixnum && ty == tt_type_fixnum) {
+		tag = tt_type_fixnum;
+	} else if ((tx == tt_type_flonum || ty == tt_type_flonum)
+			   && tx != tt_type_bottom && ty != tt_type_bottom) {
+		tag = tt_type_flonum;
+	} else {
+		return 0;
+	}
+	char *op;
+	switch (primop_p(expr->u.primcall.prim)) {
+	case tt_prim_add: op = "+"; break;
+	case tt_prim_sub: op = "-"; break;
+	case tt_prim_mul: op = "*"; break;
+	case tt_prim_num_eq: op = "=="; break;
+	case tt_prim_less: op = "<"; break;
+	case tt_prim_gr: op = ">"; break;
+	case tt_prim_leq: op = "<="; break;
+	case tt_prim_geq: op = ">="; break;
+	default: return 0;
+	}
+	if (op[0] != '+' && op[0] != '-' && op[0] != '*') {
+		// comparisons need both operands to be numbers
+		if (tx == tt_type_top || ty == tt_type_top) {
+			return 0;
+		}
+	} else if (info->type.tag != tag) {
+		return 0;
+	}
+	char x[0x100], y[0x100];
+	emit_c_operand(car(args), tag, x, sizeof(x));
+	emit_c_operand(car(cdr(args)), tag, y, sizeof(y));
+	char *id = symbol_to_cid(binding);
+	if (info->type.tag != tag) {
+		fprintf(file, "\tscm_value %s = ITOBOOL(%s %s %s);\n", id, x, op, y);
+		return 1;
+	}
+	if (tag == tt_type_fixnum) {
+		fprintf(file, "\ti64 %s_i = %s %s %s;\n", id, x, op, y);
+		if (info->checked) {
+			fprintf(file, "\tscm_assert(%s_i >= INT32_MIN && %s_i <= INT32_MAX, "
+					"\"Integer overflow\");\n", id, id);
+		}
+		fprintf(file, "\tscm_value %s = box_fixnum(%s_i);\n", id, id);
+	} else {
+		fprintf(file, "\tf64 %s_d = %s %s %s;\n", id, x, op, y);
+		fprintf(file, "\tscm_value %s = box_flonum(%s_d);\n", id, id);
+	}
+	dictionary_set(ss, typed_locals, binding, SLY_TRUE);
+	return 1;
+}
+
+static void
+emit_c_call(sly_value graph, sly_value known, CPS_Expr *expr, FILE *file)
+{
+	sly_value proc = expr->u.call.proc;
+	sly_value args = expr->u.call.args;
+	sly_value code = dictionary_ref(known, proc, SLY_FALSE);
+	if (code != SLY_FALSE && sly_equal(code, loop_kproc)) {
+		CPS_Kont *kproc = cps_graph_ref(graph, code);
+		CPS_Kont *body = cps_graph_ref(graph, kproc->u.kproc.body);
+		sly_value vars = body->u.kargs.vars;
+		if (list_len(vars) == list_len(args)) {
+			/* rebind the parameters in place, the arguments may
+			 * refer to them so they are all read first */
+			fprintf(file, "\tscm_value _proc = scm_ref(%s);\n", symbol_to_cid(proc));
+			fprintf(file, "\tif (scm_code_p(_proc, %s)) {\n", symbol_to_cid(code));
+			for (size_t i = 0; !null_p(args); ++i, args = cdr(args)) {
+				fprintf(file, "\t\tscm_value _a%zu = scm_ref(%s);\n",
+						i, symbol_to_cid(car(args)));
+			}
+			for (size_t i = 0; !null_p(vars); ++i, vars = cdr(vars)) {
+				fprintf(file, "\t\t%s_a = _a%zu;\n", symbol_to_cid(car(vars)), i);
+			}
+			fprintf(file, "\t\tself = _proc;\n");
+			fprintf(file, "\t\tgoto %s_loop;\n\t}\n", symbol_to_cid(code));
+			loop_used = 1;
+			args = expr->u.call.args;
+		}
+	} else if (code != SLY_FALSE) {
+		CPS_Kont *kproc = cps_graph_ref(graph, code);
+		if (direct_kproc_p(kproc)
+			&& list_len(kproc->u.kproc.arity.req) == list_len(args)) {
+			fprintf(file, "\tscm_value _proc = scm_ref(%s);\n", symbol_to_cid(proc));
+			fprintf(file, "\tif (scm_direct_call_p(_proc, %s)) {\n",
+					symbol_to_cid(code));
+			fprintf(file, "\t\treturn %s_d(_proc, k", symbol_to_cid(code));
+			while (!null_p(args)) {
+				fprintf(file, ", scm_ref(%s)", symbol_to_cid(car(args)));
+				args = cdr(args);
+			}
+			fprintf(file, ");\n\t}\n");
+		}
+	}
+	emit_c_push_refs(SLY_VOID, expr->u.call.args, file);
+	fprintf(file, push_tmpl, "", "k");
+	fprintf(file, tail_call_tmpl, symbol_to_cid(proc));
+}
+
+static void
+_cps_emit_c(Sly_State *ss, sly_value graph, sly_value k, sly_value free_vars,
+			sly_value constants, sly_value known, sly_value unboxed, FILE *file)
 {
 	CPS_Kont *kont = cps_graph_ref(graph, k);
 	switch (kont->type) {
@@ -315,70 +726,117 @@ _cps_emit_c(Sly_State *ss, sly_value graph, sly_value k,
 					fprintf(file, push_tmpl, "(scm_value)", symbol_to_cid(next->name));
 					fprintf(file, "\tk = make_closure();\n");
 				}
-				emit_c_push_refs(SLY_VOID, expr->u.call.args, file);
-				fprintf(file, push_tmpl, "", "k");
-				fprintf(file, tail_call_tmpl, symbol_to_cid(expr->u.call.proc));
+				emit_c_call(graph, known, expr, file);
 				return;
 			} else if (expr->type == tt_cps_primcall) {
-				char *tmpl = emit_c_visit_expr(ss, expr, graph, free_vars, constants, file);
 				sly_assert(list_len(next->u.kreceive.arity.req) == 1, "Arity mismatch");
 				next = cps_graph_ref(graph, next->u.kreceive.k);
 				sly_value binding = car(next->u.kargs.vars);
-				fprintf(file, "\tscm_value %s = %s;\n", symbol_to_cid(binding), tmpl);
-				_cps_emit_c(ss, graph, next->name, free_vars, constants, file);
+				char *id = symbol_to_cid(binding);
+				if (list_member(binding, loop_hoisted)) {
+					fprintf(file, "\tif (!%s_ok) {\n", id);
+					char *tmpl = emit_c_visit_expr(ss, expr, graph, free_vars, constants, unboxed, file);
+					fprintf(file, "\t%s_h = %s;\n\t%s_ok = 1;\n\t}\n", id, tmpl, id);
+					fprintf(file, "\tscm_value %s = %s_h;\n", id, id);
+				} else if (!emit_c_typed_primcall(ss, expr, binding, file)) {
+					char *tmpl = emit_c_visit_expr(ss, expr, graph, free_vars, constants, unboxed, file);
+					fprintf(file, "\tscm_value %s = %s;\n", id, tmpl);
+				}
+				_cps_emit_c(ss, graph, next->name, free_vars, constants, known, unboxed, file);
 				return;
 			} else {
-				char *tmpl = emit_c_visit_expr(ss, expr, graph, free_vars, constants, file);
+				char *tmpl = emit_c_visit_expr(ss, expr, graph, free_vars, constants, unboxed, file);
 				if (tmpl) {
 					if (next->type == tt_cps_ktail) {
 						fprintf(file, push_tmpl, "", tmpl);
-					} else {
+					} else if (!null_p(next->u.kargs.vars)) {
 						sly_value binding = next->u.kargs.vars;
 						fprintf(file, "\tscm_value %s = %s;\n",
 								symbol_to_cid(car(binding)), tmpl);
+						if (expr->type == tt_cps_const) {
+							emit_c_unbox_var(ss, car(binding), file);
+						}
 					}
 				}
 			}
-			_cps_emit_c(ss, graph, term->u.cont.k, free_vars, constants, file);
+			_cps_emit_c(ss, graph, term->u.cont.k, free_vars, constants, known, unboxed, file);
 		} else if (term->type == tt_cps_branch) {
 			fprintf(file, "\tif (%s != SCM_FALSE) {\n", symbol_to_cid(term->u.branch.arg));
-			_cps_emit_c(ss, graph, term->u.branch.kt, free_vars, constants, file);
+			_cps_emit_c(ss, graph, term->u.branch.kt, free_vars, constants, known, unboxed, file);
 			fprintf(file, "\t} else {\n");
-			_cps_emit_c(ss, graph, term->u.branch.kf, free_vars, constants, file);
+			_cps_emit_c(ss, graph, term->u.branch.kf, free_vars, constants, known, unboxed, file);
 			fprintf(file, "\t}\n");
 		}
 	} break;
 	case tt_cps_kproc: {
+		FILE *func_file = NULL;
+		char *body_buf;
+		size_t body_sz;
 		sly_value name = symbol_p(kont->u.kproc.binding)
 			? symbol_get_alias(kont->u.kproc.binding) : kont->name;
 		fprintf(file, closure_tmpl, "", symbol_to_cid(k), symbol_to_cstr(name));
 		fprintf(file, "\tscm_chk_heap(&self);\n");
+		typed_locals = make_dictionary(ss);
 		struct arity_t arity = kont->u.kproc.arity;
 		fprintf(file, chk_args_tmpl, list_len(arity.req) + 1, booltoc(arity.rest));
 		fprintf(file, pop_tmpl, "scm_value ", "k");
 		CPS_Kont *next = cps_graph_ref(graph, kont->u.kproc.body);
 		sly_value vars = copy_list(ss, next->u.kargs.vars);
-		sly_value v = vars;
-		while (!null_p(v)) {
-			fprintf(file, "\tscm_value %s = make_box();\n", symbol_to_cid(car(v)));
-			v = cdr(v);
-		}
 		if (booltoc(arity.rest)) {
 			vars = list_reverse(ss, vars);
 			sly_value rest = car(vars);
 			vars = list_reverse(ss, cdr(vars));
 			while (!null_p(vars)) {
-				fprintf(file, "\tbox_set(%s, pop_arg());\n",
-						symbol_to_cid(car(vars)));
+				emit_c_param(unboxed, car(vars), "pop_arg()", file);
 				vars = cdr(vars);
 			}
-			fprintf(file, "\tbox_set(%s, cons_rest());\n", symbol_to_cid(rest));
+			emit_c_param(unboxed, rest, "cons_rest()", file);
 		} else {
+			/* the trampoline entry pops the arguments and
+			 * continues in the direct entry */
 			while (!null_p(vars)) {
-				fprintf(file, "\tbox_set(%s, pop_arg());\n",
+				fprintf(file, "\tscm_value %s_a = pop_arg();\n",
 						symbol_to_cid(car(vars)));
 				vars = cdr(vars);
 			}
+			vars = next->u.kargs.vars;
+			fprintf(file, "\treturn %s_d(self, k", symbol_to_cid(k));
+			while (!null_p(vars)) {
+				fprintf(file, ", %s_a", symbol_to_cid(car(vars)));
+				vars = cdr(vars);
+			}
+			fprintf(file, ");\n}\n\n");
+			emit_c_direct_header(k, next->u.kargs.vars, file);
+			fprintf(file, " // %s\n{\n", symbol_to_cstr(name));
+			/* the label is only written out once we know a self
+			 * call jumps to it */
+			func_file = file;
+			file = open_memstream(&body_buf, &body_sz);
+			loop_kproc = k;
+			loop_used = 0;
+			loop_hoisted = dictionary_ref(loop_invariants, k, SLY_NULL);
+			typed_locals = make_dictionary(ss);
+			/* a direct call skipped scm_chk_heap, so hand the
+			 * arguments back to the trampoline entry when a
+			 * collection is due */
+			fprintf(file, "\tif (scm_gc_pending()) {\n");
+			vars = list_reverse(ss, copy_list(ss, next->u.kargs.vars));
+			while (!null_p(vars)) {
+				fprintf(file, "\t\tpush_arg(%s_a);\n", symbol_to_cid(car(vars)));
+				vars = cdr(vars);
+			}
+			fprintf(file, "\t\tpush_arg(k);\n");
+			fprintf(file, "\t\treturn %s(self);\n\t}\n", symbol_to_cid(k));
+			vars = next->u.kargs.vars;
+			while (!null_p(vars)) {
+				char init[0xff];
+				snprintf(init, sizeof(init), "%s_a", symbol_to_cid(car(vars)));
+				emit_c_param(unboxed, car(vars), init, file);
+				if (dictionary_has(unboxed, car(vars))) {
+					emit_c_unbox_var(ss, car(vars), file);
+				}
+				vars = cdr(vars);
+			}
 		}
 		vars = dictionary_ref(free_vars, k, SLY_NULL);
 		if (list_member(kont->u.kproc.binding, vars)) {
@@ -387,11 +845,27 @@ _cps_emit_c(Sly_State *ss, sly_value graph, sly_value k,
 					symbol_to_cid(kont->u.kproc.binding));
 		}
 		emit_c_unpack_self(vars, 0, file);
-		_cps_emit_c(ss, graph, next->name, free_vars, constants, file);
+		_cps_emit_c(ss, graph, next->name, free_vars, constants, known, unboxed, file);
+		if (func_file) {
+			fclose(file);
+			for (vars = loop_hoisted; !null_p(vars); vars = cdr(vars)) {
+				char *id = symbol_to_cid(car(vars));
+				fprintf(func_file, "\tscm_value %s_h = SCM_VOID;\n", id);
+				fprintf(func_file, "\tint %s_ok = 0;\n", id);
+			}
+			if (loop_used) {
+				fprintf(func_file, "%s_loop:\n", symbol_to_cid(k));
+			}
+			fwrite(body_buf, 1, body_sz, func_file);
+			free(body_buf);
+			loop_kproc = SLY_VOID;
+			loop_hoisted = SLY_NULL;
+		}
 	} break;
 	case tt_cps_kreceive: {
 		fprintf(file, closure_tmpl, "", symbol_to_cid(k), "");
 		fprintf(file, "\tscm_chk_heap(&self);\n");
+		typed_locals = make_dictionary(ss);
 		struct arity_t arity = kont->u.kreceive.arity;
 		fprintf(file, chk_args_tmpl, list_len(arity.req), booltoc(arity.rest));
 		sly_assert(!booltoc(arity.rest), "unimplemented");
@@ -400,7 +874,7 @@ _cps_emit_c(Sly_State *ss, sly_value graph, sly_value k,
 		sly_value vars = dictionary_ref(free_vars, k, SLY_NULL);
 		fprintf(file, "\tscm_value k = closure_ref(self, 0);\n");
 		emit_c_unpack_self(vars, 1, file);
-		_cps_emit_c(ss, graph, next->name, free_vars, constants, file);
+		_cps_emit_c(ss, graph, next->name, free_vars, constants, known, unboxed, file);
 	} break;
 	case tt_cps_ktail: {
 		fprintf(file, tail_call_tmpl, "k");
@@ -417,7 +891,7 @@ emit_const_element(FILE *file, sly_value constants, sly_value elem)
 		fprintf(file, "\t\t{tt_int, .u.as_int=%ld},\n",
 				get_int(elem));
 	} else if (float_p(elem)) {
-		fprintf(file, "\t\t{tt_float, .u.as_float=%g},\n",
+		fprintf(file, "\t\t{tt_float, .u.as_float=%.17g},\n",
 				get_float(elem));
 	} else if (true_p(elem)) {
 		fprintf(file, "\t\t{tt_bool, .u.as_int=1},\n");
@@ -450,22 +924,51 @@ emit_const_element(FILE *file, sly_value constants, sly_value elem)
 	}
 }
 
+static int
+label_cmp(const void *a, const void *b)
+{
+	sly_value x = *(const sly_value *)a;
+	sly_value y = *(const sly_value *)b;
+	return strcmp(symbol_to_cstr(x), symbol_to_cstr(y));
+}
+
+/* The labels with an entry in free_vars, sorted by name. Dictionary
+ * order follows symbol addresses, and the generated code has to be
+ * the same from one run to the next for the module cache.
+ */
+static sly_value *
+sorted_labels(sly_value free_vars, size_t *len)
+{
+	sly_value *labels = GC_MALLOC((dictionary_len(free_vars) + 1) * sizeof(*labels));
+	size_t n = 0;
+	sly_value label;
+	for (size_t i = 0; dictionary_next(free_vars, &i, &label, NULL);) {
+		labels[n++] = label;
+	}
+	qsort(labels, n, sizeof(*labels), label_cmp);
+	*len = n;
+	return labels;
+}
+
 void
 cps_emit_c(Sly_State *ss, sly_value graph, sly_value start,
-		   sly_value free_vars, FILE *file, int lib)
+		   sly_value var_info, sly_value free_vars, FILE *file, int lib)
 {
 	char *buf;
 	size_t buf_sz;
 	FILE *buf_stream = open_memstream(&buf, &buf_sz);
-	vector *vec = GET_PTR(free_vars);
-	for (size_t i = 0; i < vec->cap; ++i) {
-		sly_value entry = vec->elems[i];
-		if (!slot_is_free(entry)) {
-			sly_value k = car(entry);
-			CPS_Kont *kont = cps_graph_ref(graph, k);
-			if (kont->type != tt_cps_ktail) {
-				fprintf(buf_stream, "scm_value %s(scm_value self);\n", symbol_to_cid(k));
-			}
+	size_t nlabels;
+	sly_value *labels = sorted_labels(free_vars, &nlabels);
+	for (size_t i = 0; i < nlabels; ++i) {
+		sly_value k = labels[i];
+		CPS_Kont *kont = cps_graph_ref(graph, k);
+		if (kont->type != tt_cps_ktail) {
+			fprintf(buf_stream, "scm_value %s(scm_value self);\n", symbol_to_cid(k));
+		}
+		if (direct_kproc_p(kont)) {
+			CPS_Kont *body = cps_graph_ref(graph, kont->u.kproc.body);
+			emit_c_direct_header(k, body->u.kargs.vars, buf_stream);
+			fprintf(buf_stream, ";\n");
 		}
 	}
 	fprintf(buf_stream, "\n");
@@ -484,15 +987,19 @@ cps_emit_c(Sly_State *ss, sly_value graph, sly_value start,
 		}
 	}
 	sly_value constants = make_dictionary(ss);
-	_cps_emit_c(ss, graph, start, free_vars, constants, buf_stream);
+	sly_value known = collect_known_procs(ss, graph);
+	sly_value unboxed = collect_unboxed_params(ss, graph, var_info, free_vars);
+	loop_invariants = cps_collect_loop_invariants(ss, graph, known, var_info);
+	var_types = cps_infer_types(ss, graph, start, known, var_info);
+	typed_locals = make_dictionary(ss);
+	_cps_emit_c(ss, graph, start, free_vars, constants, known, unboxed, buf_stream);
 	fprintf(buf_stream, "}\n\n");
-	for (size_t i = 0; i < vec->cap; ++i) {
-		sly_value entry = vec->elems[i];
-		if (!slot_is_free(entry) && !sly_equal(car(entry), start)) {
-			sly_value k = car(entry);
+	for (size_t i = 0; i < nlabels; ++i) {
+		sly_value k = labels[i];
+		if (!sly_equal(k, start)) {
 			CPS_Kont *kont = cps_graph_ref(graph, k);
 			if (kont->type != tt_cps_ktail) {
-				_cps_emit_c(ss, graph, car(entry), free_vars, constants, buf_stream);
+				_cps_emit_c(ss, graph, k, free_vars, constants, known, unboxed, buf_stream);
 				fprintf(buf_stream, "}\n\n");
 			}
 		}
@@ -505,16 +1012,21 @@ cps_emit_c(Sly_State *ss, sly_value graph, sly_value start,
 	fprintf(file, "#include \"scheme/scm_types.h\"\n");
 	fprintf(file, "#include \"scheme/scm_runtime.h\"\n\n");
 	fprintf(file, "static scm_value *interned;\n\n");
-	vec = GET_PTR(constants);
 	char *cbuf;
 	size_t cbuf_sz;
 	FILE *cbuf_stream = open_memstream(&cbuf, &cbuf_sz);
 	fprintf(cbuf_stream, "static struct constant constants[] = {\n");
-	for (size_t i = 0; i < vec->cap; ++i) {
-		sly_value entry = vec->elems[i];
-		if (!slot_is_free(entry)) {
-			sly_value key = car(entry);
-			size_t idx = cdr(entry);
+	/* emit the constants in the order they were interned, the
+	 * dictionary order depends on where the keys live in memory and
+	 * the output has to be stable for the module cache */
+	sly_value *keys = GC_MALLOC((const_idx + 1) * sizeof(*keys));
+	sly_value k, idx;
+	for (size_t i = 0; dictionary_next(constants, &i, &k, &idx);) {
+		keys[idx] = k;
+	}
+	for (size_t idx = 0; idx < const_idx; ++idx) {
+		sly_value key = keys[idx];
+		if (key) {
 			sly_value var = cps_gensym_temporary_name(ss);
 			char *var_name = symbol_to_cid(var);
 			if (string_p(key)) {
@@ -584,10 +1096,124 @@ cps_emit_c(Sly_State *ss, sly_value graph, sly_value start,
 	fwrite(buf, 1, buf_sz, file);
 }
 
+/* Modules are compiled ahead of time to a shared object next to the
+ * source (or in $SLY_CACHE_DIR, see sly_cache_path). The generated C
+ * is a function of the source, everything it requires and the
+ * compiler itself, so its hash together with the C flags, the gcc
+ * version and the runtime library is the cache key. The key is
+ * stored in the shared object as scm_module_key; when it matches,
+ * gcc is skipped.
+ */
+#define RUNTIME_SRC "scheme/scm_runtime.c"
+#define RUNTIME_LIB "scheme/libscm_runtime.a"
+#define DEFAULT_CFLAGS "-O2"
+
+static char *
+module_cflags(void)
+{
+	char *flags = getenv("SLY_CFLAGS");
+	return flags && flags[0] ? flags : DEFAULT_CFLAGS;
+}
+
+static int
+file_newer_p(char *a, char *b)
+{
+	struct stat sa, sb;
+	if (stat(a, &sa) != 0) {
+		return 0;
+	}
+	if (stat(b, &sb) != 0) {
+		return 1;
+	}
+	return sa.st_mtim.tv_sec > sb.st_mtim.tv_sec
+		|| (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec
+			&& sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec);
+}
+
+/* The runtime is built once into a static library and only rebuilt
+ * when one of its sources changes. Returns a stamp that changes
+ * whenever the library does.
+ */
+static u64
+runtime_build(void)
+{
+	if (file_newer_p(RUNTIME_SRC, RUNTIME_LIB)
+		|| file_newer_p("scheme/scm_runtime.h", RUNTIME_LIB)
+		|| file_newer_p("scheme/scm_types.h", RUNTIME_LIB)) {
+		int r = system("./scheme/build_runtime.sh");
+		sly_assert(r == 0, "compile error");
+	}
+	struct stat st;
+	sly_assert(stat(RUNTIME_LIB, &st) == 0, "Error runtime library missing");
+	return (u64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec
+		+ (u64)st.st_size;
+}
+
+/* Hash of the version of the gcc that modules are built with, which
+ * is not necessarily the one sly itself was built with.
+ */
+static u64
+gcc_version(void)
+{
+	static u64 version = 0;
+	if (version) {
+		return version;
+	}
+	char buf[256];
+	size_t len = 0;
+	FILE *p = popen("gcc -dumpfullversion -dumpversion", "r");
+	if (p) {
+		len = fread(buf, 1, sizeof(buf), p);
+		pclose(p);
+	}
+	version = sly_image_hash(buf, len) | 1;
+	return version;
+}
+
+/* Open a uniquely named file next to path to build it in, it is
+ * renamed over path once complete so that another sly compiling the
+ * same module never loads or overwrites a half written file.
+ */
+static FILE *
+open_temp(char *path, char **tmp_path)
+{
+	size_t len = strlen(path);
+	char *tmp = GC_MALLOC(len + 8);
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, ".XXXXXX", 8);
+	int fd = mkstemp(tmp);
+	if (fd == -1) {
+		return NULL;
+	}
+	FILE *file;
+	if (fchmod(fd, 0644) != 0 || (file = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		remove(tmp);
+		return NULL;
+	}
+	*tmp_path = tmp;
+	return file;
+}
+
+static void *
+module_open(char *so_path, u64 key)
+{
+	void *handle = dlopen(so_path, RTLD_NOW|RTLD_LOCAL);
+	if (handle == NULL) {
+		return NULL;
+	}
+	u64 *stored = dlsym(handle, "scm_module_key");
+	if (stored == NULL || *stored != key) {
+		dlclose(handle);
+		return NULL;
+	}
+	return handle;
+}
+
 int
 compile_form(Sly_State *ss, sly_value ast)
 {
-	sly_value graph = make_dictionary(ss);
+	sly_value graph = make_eq_dictionary(ss);
 	sly_value name = make_symbol(ss, "$tkexit", 7);
 	CPS_Kont *kont = cps_make_ktail(ss, 0);
 	kont->name = name;
@@ -598,25 +1224,73 @@ compile_form(Sly_State *ss, sly_value ast)
 	cps_display(ss, graph, entry);
 	printf("========================================================\n");
 	graph = cps_opt_contraction_phase(ss, graph, entry, 1);
+	graph = cps_opt_cse_phase(ss, graph, entry, 1);
 	cps_display(ss, graph, entry);
 	printf("\n");
+	sly_value global_var_info = make_eq_dictionary(ss);
 	sly_value var_info = cps_collect_var_info(ss, graph,
-											  make_dictionary(ss),
+											  global_var_info,
 											  make_dictionary(ss),
 											  make_dictionary(ss), NULL, entry);
 	sly_value free_var_lookup = cps_collect_free_variables(ss, graph, var_info, entry);
-	FILE *file = fopen("test.sly.c", "w");
-	if (file == NULL) {
-		fprintf(stderr, "Error opening file\n");
-		return 1;
+	char *code;
+	size_t code_sz;
+	FILE *code_stream = open_memstream(&code, &code_sz);
+	cps_emit_c(ss, graph, entry, global_var_info, free_var_lookup, code_stream, 1);
+	fclose(code_stream);
+	char *flags = module_cflags();
+	u64 key = sly_image_hash(code, code_sz);
+	key = key * 31 + sly_image_hash(flags, strlen(flags));
+	key = key * 31 + gcc_version();
+	key = key * 31 + runtime_build();
+	char *c_path = sly_cache_path(ss->file_path, ".c");
+	char *so_path = sly_cache_path(ss->file_path, ".so");
+	if (strchr(so_path, '/') == NULL) {
+		/* dlopen only looks in the library path for bare names */
+		char *p = GC_MALLOC(strlen(so_path) + 3);
+		sprintf(p, "./%s", so_path);
+		so_path = p;
+	}
+	void *handle = module_open(so_path, key);
+	if (handle == NULL) {
+		char *c_tmp, *so_tmp;
+		FILE *file = open_temp(c_path, &c_tmp);
+		if (file == NULL) {
+			fprintf(stderr, "Error opening file %s\n", c_path);
+			free(code);
+			return 1;
+		}
+		fwrite(code, 1, code_sz, file);
+		fprintf(file, "const u64 scm_module_key = 0x%lx;\n", key);
+		fclose(file);
+		FILE *so_file = open_temp(so_path, &so_tmp);
+		if (so_file == NULL) {
+			fprintf(stderr, "Error opening file %s\n", so_path);
+			remove(c_tmp);
+			free(code);
+			return 1;
+		}
+		fclose(so_file);
+		/* the temporary names have no .c suffix, hence the -x c */
+		char *fmt = "gcc -fPIC -shared -I. %s -o '%s' -x c '%s' -x none "
+			RUNTIME_LIB;
+		size_t cmd_sz = strlen(fmt) + strlen(flags)
+			+ strlen(so_tmp) + strlen(c_tmp);
+		char *cmd = GC_MALLOC(cmd_sz);
+		snprintf(cmd, cmd_sz, fmt, flags, so_tmp, c_tmp);
+		int r = system(cmd);
+		if (r != 0 || rename(so_tmp, so_path) != 0) {
+			remove(so_tmp);
+			remove(c_tmp);
+			sly_assert(0, "compile error");
+		}
+		/* the C is kept for reference only, losing it is harmless */
+		if (rename(c_tmp, c_path) != 0) {
+			remove(c_tmp);
+		}
+		handle = module_open(so_path, key);
 	}
-	cps_emit_c(ss, graph, entry, free_var_lookup, file, 1);
-	fclose(file);
-	int r = system("./scheme/build_runtime.sh -s");
-	sly_assert(r == 0, "compile error");
-	r = system("gcc -fPIC -shared -ggdb -o test.so test.sly.c scheme/scm_runtime.o");
-	sly_assert(r == 0, "compile error");
-	void *handle = dlopen("./test.so", RTLD_NOW);
+	free(code);
 	if (handle == NULL) {
 		printf("ERROR:\n%s\n", dlerror());
 		assert(handle != NULL);
@@ -1,5 +1,6 @@
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <gc.h>
 #include "sly_types.h"
 #include "cps.h"
@@ -21,10 +22,12 @@
 
 /* Optimization passes:
  * 1. Constant folding/Beta-contraction
- * 2. Beta-expansion (inlining)
+ * 2. Beta-expansion (inlining) of small leaf procedures,
+ *    bounded by $SLY_INLINE_BUDGET continuations
  * 3. Eta-reduction
- * 4. Hoisting
+ * 4. Hoisting of loop invariants (see cps_collect_loop_invariants)
  * 5. Common subexpression elimination
+ * 6. Type inference for the C backend (see cps_infer_types)
  */
 
 /* Phases: (discribed in "Compiling with continuations")
@@ -74,19 +77,19 @@
 		cps_graph_set(ss, graph, cc, k);								\
 	} while (0)
 
-#define SYM_SET				cstr_to_symbol("set!")
-#define SYM_CALLWCC			cstr_to_symbol("call/cc")
-#define SYM_CALLWCC_LONG	cstr_to_symbol("call-with-current-continuation")
-#define SYM_VALUES			cstr_to_symbol("values")
-#define SYM_CALLWVALUES		cstr_to_symbol("call-with-values")
-#define SYM_APPLY			cstr_to_symbol("apply")
-#define SYM_LAMBDA			cstr_to_symbol("lambda")
-#define SYM_BEGIN			cstr_to_symbol("begin")
-#define SYM_IF				cstr_to_symbol("if")
-#define SYM_QUOTE			cstr_to_symbol("quote")
-#define SYM_SYNTAX_QUOTE	cstr_to_symbol("syntax-quote")
-#define SYM_DEFINE			cstr_to_symbol("define")
-#define SYM_DEFINE_SYNTAX	cstr_to_symbol("define-syntax")
+#define SYM_SET				static_symbol(ss, ssym_set)
+#define SYM_CALLWCC			static_symbol(ss, ssym_call_cc)
+#define SYM_CALLWCC_LONG	static_symbol(ss, ssym_call_with_current_continuation)
+#define SYM_VALUES			static_symbol(ss, ssym_values)
+#define SYM_CALLWVALUES		static_symbol(ss, ssym_call_with_values)
+#define SYM_APPLY			static_symbol(ss, ssym_apply)
+#define SYM_LAMBDA			static_symbol(ss, ssym_lambda)
+#define SYM_BEGIN			static_symbol(ss, ssym_begin)
+#define SYM_IF				static_symbol(ss, ssym_if)
+#define SYM_QUOTE			static_symbol(ss, ssym_quote)
+#define SYM_SYNTAX_QUOTE	static_symbol(ss, ssym_syntax_quote)
+#define SYM_DEFINE			static_symbol(ss, ssym_define)
+#define SYM_DEFINE_SYNTAX	static_symbol(ss, ssym_define_syntax)
 
 static sly_value prim_void(Sly_State *ss, sly_value arg_list);
 static sly_value prim_add(Sly_State *ss, sly_value arg_list);
@@ -136,7 +139,8 @@ static struct primop primops[] = {
 	[tt_prim_list]			= {"list", .fn = prim_list},
 	[tt_prim_vector]		= {"vector", .fn = prim_vector},
 	[tt_prim_vector_ref]	= {"vector-ref"},
-	[tt_prim_vector_set]	= {"vector-set"},
+	[tt_prim_vector_set]	= {"vector-set!"},
+	[tt_prim_vector_length]	= {"vector-length"},
 };
 
 UNUSED_ATTR static int NGPR = 32;
@@ -1005,40 +1009,17 @@ cps_var_tbl_union(Sly_State *ss, sly_value t1, sly_value t2)
 	sly_assert(dictionary_p(t1), "Type Error expected dictionary");
 	sly_assert(dictionary_p(t2), "Type Error expected dictionary");
 	sly_value nt = copy_dictionary(ss, t1);
-	vector *vec = GET_PTR(t2);
-	for (size_t i = 0; i < vec->cap; ++i) {
-		sly_value entry = vec->elems[i];
-		if (!slot_is_free(entry)) {
-			sly_value name = car(entry);
-			sly_value info2 = cdr(entry);
-			sly_value info1 = dictionary_ref(nt, name, SLY_VOID);
-			if (info1 != info2) {
-				info1 = (sly_value)var_info_cat(GET_PTR(info1), GET_PTR(info2));
-				dictionary_set(ss, nt, name, info1);
-			}
+	sly_value name, info2;
+	for (size_t i = 0; dictionary_next(t2, &i, &name, &info2);) {
+		sly_value info1 = dictionary_ref(nt, name, SLY_VOID);
+		if (info1 != info2) {
+			info1 = (sly_value)var_info_cat(GET_PTR(info1), GET_PTR(info2));
+			dictionary_set(ss, nt, name, info1);
 		}
 	}
 	return nt;
 }
 
-static sly_value
-cps_var_info_propagate(Sly_State *ss, sly_value state, sly_value out)
-{
-	sly_assert(dictionary_p(out), "Type Error expected dictionary");
-	sly_value nstate = copy_dictionary(ss, state);
-	vector *vout = GET_PTR(out);
-	for (size_t i = 0; i < vout->cap; ++i) {
-		sly_value entry = vout->elems[i];
-		if (!slot_is_free(entry)) {
-			sly_value name = car(entry);
-			sly_value ot = cdr(entry);
-			sly_value nt = dictionary_ref(nstate, name, SLY_VOID);
-			dictionary_set(ss, nstate, name, cps_var_tbl_union(ss, nt, ot));
-		}
-	}
-	return nstate;
-}
-
 sly_value
 cps_collect_var_info(Sly_State *ss, sly_value graph, sly_value global_tbl,
 					 sly_value state, sly_value prev_tbl, CPS_Expr *expr,
@@ -1060,7 +1041,9 @@ cps_collect_var_info(Sly_State *ss, sly_value graph, sly_value global_tbl,
 				vlist = cdr(vlist);
 			}
 		}
-		dictionary_set(ss, state, kont->name, var_tbl);
+		/* a join is reached once from each of its predecessors */
+		sly_value prev = dictionary_ref(state, kont->name, SLY_VOID);
+		dictionary_set(ss, state, kont->name, cps_var_tbl_union(ss, prev, var_tbl));
 		switch (term->type) {
 		case tt_cps_continue: {
 			CPS_Expr *nexpr = term->u.cont.expr;
@@ -1091,15 +1074,12 @@ cps_collect_var_info(Sly_State *ss, sly_value graph, sly_value global_tbl,
 		case tt_cps_branch: {
 			cps_var_info_inc_used(ss, var_tbl, term->u.branch.arg);
 			cps_var_info_inc_used(ss, global_tbl, term->u.branch.arg);
-			sly_value b1, b2;
-			b1 = copy_dictionary(ss, state);
-			b2 = copy_dictionary(ss, state);
-			b1 = cps_collect_var_info(ss, graph, global_tbl, b1, var_tbl, NULL,
-									  term->u.branch.kt);
-			b2 = cps_collect_var_info(ss, graph, global_tbl, b2, var_tbl, NULL,
-									  term->u.branch.kf);
-			state = cps_var_info_propagate(ss, state,
-										   cps_var_info_propagate(ss, b1, b2));
+			/* the arms only have their joins in common, so they can
+			 * share the state instead of each working on a copy */
+			state = cps_collect_var_info(ss, graph, global_tbl, state, var_tbl,
+										 NULL, term->u.branch.kt);
+			state = cps_collect_var_info(ss, graph, global_tbl, state, var_tbl,
+										 NULL, term->u.branch.kf);
 		} break;
 		}
 	} break;
@@ -1154,6 +1134,20 @@ var_is_dead(sly_value var_info, sly_value var)
 	return (used + escapes + updates) == 0;
 }
 
+static int
+var_is_write_only(sly_value var_info, sly_value var)
+{
+	sly_value s = dictionary_ref(var_info, var, SLY_VOID);
+	if (void_p(s)) {
+		return 0;  // No info. Variable may be imported
+	}
+	int reads = 0;
+	for (CPS_Var_Info *vi = GET_PTR(s); vi; vi = vi->alt) {
+		reads += vi->used + vi->escapes;
+	}
+	return reads == 0;
+}
+
 static int
 var_is_used_once(sly_value var_info, sly_value var)
 {
@@ -1302,6 +1296,7 @@ cps_opt_constant_folding_visit_expr(Sly_State *ss, sly_value var_info,
 		} break;
 		case tt_prim_vector_ref: break;
 		case tt_prim_vector_set: break;
+		case tt_prim_vector_length: break;
 		case tt_prim_list: {
 			while (!null_p(args)) {
 				sly_value val = cps_get_const(var_info, car(args));
@@ -1367,7 +1362,7 @@ cps_opt_constant_folding(Sly_State *ss, sly_value graph,
 						 sly_value var_info, sly_value k)
 {
 	CPS_Kont *kont = cps_graph_ref(graph, k);
-	sly_value new_graph = make_dictionary(ss);
+	sly_value new_graph = make_eq_dictionary(ss);
 	cps_graph_set(ss, new_graph, k, kont);
 	switch (kont->type) {
 	case tt_cps_kargs: {
@@ -1474,6 +1469,11 @@ cps_opt_constant_folding(Sly_State *ss, sly_value graph,
 						return dictionary_union(ss, new_graph, tmp);
 					}
 				}
+			} else if (expr->type == tt_cps_set
+					   && var_is_write_only(global_var_info, expr->u.set.var)) {
+				// nothing reads the variable, drop the store
+				CLICK();
+				term->u.cont.expr = cps_make_constant(SLY_VOID);
 			} else if (expr->type == tt_cps_set
 					   && next->type == tt_cps_kargs
 					   && list_len(next->u.kargs.vars) == 1
@@ -2045,7 +2045,7 @@ cps_opt_beta_contraction(Sly_State *ss,
 	// Functions called only once can be inlined (beta-reduction)
 	// without growing program size.
 	CPS_Kont *kont = cps_graph_ref(graph, k);
-	sly_value new_graph = make_dictionary(ss);
+	sly_value new_graph = make_eq_dictionary(ss);
 	cps_graph_set(ss, new_graph, k, kont);
 	switch (kont->type) {
 	case tt_cps_kargs: {
@@ -2130,16 +2130,165 @@ cps_opt_beta_contraction(Sly_State *ss,
 	return new_graph;
 }
 
+/* Size of a procedure body in continuations, or -1 if the body
+ * cannot be inlined. Only leaf procedures (no calls, closures
+ * or fix) are considered, so expansion can never feed itself.
+ * Bodies with a branch are left alone too: each inlined copy of
+ * one adds a predecessor to the join continuation, which the
+ * contraction passes that run afterwards do not expect.
+ */
+static int
+cps_inline_size(sly_value graph, sly_value k, int budget)
+{
+	CPS_Kont *kont = cps_graph_ref(graph, k);
+	switch (kont->type) {
+	case tt_cps_kargs: {
+		CPS_Term *term = kont->u.kargs.term;
+		int size;
+		if (budget <= 0) {
+			return -1;
+		}
+		if (term->type == tt_cps_continue) {
+			int type = term->u.cont.expr->type;
+			if (type == tt_cps_call || type == tt_cps_proc
+				|| type == tt_cps_fix) {
+				return -1;
+			}
+			size = cps_inline_size(graph, term->u.cont.k, budget - 1);
+			return size < 0 ? -1 : size + 1;
+		}
+		return -1;
+	} break;
+	case tt_cps_kreceive: {
+		return cps_inline_size(graph, kont->u.kreceive.k, budget);
+	} break;
+	case tt_cps_ktail: return 0;
+	}
+	return -1;
+}
+
+static int
+inline_budget(void)
+{
+	static int budget = -1;
+	if (budget < 0) {
+		char *s = getenv("SLY_INLINE_BUDGET");
+		budget = s ? atoi(s) : 12;
+		if (budget < 0) {
+			budget = 0;
+		}
+	}
+	return budget;
+}
+
+/* Returns the kproc bound to proc at this call site when it may be
+ * copied into the caller, otherwise NULL.
+ */
+static CPS_Kont *
+cps_inline_candidate(sly_value graph, sly_value global_var_info,
+					 CPS_Var_Info *vi, CPS_Expr *call, sly_value kk)
+{
+	if (vi == NULL || vi->alt || vi->binding == NULL
+		|| vi->binding->type != tt_cps_proc) {
+		return NULL;
+	}
+	CPS_Var_Info *gvi = GET_PTR(dictionary_ref(global_var_info,
+											   call->u.call.proc, SLY_VOID));
+	int updates = 0;
+	for (; gvi; gvi = gvi->alt) {
+		updates += gvi->updates;
+	}
+	if (updates > 1) { // only the definition itself
+		return NULL;
+	}
+	CPS_Kont *kproc = cps_graph_ref(graph, vi->binding->u.proc.k);
+	struct arity_t arity = kproc->u.kproc.arity;
+	if (arity.rest != SLY_FALSE
+		|| list_len(arity.req) != list_len(call->u.call.args)) {
+		return NULL;
+	}
+	CPS_Kont *krec = cps_graph_ref(graph, kk);
+	if (krec->type == tt_cps_kreceive
+		&& (krec->u.kreceive.arity.rest != SLY_FALSE
+			|| list_len(krec->u.kreceive.arity.req) != 1)) {
+		return NULL;
+	}
+	if (cps_inline_size(graph, kproc->u.kproc.body, inline_budget()) < 0) {
+		return NULL;
+	}
+	return kproc;
+}
+
+static void
+cps_opt_beta_expansion(Sly_State *ss, sly_value graph,
+					   sly_value global_var_info, sly_value var_info,
+					   sly_value k)
+{
+	// Inlines small known procedures at every call site.
+	// The graph is updated in place; each call that is replaced
+	// counts as a click.
+	CPS_Kont *kont = cps_graph_ref(graph, k);
+	switch (kont->type) {
+	case tt_cps_kargs: {
+		CPS_Term *term = kont->u.kargs.term;
+		if (term->type == tt_cps_branch) {
+			cps_opt_beta_expansion(ss, graph, global_var_info,
+								   var_info, term->u.branch.kt);
+			cps_opt_beta_expansion(ss, graph, global_var_info,
+								   var_info, term->u.branch.kf);
+			return;
+		}
+		CPS_Expr *expr = term->u.cont.expr;
+		sly_value knext = term->u.cont.k;
+		if (expr->type == tt_cps_proc) {
+			cps_opt_beta_expansion(ss, graph, global_var_info,
+								   var_info, expr->u.proc.k);
+		} else if (expr->type == tt_cps_fix) {
+			sly_value procs = expr->u.fix.procs;
+			while (!null_p(procs)) {
+				CPS_Expr *p = GET_PTR(car(procs));
+				if (p->type == tt_cps_proc) {
+					cps_opt_beta_expansion(ss, graph, global_var_info,
+										   var_info, p->u.proc.k);
+				}
+				procs = cdr(procs);
+			}
+		} else if (expr->type == tt_cps_call) {
+			sly_value info = dictionary_ref(var_info, k, SLY_VOID);
+			CPS_Var_Info *vi = void_p(info) ? NULL :
+				GET_PTR(dictionary_ref(info, expr->u.call.proc, SLY_VOID));
+			CPS_Kont *kproc =
+				cps_inline_candidate(graph, global_var_info, vi, expr, knext);
+			if (kproc) {
+				CLICK();
+				cps_inline_kproc(ss, graph, make_dictionary(ss),
+								 cps_copy_kont(kont), kproc);
+			}
+		}
+		cps_opt_beta_expansion(ss, graph, global_var_info, var_info, knext);
+	} break;
+	case tt_cps_kreceive: {
+		cps_opt_beta_expansion(ss, graph, global_var_info,
+							   var_info, kont->u.kreceive.k);
+	} break;
+	case tt_cps_kproc: {
+		cps_opt_beta_expansion(ss, graph, global_var_info,
+							   var_info, kont->u.kproc.body);
+	} break;
+	}
+}
+
 sly_value
 cps_opt_contraction_phase(Sly_State *ss, sly_value graph, sly_value k, int debug)
 {
 	static int called = 0;
 	int rounds = 0;
+	size_t changed;
 	sly_value gvi, vi;
 	called++;
 	printf("CONTRACTION PHASE #%d\n", called);
 #if 0
-	gvi = make_dictionary(ss);
+	gvi = make_eq_dictionary(ss);
 	vi = cps_collect_var_info(ss, graph,
 							  gvi,
 							  make_dictionary(ss),
@@ -2149,7 +2298,7 @@ cps_opt_contraction_phase(Sly_State *ss, sly_value graph, sly_value k, int debug
 	do {
 		rounds++;
 		printf("ROUND #%d\n", rounds);
-		gvi = make_dictionary(ss);
+		gvi = make_eq_dictionary(ss);
 		vi = cps_collect_var_info(ss, graph,
 								  gvi,
 								  make_dictionary(ss),
@@ -2160,7 +2309,7 @@ cps_opt_contraction_phase(Sly_State *ss, sly_value graph, sly_value k, int debug
 			cps_display(ss, graph, k);
 			printf("================================================\n");
 		}
-		gvi = make_dictionary(ss);
+		gvi = make_eq_dictionary(ss);
 		vi = cps_collect_var_info(ss, graph,
 								  gvi,
 								  make_dictionary(ss),
@@ -2171,7 +2320,7 @@ cps_opt_contraction_phase(Sly_State *ss, sly_value graph, sly_value k, int debug
 			cps_display(ss, graph, k);
 			printf("================================================\n");
 		}
-		gvi = make_dictionary(ss);
+		gvi = make_eq_dictionary(ss);
 		vi = cps_collect_var_info(ss, graph,
 								  gvi,
 								  make_dictionary(ss),
@@ -2182,16 +2331,995 @@ cps_opt_contraction_phase(Sly_State *ss, sly_value graph, sly_value k, int debug
 			cps_display(ss, graph, k);
 			printf("================================================\n");
 		}
-	} while (CLICK_RESET());
+		changed = CLICK_RESET();
+		if (changed) {
+			continue;
+		}
+		/* Expansion only runs on a contracted graph, after which
+		 * the copies are contracted again. */
+		gvi = make_eq_dictionary(ss);
+		vi = cps_collect_var_info(ss, graph,
+								  gvi,
+								  make_dictionary(ss),
+								  make_dictionary(ss), NULL, k);
+		cps_opt_beta_expansion(ss, graph, gvi, vi, k);
+		if (debug) {
+			printf("BETA-EXPANSION:\n");
+			cps_display(ss, graph, k);
+			printf("================================================\n");
+		}
+		changed = CLICK_RESET();
+	} while (changed);
 	return graph;
 }
 
+/* Primops whose result depends only on their arguments. */
+static int
+primop_pure_p(int op)
+{
+	switch (op) {
+	case tt_prim_add:
+	case tt_prim_sub:
+	case tt_prim_mul:
+	case tt_prim_div:
+	case tt_prim_idiv:
+	case tt_prim_mod:
+	case tt_prim_bw_and:
+	case tt_prim_bw_ior:
+	case tt_prim_bw_xor:
+	case tt_prim_bw_eqv:
+	case tt_prim_bw_nor:
+	case tt_prim_bw_nand:
+	case tt_prim_bw_not:
+	case tt_prim_bw_shift:
+	case tt_prim_eq:
+	case tt_prim_eqv:
+	case tt_prim_num_eq:
+	case tt_prim_less:
+	case tt_prim_gr:
+	case tt_prim_leq:
+	case tt_prim_geq:
+	case tt_prim_vector_length:
+		return 1;
+	}
+	return 0;
+}
+
+/* Primops that read mutable memory. They can be reused until the
+ * next call or vector-set!.
+ */
+static int
+primop_reads_heap_p(int op)
+{
+	return op == tt_prim_car
+		|| op == tt_prim_cdr
+		|| op == tt_prim_vector_ref;
+}
+
+static int
+cse_const_p(CPS_Expr *expr)
+{
+	sly_value value = expr->u.constant.value;
+	return expr->type == tt_cps_const
+		&& (int_p(value) || true_p(value) || false_p(value));
+}
+
+/* The variable a primcall or constant is bound to, or #<void>. */
+static sly_value
+cse_binding(sly_value graph, sly_value k)
+{
+	CPS_Kont *kont = cps_graph_ref(graph, k);
+	if (kont->type == tt_cps_kreceive) {
+		if (kont->u.kreceive.arity.rest != SLY_FALSE
+			|| list_len(kont->u.kreceive.arity.req) != 1) {
+			return SLY_VOID;
+		}
+		kont = cps_graph_ref(graph, kont->u.kreceive.k);
+	}
+	if (kont->type == tt_cps_kargs && list_len(kont->u.kargs.vars) == 1) {
+		return car(kont->u.kargs.vars);
+	}
+	return SLY_VOID;
+}
+
+static int
+cse_args_equal(sly_value aliases, sly_value a, sly_value b)
+{
+	while (!null_p(a) && !null_p(b)) {
+		if (!sly_eq(dictionary_ref(aliases, car(a), car(a)),
+					dictionary_ref(aliases, car(b), car(b)))) {
+			return 0;
+		}
+		a = cdr(a);
+		b = cdr(b);
+	}
+	return null_p(a) && null_p(b);
+}
+
+static sly_value
+cse_lookup(sly_value aliases, sly_value avail, CPS_Expr *expr)
+{
+	for (; !null_p(avail); avail = cdr(avail)) {
+		CPS_Expr *e = GET_PTR(car(car(avail)));
+		if (e->type != expr->type) {
+			continue;
+		}
+		if (e->type == tt_cps_const) {
+			if (sly_eq(e->u.constant.value, expr->u.constant.value)) {
+				return cdr(car(avail));
+			}
+		} else if (sly_eq(e->u.primcall.prim, expr->u.primcall.prim)
+				   && cse_args_equal(aliases, e->u.primcall.args,
+									 expr->u.primcall.args)) {
+			return cdr(car(avail));
+		}
+	}
+	return SLY_VOID;
+}
+
+/* Forget the expressions that read memory a call or vector-set! may
+ * have changed.
+ */
+static sly_value
+cse_kill_heap_reads(Sly_State *ss, sly_value avail)
+{
+	if (null_p(avail)) {
+		return avail;
+	}
+	sly_value rest = cse_kill_heap_reads(ss, cdr(avail));
+	CPS_Expr *e = GET_PTR(car(car(avail)));
+	if (e->type == tt_cps_primcall
+		&& primop_reads_heap_p(primop_p(e->u.primcall.prim))) {
+		return rest;
+	}
+	return rest == cdr(avail) ? avail : cons(ss, car(avail), rest);
+}
+
+static sly_value
+cse_intersect(Sly_State *ss, sly_value a, sly_value b)
+{
+	if (null_p(a)) {
+		return a;
+	}
+	sly_value rest = cse_intersect(ss, cdr(a), b);
+	for (sly_value x = b; !null_p(x); x = cdr(x)) {
+		if (car(x) == car(a)) {
+			return cons(ss, car(a), rest);
+		}
+	}
+	return rest;
+}
+
+static void
+cps_count_preds(Sly_State *ss, sly_value graph, sly_value preds, sly_value k)
+{
+	sly_value n = dictionary_ref(preds, k, SLY_VOID);
+	if (!void_p(n)) {
+		dictionary_set(ss, preds, k, make_int(ss, get_int(n) + 1));
+		return;
+	}
+	dictionary_set(ss, preds, k, make_int(ss, 1));
+	CPS_Kont *kont = cps_graph_ref(graph, k);
+	switch (kont->type) {
+	case tt_cps_kargs: {
+		CPS_Term *term = kont->u.kargs.term;
+		if (term->type == tt_cps_branch) {
+			cps_count_preds(ss, graph, preds, term->u.branch.kt);
+			cps_count_preds(ss, graph, preds, term->u.branch.kf);
+			break;
+		}
+		CPS_Expr *expr = term->u.cont.expr;
+		if (expr->type == tt_cps_proc) {
+			cps_count_preds(ss, graph, preds, expr->u.proc.k);
+		} else if (expr->type == tt_cps_fix) {
+			for (sly_value procs = expr->u.fix.procs; !null_p(procs);
+				 procs = cdr(procs)) {
+				CPS_Expr *p = GET_PTR(car(procs));
+				if (p->type == tt_cps_proc) {
+					cps_count_preds(ss, graph, preds, p->u.proc.k);
+				}
+			}
+		}
+		cps_count_preds(ss, graph, preds, term->u.cont.k);
+	} break;
+	case tt_cps_kreceive: {
+		cps_count_preds(ss, graph, preds, kont->u.kreceive.k);
+	} break;
+	case tt_cps_kproc: {
+		cps_count_preds(ss, graph, preds, kont->u.kproc.body);
+	} break;
+	}
+}
+
+struct cse_state {
+	sly_value graph;
+	sly_value var_info;
+	sly_value preds;
+	sly_value pending;  // join label => (arrivals . available)
+	sly_value aliases;
+};
+
+static void
+cps_opt_cse_visit(Sly_State *ss, struct cse_state *st, sly_value avail,
+				  sly_value k)
+{
+	sly_value graph = st->graph;
+	int npreds = get_int(dictionary_ref(st->preds, k, make_int(ss, 1)));
+	if (npreds > 1) {
+		// a join only keeps what is available on every path into it
+		sly_value p = dictionary_ref(st->pending, k, SLY_VOID);
+		if (void_p(p)) {
+			p = cons(ss, make_int(ss, 1), avail);
+		} else {
+			p = cons(ss, make_int(ss, get_int(car(p)) + 1),
+					 cse_intersect(ss, cdr(p), avail));
+		}
+		dictionary_set(ss, st->pending, k, p);
+		if (get_int(car(p)) < npreds) {
+			return;
+		}
+		avail = cdr(p);
+	}
+	CPS_Kont *kont = cps_graph_ref(graph, k);
+	switch (kont->type) {
+	case tt_cps_kargs: {
+		CPS_Term *term = kont->u.kargs.term;
+		if (term->type == tt_cps_branch) {
+			cps_opt_cse_visit(ss, st, avail, term->u.branch.kt);
+			cps_opt_cse_visit(ss, st, avail, term->u.branch.kf);
+			break;
+		}
+		CPS_Expr *expr = term->u.cont.expr;
+		sly_value knext = term->u.cont.k;
+		switch (expr->type) {
+		case tt_cps_proc: {
+			cps_opt_cse_visit(ss, st, SLY_NULL, expr->u.proc.k);
+		} break;
+		case tt_cps_fix: {
+			for (sly_value procs = expr->u.fix.procs; !null_p(procs);
+				 procs = cdr(procs)) {
+				CPS_Expr *p = GET_PTR(car(procs));
+				if (p->type == tt_cps_proc) {
+					cps_opt_cse_visit(ss, st, SLY_NULL, p->u.proc.k);
+				}
+			}
+		} break;
+		case tt_cps_call: {
+			avail = cse_kill_heap_reads(ss, avail);
+		} break;
+		case tt_cps_const:
+		case tt_cps_primcall: {
+			int op = expr->type == tt_cps_primcall
+				? primop_p(expr->u.primcall.prim) : -1;
+			if (op == tt_prim_vector_set) {
+				avail = cse_kill_heap_reads(ss, avail);
+				break;
+			}
+			if (expr->type == tt_cps_const ? !cse_const_p(expr)
+				: !(primop_pure_p(op) || primop_reads_heap_p(op))) {
+				break;
+			}
+			sly_value args = expr->type == tt_cps_primcall
+				? expr->u.primcall.args : SLY_NULL;
+			for (; !null_p(args); args = cdr(args)) {
+				CPS_Var_Info *vi =
+					GET_PTR(dictionary_ref(st->var_info, car(args), SLY_VOID));
+				if (vi && vi->updates) {
+					break;  // set! variables may change under us
+				}
+			}
+			sly_value var = cse_binding(graph, knext);
+			if (!null_p(args) || void_p(var)) {
+				break;
+			}
+			sly_value prev = cse_lookup(st->aliases, avail, expr);
+			if (void_p(prev)) {
+				avail = cons(ss, cons(ss, (sly_value)expr, var), avail);
+				break;
+			}
+			CLICK();
+			dictionary_set(ss, st->aliases, var, prev);
+			CPS_Kont *new_kont = cps_copy_kont(kont);
+			new_kont->u.kargs.term = cps_new_term();
+			new_kont->u.kargs.term->type = tt_cps_continue;
+			new_kont->u.kargs.term->u.cont.expr = cps_new_expr();
+			new_kont->u.kargs.term->u.cont.expr->type = tt_cps_values;
+			new_kont->u.kargs.term->u.cont.expr->u.values.args =
+				make_list(ss, 1, prev);
+			CPS_Kont *receive = cps_graph_ref(graph, knext);
+			if (receive->type == tt_cps_kreceive) {
+				knext = receive->u.kreceive.k;
+			}
+			new_kont->u.kargs.term->u.cont.k = knext;
+			cps_graph_set(ss, graph, k, new_kont);
+		} break;
+		}
+		cps_opt_cse_visit(ss, st, avail, knext);
+	} break;
+	case tt_cps_kreceive: {
+		cps_opt_cse_visit(ss, st, avail, kont->u.kreceive.k);
+	} break;
+	case tt_cps_kproc: {
+		cps_opt_cse_visit(ss, st, SLY_NULL, kont->u.kproc.body);
+	} break;
+	}
+}
+
+/* Common subexpression elimination. Pure primcalls and immediate
+ * constants that are already available on every path to them are
+ * replaced by the earlier variable; contraction then removes the
+ * resulting aliases.
+ */
+sly_value
+cps_opt_cse_phase(Sly_State *ss, sly_value graph, sly_value k, int debug)
+{
+	struct cse_state st;
+	st.graph = graph;
+	st.var_info = make_eq_dictionary(ss);
+	cps_collect_var_info(ss, graph, st.var_info, make_dictionary(ss),
+						 make_dictionary(ss), NULL, k);
+	st.preds = make_dictionary(ss);
+	cps_count_preds(ss, graph, st.preds, k);
+	st.pending = make_dictionary(ss);
+	st.aliases = make_dictionary(ss);
+	CLICK_RESET();
+	cps_opt_cse_visit(ss, &st, SLY_NULL, k);
+	if (debug) {
+		printf("CSE:\n");
+		cps_display(ss, graph, k);
+		printf("================================================\n");
+	}
+	if (CLICK_RESET()) {
+		graph = cps_opt_contraction_phase(ss, graph, k, debug);
+	}
+	return graph;
+}
+
+static void
+cps_loop_region(Sly_State *ss, sly_value graph, sly_value known,
+				sly_value self, sly_value k, sly_value *calls,
+				sly_value *defs)
+{
+	CPS_Kont *kont = cps_graph_ref(graph, k);
+	if (kont->type == tt_cps_kreceive) {
+		kont = cps_graph_ref(graph, kont->u.kreceive.k);
+	}
+	if (kont->type != tt_cps_kargs) {
+		return;
+	}
+	CPS_Term *term = kont->u.kargs.term;
+	if (term->type == tt_cps_branch) {
+		cps_loop_region(ss, graph, known, self, term->u.branch.kt, calls, defs);
+		cps_loop_region(ss, graph, known, self, term->u.branch.kf, calls, defs);
+		return;
+	}
+	CPS_Expr *expr = term->u.cont.expr;
+	if (expr->type == tt_cps_call) {
+		// the rest runs in another C function
+		if (sly_equal(dictionary_ref(known, expr->u.call.proc, SLY_FALSE), self)) {
+			*calls = cons(ss, expr->u.call.args, *calls);
+		}
+		return;
+	}
+	if (expr->type == tt_cps_const || expr->type == tt_cps_primcall) {
+		sly_value var = cse_binding(graph, term->u.cont.k);
+		if (!void_p(var)) {
+			*defs = cons(ss, cons(ss, (sly_value)expr, var), *defs);
+		}
+	}
+	cps_loop_region(ss, graph, known, self, term->u.cont.k, calls, defs);
+}
+
+/* Loop-invariant code motion for procedures whose self calls the C
+ * backend turns into jumps. A parameter is invariant when every self
+ * call passes it back unchanged, and a pure primcall is invariant when
+ * its arguments are. The result maps a kproc label to the variables
+ * bound by its invariant primcalls, which only need computing once per
+ * entry into the loop.
+ */
+sly_value
+cps_collect_loop_invariants(Sly_State *ss, sly_value graph, sly_value known,
+							sly_value var_info)
+{
+	sly_value result = make_dictionary(ss);
+	sly_value k;
+	for (size_t i = 0; dictionary_next(graph, &i, &k, NULL);) {
+		CPS_Kont *kproc = cps_graph_ref(graph, k);
+		if (kproc->type != tt_cps_kproc
+			|| kproc->u.kproc.arity.rest != SLY_FALSE) {
+			continue;
+		}
+		sly_value calls = SLY_NULL;
+		sly_value defs = SLY_NULL;
+		cps_loop_region(ss, graph, known, kproc->name, kproc->u.kproc.body,
+						&calls, &defs);
+		if (null_p(calls)) {
+			continue;
+		}
+		sly_value inv = SLY_NULL;
+		CPS_Kont *body = cps_graph_ref(graph, kproc->u.kproc.body);
+		sly_value params = body->u.kargs.vars;
+		for (size_t j = 0; !null_p(params); ++j, params = cdr(params)) {
+			sly_value p = car(params);
+			CPS_Var_Info *vi = GET_PTR(dictionary_ref(var_info, p, SLY_VOID));
+			int same = vi == NULL || vi->updates == 0;
+			for (sly_value c = calls; same && !null_p(c); c = cdr(c)) {
+				same = sly_eq(list_ref(car(c), j), p);
+			}
+			if (same) {
+				inv = cons(ss, p, inv);
+			}
+		}
+		/* defs were collected last first */
+		sly_value hoisted = SLY_NULL;
+		for (defs = list_reverse(ss, defs); !null_p(defs); defs = cdr(defs)) {
+			CPS_Expr *expr = GET_PTR(car(car(defs)));
+			sly_value var = cdr(car(defs));
+			if (expr->type == tt_cps_const) {
+				inv = cons(ss, var, inv);
+				continue;
+			}
+			if (!primop_pure_p(primop_p(expr->u.primcall.prim))) {
+				continue;
+			}
+			sly_value args = expr->u.primcall.args;
+			while (!null_p(args) && list_member(car(args), inv)) {
+				args = cdr(args);
+			}
+			if (null_p(args) && !list_member(var, hoisted)) {
+				inv = cons(ss, var, inv);
+				hoisted = cons(ss, var, hoisted);
+			}
+		}
+		if (!null_p(hoisted)) {
+			dictionary_set(ss, result, kproc->name, hoisted);
+		}
+	}
+	return result;
+}
+
+/* Type inference
+ * Every variable gets a type: a fixnum with the range of values it
+ * may hold, a flonum, or anything (top). Types flow forward from
+ * literals through arithmetic and into the parameters of procedures
+ * that are only ever called directly, and the arms of a comparison
+ * narrow the ranges of its operands. The C backend uses the result
+ * to keep numbers in C locals and leave out tag checks. Nothing is
+ * guessed: a variable whose values can't all be seen is top.
+ */
+
+static const CPS_Type type_bottom = {tt_type_bottom, 0, 0};
+static const CPS_Type type_top = {tt_type_top, 0, 0};
+static const CPS_Type type_flonum = {tt_type_flonum, 0, 0};
+static const CPS_Type type_fixnum_any = {tt_type_fixnum, INT32_MIN, INT32_MAX};
+
+static CPS_Type
+type_fixnum(i64 lo, i64 hi)
+{
+	CPS_Type t = {tt_type_fixnum, lo, hi};
+	return lo > hi ? type_bottom : t;
+}
+
+static int
+type_equal(CPS_Type a, CPS_Type b)
+{
+	return a.tag == b.tag
+		&& (a.tag != tt_type_fixnum || (a.lo == b.lo && a.hi == b.hi));
+}
+
+static CPS_Type
+type_join(CPS_Type a, CPS_Type b)
+{
+	if (a.tag == tt_type_bottom) {
+		return b;
+	}
+	if (b.tag == tt_type_bottom) {
+		return a;
+	}
+	if (a.tag != b.tag) {
+		return type_top;
+	}
+	if (a.tag == tt_type_fixnum) {
+		a.lo = b.lo < a.lo ? b.lo : a.lo;
+		a.hi = b.hi > a.hi ? b.hi : a.hi;
+	}
+	return a;
+}
+
+/* Result of + - or * on two fixnums. Sets *checked when the
+ * result may not fit in a fixnum, those values raise an error at
+ * runtime and never reach the variable.
+ */
+static CPS_Type
+type_fixnum_arith(int op, CPS_Type a, CPS_Type b, int *checked)
+{
+	i64 lo, hi;
+	switch (op) {
+	case tt_prim_add: {
+		lo = a.lo + b.lo;
+		hi = a.hi + b.hi;
+	} break;
+	case tt_prim_sub: {
+		lo = a.lo - b.hi;
+		hi = a.hi - b.lo;
+	} break;
+	default: {
+		i64 c[4] = {a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi};
+		lo = hi = c[0];
+		for (int i = 1; i < 4; ++i) {
+			lo = c[i] < lo ? c[i] : lo;
+			hi = c[i] > hi ? c[i] : hi;
+		}
+	} break;
+	}
+	if (lo < INT32_MIN) {
+		lo = INT32_MIN;
+		*checked = 1;
+	}
+	if (hi > INT32_MAX) {
+		hi = INT32_MAX;
+		*checked = 1;
+	}
+	return type_fixnum(lo, hi);
+}
+
+static int
+type_number_p(CPS_Type t)
+{
+	return t.tag == tt_type_fixnum || t.tag == tt_type_flonum;
+}
+
+struct type_state {
+	sly_value graph;
+	sly_value var_info;
+	sly_value known;
+	sly_value closed;   // kproc label => #t when all its calls are seen
+	sly_value types;    // var => CPS_Type_Info
+	sly_value preds;
+	sly_value pending;  // join label => (arrivals . env)
+	int changed;
+	int widen;
+};
+
+static CPS_Type_Info *
+type_info_ref(Sly_State *ss, struct type_state *st, sly_value var)
+{
+	sly_value p = dictionary_ref(st->types, var, SLY_VOID);
+	if (!void_p(p)) {
+		return GET_PTR(p);
+	}
+	CPS_Type_Info *info = GC_MALLOC(sizeof(*info));
+	info->type = type_bottom;
+	info->args[0] = type_bottom;
+	info->args[1] = type_bottom;
+	info->checked = 0;
+	dictionary_set(ss, st->types, var, (sly_value)info);
+	return info;
+}
+
+/* env holds (var . CPS_Type*) refinements made by the branches
+ * taken on the way here.
+ */
+static CPS_Type
+type_of(struct type_state *st, sly_value env, sly_value var)
+{
+	for (; !null_p(env); env = cdr(env)) {
+		if (sly_eq(car(car(env)), var)) {
+			return *(CPS_Type *)GET_PTR(cdr(car(env)));
+		}
+	}
+	sly_value p = dictionary_ref(st->types, var, SLY_VOID);
+	if (void_p(p)) {
+		return type_top;
+	}
+	return ((CPS_Type_Info *)GET_PTR(p))->type;
+}
+
+static CPS_Type_Info *
+type_define(Sly_State *ss, struct type_state *st, sly_value var, CPS_Type t)
+{
+	CPS_Type_Info *info = type_info_ref(ss, st, var);
+	CPS_Var_Info *vi = GET_PTR(dictionary_ref(st->var_info, var, SLY_VOID));
+	if (vi && vi->updates) {
+		t = type_top;
+	}
+	CPS_Type old = info->type;
+	t = type_join(old, t);
+	if (st->widen && old.tag == tt_type_fixnum && t.tag == tt_type_fixnum) {
+		// ranges that keep growing go straight to the limit
+		t.lo = t.lo < old.lo ? INT32_MIN : t.lo;
+		t.hi = t.hi > old.hi ? INT32_MAX : t.hi;
+	}
+	if (!type_equal(old, t)) {
+		info->type = t;
+		st->changed = 1;
+	}
+	return info;
+}
+
+static sly_value
+type_env_add(Sly_State *ss, sly_value env, sly_value var, CPS_Type t)
+{
+	CPS_Type *p = GC_MALLOC(sizeof(*p));
+	*p = t;
+	return cons(ss, cons(ss, var, (sly_value)p), env);
+}
+
+/* Only keep the refinements made on both paths into a join. */
+static sly_value
+type_env_join(Sly_State *ss, struct type_state *st, sly_value a, sly_value b)
+{
+	sly_value env = SLY_NULL;
+	for (; !null_p(a); a = cdr(a)) {
+		sly_value var = car(car(a));
+		sly_value x = b;
+		while (!null_p(x) && !sly_eq(car(car(x)), var)) {
+			x = cdr(x);
+		}
+		if (!null_p(x)) {
+			env = type_env_add(ss, env, var,
+							   type_join(*(CPS_Type *)GET_PTR(cdr(car(a))),
+										 type_of(st, b, var)));
+		}
+	}
+	return env;
+}
+
+/* x < y holds */
+static void
+type_refine_less(CPS_Type *x, CPS_Type *y)
+{
+	x->hi = y->hi - 1 < x->hi ? y->hi - 1 : x->hi;
+	y->lo = x->lo + 1 > y->lo ? x->lo + 1 : y->lo;
+}
+
+/* x <= y holds */
+static void
+type_refine_leq(CPS_Type *x, CPS_Type *y)
+{
+	x->hi = y->hi < x->hi ? y->hi : x->hi;
+	y->lo = x->lo > y->lo ? x->lo : y->lo;
+}
+
+static sly_value
+type_refine(Sly_State *ss, struct type_state *st, sly_value env,
+			CPS_Expr *cmp, int truth)
+{
+	int op = primop_p(cmp->u.primcall.prim);
+	sly_value args = cmp->u.primcall.args;
+	if (list_len(args) != 2) {
+		return env;
+	}
+	CPS_Type a = type_of(st, env, car(args));
+	CPS_Type b = type_of(st, env, car(cdr(args)));
+	if (a.tag != tt_type_fixnum || b.tag != tt_type_fixnum) {
+		return env;
+	}
+	switch (op) {
+	case tt_prim_less: {
+		truth ? type_refine_less(&a, &b) : type_refine_leq(&b, &a);
+	} break;
+	case tt_prim_gr: {
+		truth ? type_refine_less(&b, &a) : type_refine_leq(&a, &b);
+	} break;
+	case tt_prim_leq: {
+		truth ? type_refine_leq(&a, &b) : type_refine_less(&b, &a);
+	} break;
+	case tt_prim_geq: {
+		truth ? type_refine_leq(&b, &a) : type_refine_less(&a, &b);
+	} break;
+	case tt_prim_num_eq: {
+		if (!truth) {
+			return env;
+		}
+		type_refine_leq(&a, &b);
+		type_refine_leq(&b, &a);
+	} break;
+	default: return env;
+	}
+	/* an empty range means the arm is never taken */
+	a = type_fixnum(a.lo, a.hi);
+	b = type_fixnum(b.lo, b.hi);
+	env = type_env_add(ss, env, car(args), a);
+	return type_env_add(ss, env, car(cdr(args)), b);
+}
+
+static CPS_Type
+type_primcall(struct type_state *st, sly_value env, CPS_Expr *expr,
+			  CPS_Type_Info *info)
+{
+	int op = primop_p(expr->u.primcall.prim);
+	sly_value args = expr->u.primcall.args;
+	size_t nargs = list_len(args);
+	CPS_Type a = nargs > 0 ? type_of(st, env, car(args)) : type_top;
+	CPS_Type b = nargs > 1 ? type_of(st, env, car(cdr(args))) : type_top;
+	if (nargs == 2) {
+		info->args[0] = type_join(info->args[0], a);
+		info->args[1] = type_join(info->args[1], b);
+	}
+	switch (op) {
+	case tt_prim_add:
+	case tt_prim_sub:
+	case tt_prim_mul: {
+		if (nargs != 2) {
+			break;
+		}
+		if (a.tag == tt_type_bottom || b.tag == tt_type_bottom) {
+			return type_bottom;
+		}
+		if (a.tag == tt_type_fixnum && b.tag == tt_type_fixnum) {
+			return type_fixnum_arith(op, a, b, &info->checked);
+		}
+		if ((a.tag == tt_type_flonum && type_number_p(b))
+			|| (b.tag == tt_type_flonum && type_number_p(a))) {
+			return type_flonum;
+		}
+	} break;
+	case tt_prim_div: {
+		return type_flonum;
+	} break;
+	case tt_prim_mod: {
+		if (nargs == 2 && b.tag == tt_type_fixnum) {
+			i64 m = b.hi > -b.lo ? b.hi : -b.lo;
+			return type_fixnum(m > 0 ? 1 - m : 0, m > 0 ? m - 1 : 0);
+		}
+		return type_fixnum_any;
+	} break;
+	case tt_prim_idiv:
+	case tt_prim_bw_and:
+	case tt_prim_bw_ior:
+	case tt_prim_bw_xor:
+	case tt_prim_bw_eqv:
+	case tt_prim_bw_nor:
+	case tt_prim_bw_nand:
+	case tt_prim_bw_not:
+	case tt_prim_bw_shift: {
+		return type_fixnum_any;
+	} break;
+	case tt_prim_vector_length: {
+		return type_fixnum(0, INT32_MAX);
+	} break;
+	}
+	return type_top;
+}
+
+static CPS_Type
+type_constant(sly_value value)
+{
+	if (int_p(value)) {
+		i64 i = get_int(value);
+		if (i >= INT32_MIN && i <= INT32_MAX) {
+			return type_fixnum(i, i);
+		}
+	} else if (float_p(value)) {
+		return type_flonum;
+	}
+	return type_top;
+}
+
+static void
+cps_infer_types_visit(Sly_State *ss, struct type_state *st, sly_value env,
+					  sly_value k)
+{
+	sly_value graph = st->graph;
+	int npreds = get_int(dictionary_ref(st->preds, k, make_int(ss, 1)));
+	if (npreds > 1) {
+		sly_value p = dictionary_ref(st->pending, k, SLY_VOID);
+		if (void_p(p)) {
+			p = cons(ss, make_int(ss, 1), env);
+		} else {
+			p = cons(ss, make_int(ss, get_int(car(p)) + 1),
+					 type_env_join(ss, st, cdr(p), env));
+		}
+		dictionary_set(ss, st->pending, k, p);
+		if (get_int(car(p)) < npreds) {
+			return;
+		}
+		env = cdr(p);
+	}
+	CPS_Kont *kont = cps_graph_ref(graph, k);
+	switch (kont->type) {
+	case tt_cps_kargs: {
+		CPS_Term *term = kont->u.kargs.term;
+		if (term->type == tt_cps_branch) {
+			sly_value arg = term->u.branch.arg;
+			CPS_Var_Info *vi = GET_PTR(dictionary_ref(st->var_info, arg, SLY_VOID));
+			CPS_Expr *cmp = vi && vi->updates == 0 ? vi->binding : NULL;
+			sly_value tenv = env, fenv = env;
+			if (cmp && cmp->type == tt_cps_primcall) {
+				tenv = type_refine(ss, st, env, cmp, 1);
+				fenv = type_refine(ss, st, env, cmp, 0);
+			}
+			cps_infer_types_visit(ss, st, tenv, term->u.branch.kt);
+			cps_infer_types_visit(ss, st, fenv, term->u.branch.kf);
+			break;
+		}
+		CPS_Expr *expr = term->u.cont.expr;
+		sly_value knext = term->u.cont.k;
+		CPS_Kont *next = cps_graph_ref(graph, knext);
+		int received = next->type == tt_cps_kreceive;
+		if (received) {
+			next = cps_graph_ref(graph, next->u.kreceive.k);
+		}
+		sly_value vars = next->type == tt_cps_kargs ? next->u.kargs.vars : SLY_NULL;
+		switch (expr->type) {
+		case tt_cps_const: {
+			if (!null_p(vars)) {
+				type_define(ss, st, car(vars), type_constant(expr->u.constant.value));
+			}
+		} break;
+		case tt_cps_primcall: {
+			if (!null_p(vars)) {
+				CPS_Type_Info *info = type_info_ref(ss, st, car(vars));
+				type_define(ss, st, car(vars), type_primcall(st, env, expr, info));
+			}
+		} break;
+		case tt_cps_values: {
+			sly_value args = expr->u.values.args;
+			if (received) {
+				args = SLY_NULL;  // the counts are only checked at runtime
+			}
+			for (; !null_p(vars) && !null_p(args); vars = cdr(vars), args = cdr(args)) {
+				type_define(ss, st, car(vars), type_of(st, env, car(args)));
+			}
+			for (; !null_p(vars); vars = cdr(vars)) {
+				type_define(ss, st, car(vars), type_top);
+			}
+		} break;
+		case tt_cps_call: {
+			sly_value code = dictionary_ref(st->known, expr->u.call.proc, SLY_FALSE);
+			if (code != SLY_FALSE
+				&& dictionary_ref(st->closed, code, SLY_FALSE) != SLY_FALSE) {
+				CPS_Kont *kproc = cps_graph_ref(graph, code);
+				CPS_Kont *body = cps_graph_ref(graph, kproc->u.kproc.body);
+				sly_value params = body->u.kargs.vars;
+				sly_value args = expr->u.call.args;
+				if (list_len(params) == list_len(args)) {
+					for (; !null_p(params); params = cdr(params), args = cdr(args)) {
+						type_define(ss, st, car(params), type_of(st, env, car(args)));
+					}
+				}
+			}
+			for (; !null_p(vars); vars = cdr(vars)) {
+				type_define(ss, st, car(vars), type_top);
+			}
+		} break;
+		case tt_cps_proc: {
+			for (; !null_p(vars); vars = cdr(vars)) {
+				type_define(ss, st, car(vars), type_top);
+			}
+			cps_infer_types_visit(ss, st, SLY_NULL, expr->u.proc.k);
+		} break;
+		case tt_cps_fix: {
+			for (sly_value names = expr->u.fix.names; !null_p(names);
+				 names = cdr(names)) {
+				type_define(ss, st, car(names), type_top);
+			}
+			for (sly_value procs = expr->u.fix.procs; !null_p(procs);
+				 procs = cdr(procs)) {
+				CPS_Expr *p = GET_PTR(car(procs));
+				if (p->type == tt_cps_proc) {
+					cps_infer_types_visit(ss, st, SLY_NULL, p->u.proc.k);
+				}
+			}
+		} break;
+		default: {
+			for (; !null_p(vars); vars = cdr(vars)) {
+				type_define(ss, st, car(vars), type_top);
+			}
+		} break;
+		}
+		cps_infer_types_visit(ss, st, env, knext);
+	} break;
+	case tt_cps_kreceive: {
+		cps_infer_types_visit(ss, st, env, kont->u.kreceive.k);
+	} break;
+	case tt_cps_kproc: {
+		/* the parameters of a closed procedure get their types from
+		 * the call sites, until one is seen nothing reaches them */
+		CPS_Kont *body = cps_graph_ref(graph, kont->u.kproc.body);
+		int closed = dictionary_ref(st->closed, k, SLY_FALSE) != SLY_FALSE;
+		for (sly_value vars = body->u.kargs.vars; !null_p(vars); vars = cdr(vars)) {
+			if (closed) {
+				type_info_ref(ss, st, car(vars));
+			} else {
+				type_define(ss, st, car(vars), type_top);
+			}
+		}
+		cps_infer_types_visit(ss, st, SLY_NULL, kont->u.kproc.body);
+	} break;
+	}
+}
+
+/* A procedure is closed when every reference to it is the operator
+ * of a call, or the one set! that binds it to a global.
+ */
+static sly_value
+cps_closed_procs(Sly_State *ss, sly_value graph, sly_value known,
+				 sly_value var_info)
+{
+	sly_value calls = make_dictionary(ss);
+	sly_value k;
+	for (size_t i = 0; dictionary_next(graph, &i, &k, NULL);) {
+		CPS_Kont *kont = cps_graph_ref(graph, k);
+		if (kont->type != tt_cps_kargs
+			|| kont->u.kargs.term->type != tt_cps_continue) {
+			continue;
+		}
+		CPS_Expr *expr = kont->u.kargs.term->u.cont.expr;
+		sly_value var = SLY_VOID;
+		if (expr->type == tt_cps_call) {
+			var = expr->u.call.proc;
+		} else if (expr->type == tt_cps_set
+				   && sly_equal(dictionary_ref(known, expr->u.set.var, SLY_FALSE),
+								dictionary_ref(known, expr->u.set.val, SLY_TRUE))) {
+			var = expr->u.set.val;
+		}
+		if (!void_p(var)) {
+			sly_value n = dictionary_ref(calls, var, make_int(ss, 0));
+			dictionary_set(ss, calls, var, make_int(ss, get_int(n) + 1));
+		}
+	}
+	sly_value closed = make_dictionary(ss);
+	sly_value open = make_dictionary(ss);
+	sly_value var, code;
+	for (size_t i = 0; dictionary_next(known, &i, &var, &code);) {
+		CPS_Var_Info *vi = GET_PTR(dictionary_ref(var_info, var, SLY_VOID));
+		int uses = 0;
+		for (; vi; vi = vi->alt) {
+			uses += vi->used + vi->escapes;
+		}
+		if (uses != get_int(dictionary_ref(calls, var, make_int(ss, 0)))) {
+			dictionary_set(ss, open, code, SLY_TRUE);
+		}
+	}
+	for (size_t i = 0; dictionary_next(known, &i, NULL, &code);) {
+		CPS_Kont *kproc = cps_graph_ref(graph, code);
+		if (kproc->type == tt_cps_kproc
+			&& kproc->u.kproc.arity.rest == SLY_FALSE
+			&& !dictionary_has(open, code)) {
+			dictionary_set(ss, closed, code, SLY_TRUE);
+		}
+	}
+	return closed;
+}
+
+/* Infer the types of the variables reachable from k. known maps
+ * variables to the kproc they are bound to (as collected by the C
+ * backend) and var_info is the global variable info. Returns a
+ * dictionary from variables to CPS_Type_Info.
+ */
+sly_value
+cps_infer_types(Sly_State *ss, sly_value graph, sly_value k, sly_value known,
+				sly_value var_info)
+{
+	struct type_state st;
+	st.graph = graph;
+	st.var_info = var_info;
+	st.known = known;
+	st.closed = cps_closed_procs(ss, graph, known, var_info);
+	st.types = make_eq_dictionary(ss);
+	st.preds = make_dictionary(ss);
+	cps_count_preds(ss, graph, st.preds, k);
+	st.widen = 0;
+	for (int round = 0;; ++round) {
+		st.changed = 0;
+		st.widen = round > 2;
+		st.pending = make_dictionary(ss);
+		cps_infer_types_visit(ss, &st, SLY_NULL, k);
+		if (!st.changed) {
+			break;
+		}
+	}
+	return st.types;
+}
+
 #if 0
 sly_value
 cps_make_tail_calls_explicit(Sly_State *ss, sly_value graph, sly_value k)
 {
 	CPS_Kont *kont = cps_graph_ref(graph, start);
-	sly_value new_graph = make_dictionary(ss);
+	sly_value new_graph = make_eq_dictionary(ss);
 	switch (kont->type) {
 	case tt_cps_kargs: {
 		CPS_Term *term = kont->u.kargs.term;
@@ -2266,167 +3394,247 @@ cps_collect_free_variables_visit_expr(Sly_State *ss, CPS_Expr *expr)
 	return SLY_NULL;
 }
 
-static sly_value
-_cps_collect_free_variables(Sly_State *ss, sly_value graph,
-						   sly_value var_info,
-						   sly_value total_vars,
-						   sly_value local_vars,
-						   sly_value free_info,
-						   sly_value visited,
-						   sly_value k)
-{
-	if (!void_p(dictionary_ref(visited, k, SLY_VOID))) {
-		return list_subtract(ss, total_vars, local_vars);
-	}
-	dictionary_set(ss, visited, k, SLY_TRUE);
+static void
+cps_index_add(Sly_State *ss, sly_value ids, size_t *n, sly_value x)
+{
+	if (symbol_p(x) && !dictionary_has(ids, x)) {
+		dictionary_set(ss, ids, x, make_int(ss, (*n)++));
+	}
+}
+
+static void
+cps_index_add_list(Sly_State *ss, CPS_Index *ix, sly_value lst)
+{
+	for (; pair_p(lst); lst = cdr(lst)) {
+		cps_index_add(ss, ix->var_ids, &ix->nvars, car(lst));
+	}
+}
+
+static void
+cps_index_visit(Sly_State *ss, CPS_Index *ix, sly_value graph, sly_value k)
+{
+	if (dictionary_has(ix->label_ids, k)) {
+		return;
+	}
+	cps_index_add(ss, ix->label_ids, &ix->nlabels, k);
 	CPS_Kont *kont = cps_graph_ref(graph, k);
 	switch (kont->type) {
 	case tt_cps_kargs: {
 		CPS_Term *term = kont->u.kargs.term;
-		total_vars = list_union(ss, total_vars, kont->u.kargs.vars);
-		local_vars = list_union(ss, local_vars, kont->u.kargs.vars);
-		if (term->type == tt_cps_continue) {
+		cps_index_add_list(ss, ix, kont->u.kargs.vars);
+		if (term->type == tt_cps_branch) {
+			cps_index_add(ss, ix->var_ids, &ix->nvars, term->u.branch.arg);
+			cps_index_visit(ss, ix, graph, term->u.branch.kt);
+			cps_index_visit(ss, ix, graph, term->u.branch.kf);
+			break;
+		}
+		CPS_Expr *expr = term->u.cont.expr;
+		cps_index_add_list(ss, ix, cps_collect_free_variables_visit_expr(ss, expr));
+		if (expr->type == tt_cps_proc) {
+			cps_index_visit(ss, ix, graph, expr->u.proc.k);
+		} else if (expr->type == tt_cps_fix) {
+			cps_index_add_list(ss, ix, expr->u.fix.names);
+			for (sly_value procs = expr->u.fix.procs; !null_p(procs);
+				 procs = cdr(procs)) {
+				CPS_Expr *p = GET_PTR(car(procs));
+				if (p->type == tt_cps_proc) {
+					cps_index_visit(ss, ix, graph, p->u.proc.k);
+				}
+			}
+		}
+		cps_index_visit(ss, ix, graph, term->u.cont.k);
+	} break;
+	case tt_cps_kreceive: {
+		cps_index_visit(ss, ix, graph, kont->u.kreceive.k);
+	} break;
+	case tt_cps_kproc: {
+		cps_index_add_list(ss, ix, kont->u.kproc.arity.req);
+		cps_index_add(ss, ix->var_ids, &ix->nvars, kont->u.kproc.arity.rest);
+		cps_index_visit(ss, ix, graph, kont->u.kproc.body);
+	} break;
+	case tt_cps_ktail: break;
+	default: sly_assert(0, "Error Invalid continuation");
+	}
+}
+
+/* Number the labels and variables reachable from k, in the order
+ * they are first seen. The numbering only depends on the shape of
+ * the graph, so anything ordered by it is the same from one run to
+ * the next.
+ */
+CPS_Index *
+cps_index_build(Sly_State *ss, sly_value graph, sly_value k)
+{
+	CPS_Index *ix = GC_MALLOC(sizeof(*ix));
+	ix->nlabels = 0;
+	ix->nvars = 0;
+	ix->label_ids = make_eq_dictionary(ss);
+	ix->var_ids = make_eq_dictionary(ss);
+	cps_index_visit(ss, ix, graph, k);
+	ix->labels = GC_MALLOC((ix->nlabels + 1) * sizeof(*ix->labels));
+	ix->konts = GC_MALLOC((ix->nlabels + 1) * sizeof(*ix->konts));
+	ix->vars = GC_MALLOC((ix->nvars + 1) * sizeof(*ix->vars));
+	sly_value key, id;
+	for (size_t i = 0; dictionary_next(ix->label_ids, &i, &key, &id);) {
+		ix->labels[get_int(id)] = key;
+		ix->konts[get_int(id)] = cps_graph_ref(graph, key);
+	}
+	for (size_t i = 0; dictionary_next(ix->var_ids, &i, &key, &id);) {
+		ix->vars[get_int(id)] = key;
+	}
+	return ix;
+}
+
+size_t
+cps_index_label(CPS_Index *ix, sly_value k)
+{
+	sly_value id = dictionary_ref(ix->label_ids, k, SLY_VOID);
+	sly_assert(!void_p(id), "Error label not indexed");
+	return get_int(id);
+}
+
+size_t
+cps_index_var(CPS_Index *ix, sly_value var)
+{
+	sly_value id = dictionary_ref(ix->var_ids, var, SLY_VOID);
+	sly_assert(!void_p(id), "Error variable not indexed");
+	return get_int(id);
+}
+
+/* Sets of variables, as bitsets over CPS_Index variable ids. */
+
+static u64 *
+bitset_make(size_t nbits)
+{
+	return GC_MALLOC(((nbits + 63) / 64 + 1) * sizeof(u64));
+}
+
+static void
+bitset_add(u64 *set, size_t i)
+{
+	set[i / 64] |= (u64)1 << (i % 64);
+}
+
+static void
+bitset_union(u64 *dst, u64 *src, size_t nbits)
+{
+	for (size_t i = 0; i < (nbits + 63) / 64; ++i) {
+		dst[i] |= src[i];
+	}
+}
+
+static void
+bitset_add_list(CPS_Index *ix, u64 *set, sly_value lst)
+{
+	for (; pair_p(lst); lst = cdr(lst)) {
+		if (symbol_p(car(lst))) {
+			bitset_add(set, cps_index_var(ix, car(lst)));
+		}
+	}
+}
+
+static void
+bitset_remove_list(CPS_Index *ix, u64 *set, sly_value lst)
+{
+	for (; pair_p(lst); lst = cdr(lst)) {
+		size_t i = cps_index_var(ix, car(lst));
+		set[i / 64] &= ~((u64)1 << (i % 64));
+	}
+}
+
+/* The variables of set, ordered by id. */
+static sly_value
+bitset_to_list(Sly_State *ss, CPS_Index *ix, u64 *set)
+{
+	sly_value lst = SLY_NULL;
+	for (size_t i = ix->nvars; i-- > 0;) {
+		if (set[i / 64] & ((u64)1 << (i % 64))) {
+			lst = cons(ss, ix->vars[i], lst);
+		}
+	}
+	return lst;
+}
+
+struct free_state {
+	CPS_Index *index;
+	u64 **free;         // label id => free variables
+	sly_value closures; // labels that need their free variables
+};
+
+/* The variables referenced from k or anything after it that are
+ * bound outside of it. Each label is computed once.
+ */
+static u64 *
+cps_free_vars_visit(Sly_State *ss, struct free_state *st, sly_value k)
+{
+	CPS_Index *ix = st->index;
+	size_t id = cps_index_label(ix, k);
+	if (st->free[id]) {
+		return st->free[id];
+	}
+	u64 *fv = bitset_make(ix->nvars);
+	st->free[id] = fv;
+	CPS_Kont *kont = ix->konts[id];
+	switch (kont->type) {
+	case tt_cps_kargs: {
+		CPS_Term *term = kont->u.kargs.term;
+		if (term->type == tt_cps_branch) {
+			bitset_add(fv, cps_index_var(ix, term->u.branch.arg));
+			bitset_union(fv, cps_free_vars_visit(ss, st, term->u.branch.kt), ix->nvars);
+			bitset_union(fv, cps_free_vars_visit(ss, st, term->u.branch.kf), ix->nvars);
+		} else {
 			CPS_Expr *expr = term->u.cont.expr;
-			total_vars = list_union(ss, total_vars,
-									cps_collect_free_variables_visit_expr(ss, expr));
-			sly_value free_vars = SLY_NULL;
-			sly_value cont_vars = SLY_NULL;
+			bitset_add_list(ix, fv, cps_collect_free_variables_visit_expr(ss, expr));
 			if (expr->type == tt_cps_call) {
-				sly_value info = dictionary_ref(var_info, k, SLY_VOID);
-				CPS_Var_Info *vi = GET_PTR(dictionary_ref(info, expr->u.call.proc, SLY_VOID));
-				if (vi
-					&& vi->binding
-					&& vi->binding->type == tt_cps_proc) {
-					CPS_Expr *proc = vi->binding;
-					sly_value kproc = proc->u.proc.k;
-					sly_value kfv = dictionary_ref(free_info, kproc, SLY_VOID);
-					if (void_p(kfv)) {
-						free_vars = _cps_collect_free_variables(ss, graph,
-																var_info,
-																SLY_NULL,
-																SLY_NULL,
-																free_info,
-																visited,
-																kproc);
-						dictionary_set(ss, free_info, kproc, free_vars);
-					} else {
-						free_vars = list_union(ss, kfv, free_vars);
-					}
-				}
-				cont_vars = _cps_collect_free_variables(ss, graph,
-														var_info,
-														SLY_NULL,
-														SLY_NULL,
-														free_info,
-														visited,
-														term->u.cont.k);
-				dictionary_set(ss, free_info, term->u.cont.k, cont_vars);
-				return list_union(ss, list_subtract(ss, total_vars, local_vars), cont_vars);
+				st->closures = cons(ss, term->u.cont.k, st->closures);
 			} else if (expr->type == tt_cps_proc) {
-				sly_value kproc = expr->u.proc.k;
-				free_vars = _cps_collect_free_variables(ss, graph,
-														var_info,
-														SLY_NULL,
-														SLY_NULL,
-														free_info,
-														visited,
-														kproc);
-				dictionary_set(ss, free_info, kproc, free_vars);
+				st->closures = cons(ss, expr->u.proc.k, st->closures);
+				bitset_union(fv, cps_free_vars_visit(ss, st, expr->u.proc.k), ix->nvars);
 			} else if (expr->type == tt_cps_fix) {
-				local_vars = list_union(ss, local_vars, expr->u.fix.names);
-				sly_value procs = expr->u.fix.procs;
-				while (!null_p(procs)) {
-					CPS_Expr *expr = GET_PTR(car(procs));
-					if (expr->type == tt_cps_proc) {
-						sly_value kproc = expr->u.proc.k;
-						sly_value tmp = _cps_collect_free_variables(ss, graph,
-																	var_info,
-																	SLY_NULL,
-																	SLY_NULL,
-																	free_info,
-																	visited,
-																	kproc);
-						dictionary_set(ss, free_info, kproc, tmp);
-						free_vars = list_union(ss, free_vars, tmp);
+				for (sly_value procs = expr->u.fix.procs; !null_p(procs);
+					 procs = cdr(procs)) {
+					CPS_Expr *p = GET_PTR(car(procs));
+					if (p->type == tt_cps_proc) {
+						st->closures = cons(ss, p->u.proc.k, st->closures);
+						bitset_union(fv, cps_free_vars_visit(ss, st, p->u.proc.k),
+									 ix->nvars);
 					}
-					procs = cdr(procs);
 				}
 			}
-			if (null_p(cont_vars)) {
-				cont_vars = _cps_collect_free_variables(ss, graph,
-														var_info,
-														total_vars,
-														local_vars,
-														free_info,
-														visited,
-														term->u.cont.k);
-			}
-			free_vars = list_subtract(ss,
-									  list_union(ss, free_vars, cont_vars),
-									  local_vars);
-//			free_vars = list_union(ss, list_subtract(ss, total_vars, local_vars), cont_vars);
-			return free_vars;
-		} else if (term->type == tt_cps_branch) {
-			total_vars = cons(ss, term->u.branch.arg, total_vars);
-			return list_union(ss, _cps_collect_free_variables(ss, graph,
-															  var_info,
-															  total_vars,
-															  local_vars,
-															  free_info,
-															  visited,
-															  term->u.branch.kt),
-							  _cps_collect_free_variables(ss, graph,
-														  var_info,
-														  total_vars,
-														  local_vars,
-														  free_info,
-														  visited,
-														  term->u.branch.kf));
-		} else {
-			sly_assert(0, "unreachable");
+			bitset_union(fv, cps_free_vars_visit(ss, st, term->u.cont.k), ix->nvars);
+			if (expr->type == tt_cps_fix) {
+				bitset_remove_list(ix, fv, expr->u.fix.names);
+			}
 		}
+		bitset_remove_list(ix, fv, kont->u.kargs.vars);
 	} break;
 	case tt_cps_kreceive: {
-		CPS_Kont *next = cps_graph_ref(graph, kont->u.kreceive.k);
-		sly_value free_vars = _cps_collect_free_variables(ss, graph,
-														  var_info,
-														  total_vars,
-														  local_vars,
-														  free_info,
-														  visited,
-														  kont->u.kreceive.k);
-		return list_subtract(ss, free_vars, next->u.kargs.vars);
+		bitset_union(fv, cps_free_vars_visit(ss, st, kont->u.kreceive.k), ix->nvars);
 	} break;
 	case tt_cps_kproc: {
-		CPS_Kont *next = cps_graph_ref(graph, kont->u.kproc.body);
-		sly_value free_vars = _cps_collect_free_variables(ss, graph,
-														  var_info,
-														  SLY_NULL,
-														  SLY_NULL,
-														  free_info,
-														  visited,
-														  kont->u.kproc.body);
-		return list_subtract(ss, free_vars, next->u.kargs.vars);
+		bitset_union(fv, cps_free_vars_visit(ss, st, kont->u.kproc.body), ix->nvars);
 	} break;
 	case tt_cps_ktail: break;
 	default: sly_assert(0, "unreachable");
 	}
-	return list_subtract(ss, total_vars, local_vars);
+	return fv;
 }
 
 sly_value
 cps_collect_free_variables(Sly_State *ss, sly_value graph,
-						   sly_value var_info, sly_value k)
+						   UNUSED_ATTR sly_value var_info, sly_value k)
 {
+	struct free_state st;
+	st.index = cps_index_build(ss, graph, k);
+	st.free = GC_MALLOC((st.index->nlabels + 1) * sizeof(*st.free));
+	st.closures = make_list(ss, 1, k);
+	cps_free_vars_visit(ss, &st, k);
 	sly_value free_info = make_dictionary(ss);
-	sly_value vs = _cps_collect_free_variables(ss, graph,
-											   var_info,
-											   SLY_NULL,
-											   SLY_NULL,
-											   free_info,
-											   make_dictionary(ss),
-											   k);
-	dictionary_set(ss, free_info, k, vs);
+	for (sly_value c = st.closures; !null_p(c); c = cdr(c)) {
+		size_t id = cps_index_label(st.index, car(c));
+		dictionary_set(ss, free_info, car(c),
+					   bitset_to_list(ss, st.index, st.free[id]));
+	}
 	return free_info;
 }
 
@@ -2565,13 +3773,9 @@ cps_free_vars_in_k(Sly_State *ss, sly_value graph, sly_value k)
 {
 	sly_value free = make_dictionary(ss);
 	_cps_free_vars_in_k(ss, graph, free, make_dictionary(ss), k);
-	vector *vec = GET_PTR(free);
-	sly_value free_vars = SLY_NULL;
-	for (size_t i = 0; i < vec->cap; ++i) {
-		sly_value entry = vec->elems[i];
-		if (!slot_is_free(entry)) {
-			free_vars = cons(ss, car(entry), free_vars);
-		}
+	sly_value var, free_vars = SLY_NULL;
+	for (size_t i = 0; dictionary_next(free, &i, &var, NULL);) {
+		free_vars = cons(ss, var, free_vars);
 	}
 	return free_vars;
 }
@@ -2826,37 +4030,30 @@ cps_display(Sly_State *ss, sly_value graph, sly_value k)
 void
 cps_display_var_info(Sly_State *ss, sly_value var_info)
 {
-	vector *v = GET_PTR(var_info);
-	for (size_t i = 0; i < v->cap; ++i) {
-		sly_value entry = v->elems[i];
-		if (!slot_is_free(entry)) {
-			sly_display(car(entry), 1);
-			printf(":\n");
-			vector *w = GET_PTR(cdr(entry));
-			if (w) {
-				for (size_t j = 0; j < w->cap; ++j) {
-					sly_value entry = w->elems[j];
-					if (!slot_is_free(entry)) {
-						sly_value name = car(entry);
-						CPS_Var_Info *info = GET_PTR(cdr(entry));
-						while (info) {
-							sly_display(name, 1);
-							if (info->binding) {
-								printf(" = { used = %d, escapes = %d, "
-									   "updates = %d, binding = ",
-									   info->used, info->escapes,
-									   info->updates);
-								cps_display_visit_expr(ss, info->binding);
-								printf(" }");
-							}
-							printf("\n");
-							info = info->alt;
-						}
-						printf("\n");
+	sly_value k, tbl;
+	for (size_t i = 0; dictionary_next(var_info, &i, &k, &tbl);) {
+		sly_display(k, 1);
+		printf(":\n");
+		if (!void_p(tbl)) {
+			sly_value name, vi;
+			for (size_t j = 0; dictionary_next(tbl, &j, &name, &vi);) {
+				CPS_Var_Info *info = GET_PTR(vi);
+				while (info) {
+					sly_display(name, 1);
+					if (info->binding) {
+						printf(" = { used = %d, escapes = %d, "
+							   "updates = %d, binding = ",
+							   info->used, info->escapes,
+							   info->updates);
+						cps_display_visit_expr(ss, info->binding);
+						printf(" }");
 					}
+					printf("\n");
+					info = info->alt;
 				}
+				printf("\n");
 			}
-			printf("\n");
 		}
+		printf("\n");
 	}
 }
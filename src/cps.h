@@ -58,6 +58,7 @@ enum prim {
 	tt_prim_vector,
 	tt_prim_vector_ref,
 	tt_prim_vector_set,
+	tt_prim_vector_length,
 };
 
 typedef sly_value (*fn_primop)(Sly_State *ss, sly_value arg_list);
@@ -243,6 +244,40 @@ typedef struct _var_info {
 	struct _var_info *alt;
 } CPS_Var_Info;
 
+/* types inferred for variables (see cps_infer_types) */
+enum cps_type_tag {
+	tt_type_bottom = 0,  // no value has reached it (yet)
+	tt_type_fixnum,
+	tt_type_flonum,
+	tt_type_top,
+};
+
+typedef struct _cps_type {
+	int tag;
+	i64 lo;  // range of a fixnum
+	i64 hi;
+} CPS_Type;
+
+typedef struct _cps_type_info {
+	CPS_Type type;     // type of the variable
+	CPS_Type args[2];  // argument types of the primcall that binds it
+	int checked;       // fixnum result of that primcall may overflow
+} CPS_Type_Info;
+
+/* Dense numbering of the labels and variables reachable from a
+ * continuation (see cps_index_build). Analyses that need sets of
+ * variables use it to work on bitsets instead of lists.
+ */
+typedef struct _cps_index {
+	size_t nlabels;
+	size_t nvars;
+	sly_value label_ids;  // label => id
+	sly_value var_ids;    // variable => id
+	sly_value *labels;    // id => label
+	sly_value *vars;      // id => variable
+	CPS_Kont **konts;     // id => continuation
+} CPS_Index;
+
 sly_value cps_gensym_temporary_name(Sly_State *ss);
 CPS_Kont *cps_graph_ref(sly_value graph, sly_value k);
 void cps_graph_set(Sly_State *ss, sly_value graph, sly_value k, CPS_Kont *kont);
@@ -259,12 +294,20 @@ sly_value cps_collect_var_info(Sly_State *ss, sly_value graph, sly_value global_
 sly_value cps_collect_free_variables(Sly_State *ss, sly_value graph,
 									 sly_value var_info, sly_value k);
 sly_value cps_opt_contraction_phase(Sly_State *ss, sly_value graph, sly_value k, int debug);
+sly_value cps_opt_cse_phase(Sly_State *ss, sly_value graph, sly_value k, int debug);
+sly_value cps_collect_loop_invariants(Sly_State *ss, sly_value graph, sly_value known,
+									  sly_value var_info);
 void cps_init_primops(Sly_State *ss);
 sly_value cps_translate(Sly_State *ss, sly_value cc, sly_value graph, sly_value form);
 void cps_display(Sly_State *ss, sly_value graph, sly_value k);
 void cps_display_var_info(Sly_State *ss, sly_value var_info);
 sly_value cps_free_vars_in_k(Sly_State *ss, sly_value graph, sly_value k);
+CPS_Index *cps_index_build(Sly_State *ss, sly_value graph, sly_value k);
+size_t cps_index_label(CPS_Index *ix, sly_value k);
+size_t cps_index_var(CPS_Index *ix, sly_value var);
 void cps_display_free_vars_foreach_k(Sly_State *ss, sly_value graph, sly_value k);
+sly_value cps_infer_types(Sly_State *ss, sly_value graph, sly_value k,
+						  sly_value known, sly_value var_info);
 int primop_p(sly_value name);
 
 #endif /* SLY_CPS_H_ */
@@ -7,12 +7,9 @@
 #include "eval.h"
 
 stack_frame *
-make_eval_stack(Sly_State *ss, sly_value regs)
+make_eval_stack(Sly_State *ss, size_t nregs)
 {
-	stack_frame *frame = GC_MALLOC(sizeof(*frame));
-	frame->type = tt_stack_frame;
-	frame->cont = SLY_NULL;
-	frame->R = regs;
+	stack_frame *frame = vm_push_frame(ss, nregs);
 	frame->code = make_vector(ss, 0, 4);
 	frame->pc = 0;
 	frame->level = 0;
@@ -23,17 +20,25 @@ make_eval_stack(Sly_State *ss, sly_value regs)
 sly_value
 call_closure(Sly_State *ss, sly_value call_list)
 {
-	stack_frame *nframe = make_eval_stack(ss, call_list);
-	size_t len = vector_len(nframe->R);
+	stack_frame *tmp = ss->frame;
+	stack_pos base = ss->base;
+	stack_pos mark = vm_stack_mark(ss);
+	ss->base = mark;
+	size_t len = vector_len(call_list);
+	stack_frame *nframe = make_eval_stack(ss, len);
+	for (size_t i = 0; i < len; ++i) {
+		nframe->R[i] = vector_ref(call_list, i);
+	}
 	vector_append(ss, nframe->code, iAB(OP_CALL, 0, len, -1));
 	//vector_append(ss, nframe->code, iA(OP_RETURN, 0, -1));
-	stack_frame *tmp = ss->frame;
 	ss->frame = nframe;
 	ss->frame->clos = vector_ref(call_list, 0);
 	closure *clos = GET_PTR(ss->frame->clos);
 	ss->frame->U = clos->upvals;
 	sly_value val = vm_run(ss);
 	ss->frame = tmp;
+	ss->sp = mark;
+	ss->base = base;
 	return val;
 }
 
@@ -41,20 +46,18 @@ sly_value
 eval_closure(Sly_State *ss, sly_value _clos, sly_value args)
 {
 	stack_frame *tmp = ss->frame;
-	ss->frame = GC_MALLOC(sizeof(stack_frame));
-	ss->frame->type = tt_stack_frame;
-	ss->frame->cont = SLY_NULL;
+	stack_pos base = ss->base;
+	stack_pos mark = vm_stack_mark(ss);
+	ss->base = mark;
 	closure *clos = GET_PTR(_clos);
 	prototype *proto = GET_PTR(clos->proto);
-	ss->frame->K = proto->K;
-	ss->frame->U = clos->upvals;
 	size_t len = proto->nregs + proto->has_varg;
 	size_t nargs = proto->nargs + proto->has_varg;
-	ss->frame->R = make_vector(ss, len, len);
-	if (nargs) {
-		for (size_t i = 0; i < nargs; ++i) {
-			vector_set(ss->frame->R, i, vector_ref(args, i));
-		}
+	ss->frame = vm_push_frame(ss, len);
+	ss->frame->K = proto->K;
+	ss->frame->U = clos->upvals;
+	for (size_t i = 0; i < nargs; ++i) {
+		ss->frame->R[i] = vector_ref(args, i);
 	}
 	ss->frame->code = proto->code;
 	ss->frame->pc = proto->entry;
@@ -63,5 +66,7 @@ eval_closure(Sly_State *ss, sly_value _clos, sly_value args)
 	ss->frame->cont = SLY_NULL;
 	sly_value rv = vm_run(ss);
 	ss->frame = tmp;
+	ss->sp = mark;
+	ss->base = base;
 	return rv;
 }
@@ -0,0 +1,714 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "sly_types.h"
+#include "opcodes.h"
+#include "parser.h"
+#include "image.h"
+
+#define IMAGE_MAGIC   0x49594c53 // "SLYI"
+#define IMAGE_VERSION 3
+#define IMAGE_MAX_PATH 4096
+#define IMAGE_MAX_PAYLOAD (1LU << 30)
+#define FNV_OFFSET 0xcbf29ce484222325
+#define MEMO_INIT_SIZE 1024
+
+enum image_tag {
+	img_imm = 0,      // any non heap value, written as is
+	img_ref,          // back reference to an object already in the image
+	img_special,      // index into the specials vector
+	img_pair,
+	img_cell,         // entry of the globals dictionary
+	img_int,
+	img_float,
+	img_symbol,       // interned symbol
+	img_gensym,       // uninterned symbol
+	img_string,
+	img_byte_vector,
+	img_vector,
+	img_dictionary,
+	img_syntax,
+	img_prototype,
+};
+
+struct image_writer {
+	Sly_State *ss;
+	FILE *file;
+	image_source *srcs;
+	size_t nsrcs;
+	sly_value specials;
+	sly_value *memo;     // open addressing table of written objects
+	u64 *memo_idx;
+	size_t memo_cap;
+	size_t memo_len;
+	u64 payload_len;     // bytes written after the header
+	u64 payload_sum;     // and their hash
+	int in_payload;
+	int err;
+};
+
+struct image_reader {
+	Sly_State *ss;
+	FILE *file;
+	image_source *srcs;
+	size_t nsrcs;
+	sly_value specials;
+	sly_value *objs;     // objects in the order they were written
+	size_t len;
+	size_t cap;
+	int err;
+};
+
+static u64
+hash_bytes(u64 h, void *buf, size_t len)
+{ // FNV-1a
+	u8 *bytes = buf;
+	for (size_t i = 0; i < len; ++i) {
+		h ^= bytes[i];
+		h *= 0x100000001b3;
+	}
+	return h;
+}
+
+u64
+sly_image_hash(char *text, size_t len)
+{
+	return hash_bytes(FNV_OFFSET, text, len);
+}
+
+char *
+sly_cache_path(char *file_path, char *suffix)
+{
+	char *dir = getenv("SLY_CACHE_DIR");
+	size_t len = strlen(file_path);
+	size_t slen = strlen(suffix);
+	char *path;
+	if (dir == NULL || dir[0] == '\0') {
+		path = GC_MALLOC(len + slen + 1);
+		memcpy(path, file_path, len);
+		memcpy(path + len, suffix, slen + 1);
+		return path;
+	}
+	/* flatten the source path into a single file name */
+	size_t dlen = strlen(dir);
+	path = GC_MALLOC(dlen + len + slen + 2);
+	memcpy(path, dir, dlen);
+	path[dlen] = '/';
+	for (size_t i = 0; i < len; ++i) {
+		path[dlen+1+i] = file_path[i] == '/' ? '%' : file_path[i];
+	}
+	memcpy(path + dlen + 1 + len, suffix, slen + 1);
+	return path;
+}
+
+char *
+sly_image_path(char *file_path)
+{
+	return sly_cache_path(file_path, "c");
+}
+
+static void
+put_bytes(struct image_writer *w, void *buf, size_t size)
+{
+	if (fwrite(buf, 1, size, w->file) != size) {
+		w->err = 1;
+	}
+	if (w->in_payload) {
+		w->payload_len += size;
+		w->payload_sum = hash_bytes(w->payload_sum, buf, size);
+	}
+}
+
+static void
+put_u8(struct image_writer *w, u8 x)
+{
+	put_bytes(w, &x, sizeof(x));
+}
+
+static void
+put_u32(struct image_writer *w, u32 x)
+{
+	put_bytes(w, &x, sizeof(x));
+}
+
+static void
+put_u64(struct image_writer *w, u64 x)
+{
+	put_bytes(w, &x, sizeof(x));
+}
+
+static void
+put_raw_vector(struct image_writer *w, sly_value v)
+{ // vector of untagged words (code, uplist)
+	vector *vec = GET_PTR(v);
+	put_u64(w, vec->len);
+	put_bytes(w, vec->elems, vec->len * sizeof(sly_value));
+}
+
+static size_t
+memo_slot(sly_value *memo, size_t cap, sly_value v)
+{
+	size_t i = (v >> 3) % cap;
+	while (memo[i] != SLY_VOID && memo[i] != v) {
+		i = (i + 1) % cap;
+	}
+	return i;
+}
+
+static int
+memo_lookup(struct image_writer *w, sly_value v, u64 *idx)
+{
+	size_t i = memo_slot(w->memo, w->memo_cap, v);
+	if (w->memo[i] == SLY_VOID) {
+		return 0;
+	}
+	*idx = w->memo_idx[i];
+	return 1;
+}
+
+static void
+memo_add(struct image_writer *w, sly_value v)
+{
+	if ((w->memo_len + 1) * 2 > w->memo_cap) {
+		size_t cap = w->memo_cap * 2;
+		sly_value *memo = GC_MALLOC(cap * sizeof(*memo));
+		u64 *memo_idx = GC_MALLOC(cap * sizeof(*memo_idx));
+		for (size_t i = 0; i < w->memo_cap; ++i) {
+			if (w->memo[i] != SLY_VOID) {
+				size_t j = memo_slot(memo, cap, w->memo[i]);
+				memo[j] = w->memo[i];
+				memo_idx[j] = w->memo_idx[i];
+			}
+		}
+		w->memo = memo;
+		w->memo_idx = memo_idx;
+		w->memo_cap = cap;
+	}
+	size_t i = memo_slot(w->memo, w->memo_cap, v);
+	w->memo[i] = v;
+	w->memo_idx[i] = w->memo_len++;
+}
+
+static int
+global_cell_p(Sly_State *ss, sly_value v)
+{
+	if (!symbol_p(car(v))) {
+		return 0;
+	}
+	return dictionary_entry_ref(ss->cc->globals, car(v)) == v;
+}
+
+static int
+interned_p(Sly_State *ss, sly_value sym)
+{
+	symbol *s = GET_PTR(sym);
+	return dictionary_string_ref(ss->interned, (char *)s->name, s->len,
+								 SLY_VOID) == sym;
+}
+
+static i32
+source_index(struct image_writer *w, char *src)
+{
+	if (src == NULL) {
+		return -1;
+	}
+	for (size_t i = 0; i < w->nsrcs; ++i) {
+		if (w->srcs[i].text == src) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void
+write_value(struct image_writer *w, sly_value v)
+{
+	if (w->err) return;
+	if (!ptr_p(v)) {
+		put_u8(w, img_imm);
+		put_u64(w, v);
+		return;
+	}
+	u64 idx;
+	if (memo_lookup(w, v, &idx)) {
+		put_u8(w, img_ref);
+		put_u64(w, idx);
+		return;
+	}
+	for (size_t i = 0; i < vector_len(w->specials); ++i) {
+		if (vector_ref(w->specials, i) == v) {
+			put_u8(w, img_special);
+			put_u64(w, i);
+			return;
+		}
+	}
+	Sly_State *ss = w->ss;
+	switch (TYPEOF(v)) {
+	case tt_pair: {
+		if (global_cell_p(ss, v)) {
+			put_u8(w, img_cell);
+			memo_add(w, v);
+			write_value(w, car(v));
+			return;
+		}
+		put_u8(w, img_pair);
+		memo_add(w, v);
+		write_value(w, car(v));
+		write_value(w, cdr(v));
+	} break;
+	case tt_int: {
+		put_u8(w, img_int);
+		memo_add(w, v);
+		put_u64(w, get_int(v));
+	} break;
+	case tt_float: {
+		number *n = GET_PTR(v);
+		put_u8(w, img_float);
+		memo_add(w, v);
+		put_u64(w, n->val.as_uint);
+	} break;
+	case tt_symbol: {
+		symbol *s = GET_PTR(v);
+		int interned = interned_p(ss, v);
+		put_u8(w, interned ? img_symbol : img_gensym);
+		memo_add(w, v);
+		put_u32(w, s->len);
+		put_bytes(w, s->name, s->len);
+		if (!interned) {
+			write_value(w, s->alias);
+		}
+	} break;
+	case tt_string:
+	case tt_byte_vector: {
+		byte_vector *bv = GET_PTR(v);
+		put_u8(w, TYPEOF(v) == tt_string ? img_string : img_byte_vector);
+		memo_add(w, v);
+		put_u64(w, bv->len);
+		put_bytes(w, bv->elems, bv->len);
+	} break;
+	case tt_vector: {
+		vector *vec = GET_PTR(v);
+		put_u8(w, img_vector);
+		memo_add(w, v);
+		put_u64(w, vec->len);
+		for (size_t i = 0; i < vec->len; ++i) {
+			write_value(w, vec->elems[i]);
+		}
+	} break;
+	case tt_dictionary: {
+		put_u8(w, img_dictionary);
+		memo_add(w, v);
+		put_u64(w, dictionary_len(v));
+		sly_value key, value;
+		for (size_t i = 0; dictionary_next(v, &i, &key, &value);) {
+			write_value(w, key);
+			write_value(w, value);
+		}
+	} break;
+	case tt_syntax: {
+		syntax *stx = GET_PTR(v);
+		put_u8(w, img_syntax);
+		memo_add(w, v);
+		put_u32(w, stx->tok.tag);
+		put_u32(w, stx->tok.so);
+		put_u32(w, stx->tok.eo);
+		put_u32(w, stx->tok.ln);
+		put_u32(w, stx->tok.cn);
+		put_u32(w, source_index(w, stx->tok.src));
+		put_u32(w, stx->context);
+		write_value(w, stx->scope_set);
+		write_value(w, stx->datum);
+	} break;
+	case tt_prototype: {
+		prototype *proto = GET_PTR(v);
+		put_u8(w, img_prototype);
+		memo_add(w, v);
+		put_raw_vector(w, proto->uplist);
+		put_raw_vector(w, proto->code);
+		put_u64(w, proto->entry);
+		put_u64(w, proto->nregs);
+		put_u64(w, proto->nargs);
+		put_u64(w, proto->nvars);
+		put_u32(w, proto->has_varg);
+		write_value(w, proto->K);
+		write_value(w, proto->syntax_info);
+		write_value(w, proto->binding);
+	} break;
+	default: {
+		/* closures, continuations, user data etc. only
+		 * exist at run time and have no image representation */
+		w->err = 1;
+	} break;
+	}
+}
+
+int
+sly_image_write(Sly_State *ss, char *image_path, image_source *srcs,
+				size_t nsrcs, sly_value specials, sly_value root)
+{ /* Returns 0 on success. The image is written to a temporary
+   * file of its own in the same directory and renamed into place,
+   * so neither a reader nor another writer ever sees a partial
+   * image.
+   */
+	size_t len = strlen(image_path);
+	char *tmp_path = GC_MALLOC(len + 8);
+	memcpy(tmp_path, image_path, len);
+	memcpy(tmp_path + len, ".XXXXXX", 8);
+	int fd = mkstemp(tmp_path);
+	if (fd == -1) {
+		return -1;
+	}
+	struct image_writer w = {0};
+	if (fchmod(fd, 0644) != 0
+		|| (w.file = fdopen(fd, "wb")) == NULL) {
+		close(fd);
+		remove(tmp_path);
+		return -1;
+	}
+	w.ss = ss;
+	w.srcs = srcs;
+	w.nsrcs = nsrcs;
+	w.specials = specials;
+	w.memo_cap = MEMO_INIT_SIZE;
+	w.memo = GC_MALLOC(w.memo_cap * sizeof(*w.memo));
+	w.memo_idx = GC_MALLOC(w.memo_cap * sizeof(*w.memo_idx));
+	put_u32(&w, IMAGE_MAGIC);
+	put_u32(&w, IMAGE_VERSION);
+	put_u32(&w, OP_COUNT);
+	put_u32(&w, nsrcs);
+	for (size_t i = 0; i < nsrcs; ++i) {
+		size_t plen = strlen(srcs[i].path);
+		put_u32(&w, plen);
+		put_bytes(&w, srcs[i].path, plen);
+		put_u64(&w, srcs[i].hash);
+	}
+	/* the payload length and hash are filled in once the
+	 * payload has been written */
+	long sum_pos = ftell(w.file);
+	put_u64(&w, 0);
+	put_u64(&w, 0);
+	w.in_payload = 1;
+	w.payload_sum = FNV_OFFSET;
+	write_value(&w, root);
+	w.in_payload = 0;
+	if (sum_pos == -1 || fseek(w.file, sum_pos, SEEK_SET) != 0) {
+		w.err = 1;
+	}
+	put_u64(&w, w.payload_len);
+	put_u64(&w, w.payload_sum);
+	if (fclose(w.file) != 0) {
+		w.err = 1;
+	}
+	if (w.err || rename(tmp_path, image_path) != 0) {
+		remove(tmp_path);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+get_bytes(struct image_reader *r, void *buf, size_t size)
+{
+	if (r->err || fread(buf, 1, size, r->file) != size) {
+		memset(buf, 0, size);
+		r->err = 1;
+	}
+}
+
+static u8
+get_u8(struct image_reader *r)
+{
+	u8 x;
+	get_bytes(r, &x, sizeof(x));
+	return x;
+}
+
+static u32
+get_u32(struct image_reader *r)
+{
+	u32 x;
+	get_bytes(r, &x, sizeof(x));
+	return x;
+}
+
+static u64
+get_u64(struct image_reader *r)
+{
+	u64 x;
+	get_bytes(r, &x, sizeof(x));
+	return x;
+}
+
+static sly_value
+get_raw_vector(struct image_reader *r)
+{
+	u64 len = get_u64(r);
+	if (r->err || len > (1 << 24)) {
+		r->err = 1;
+		return make_vector(r->ss, 0, 8);
+	}
+	sly_value v = make_vector(r->ss, len, len < 8 ? 8 : len);
+	vector *vec = GET_PTR(v);
+	get_bytes(r, vec->elems, len * sizeof(sly_value));
+	return v;
+}
+
+static void
+add_object(struct image_reader *r, sly_value v)
+{
+	if (r->len == r->cap) {
+		r->cap *= 2;
+		r->objs = GC_REALLOC(r->objs, r->cap * sizeof(*r->objs));
+	}
+	r->objs[r->len++] = v;
+}
+
+static char *
+get_name(struct image_reader *r, size_t *len)
+{
+	*len = get_u32(r);
+	if (r->err || *len > UCHAR_MAX) {
+		r->err = 1;
+		*len = 0;
+	}
+	char *name = GC_MALLOC(*len + 1);
+	get_bytes(r, name, *len);
+	return name;
+}
+
+static sly_value
+read_value(struct image_reader *r)
+{
+	Sly_State *ss = r->ss;
+	sly_value v = SLY_VOID;
+	u8 tag = get_u8(r);
+	if (r->err) return SLY_VOID;
+	switch ((enum image_tag)tag) {
+	case img_imm: {
+		v = get_u64(r);
+		if (ptr_p(v)) r->err = 1;
+	} break;
+	case img_ref: {
+		u64 idx = get_u64(r);
+		if (idx >= r->len) {
+			r->err = 1;
+			return SLY_VOID;
+		}
+		v = r->objs[idx];
+	} break;
+	case img_special: {
+		u64 idx = get_u64(r);
+		if (idx >= vector_len(r->specials)) {
+			r->err = 1;
+			return SLY_VOID;
+		}
+		v = vector_ref(r->specials, idx);
+	} break;
+	case img_pair: {
+		v = cons(ss, SLY_NULL, SLY_NULL);
+		add_object(r, v);
+		set_car(v, read_value(r));
+		set_cdr(v, read_value(r));
+	} break;
+	case img_cell: {
+		size_t idx = r->len;
+		add_object(r, SLY_VOID);
+		sly_value sym = read_value(r);
+		if (!symbol_p(sym)) {
+			r->err = 1;
+			return SLY_VOID;
+		}
+		sly_value globals = ss->cc->globals;
+		v = dictionary_entry_ref(globals, sym);
+		if (slot_is_free(v)) {
+			dictionary_set(ss, globals, sym, SLY_VOID);
+			v = dictionary_entry_ref(globals, sym);
+		}
+		r->objs[idx] = v;
+	} break;
+	case img_int: {
+		v = make_int(ss, (i64)get_u64(r));
+		add_object(r, v);
+	} break;
+	case img_float: {
+		u64 bits = get_u64(r);
+		f64 f;
+		memcpy(&f, &bits, sizeof(f));
+		v = make_float(ss, f);
+		add_object(r, v);
+	} break;
+	case img_symbol: {
+		size_t len;
+		char *name = get_name(r, &len);
+		v = make_symbol(ss, name, len);
+		add_object(r, v);
+	} break;
+	case img_gensym: {
+		size_t len;
+		char *name = get_name(r, &len);
+		v = tagged_symbol(ss, name, len);
+		add_object(r, v);
+		symbol *s = GET_PTR(v);
+		s->alias = read_value(r);
+	} break;
+	case img_string:
+	case img_byte_vector: {
+		u64 len = get_u64(r);
+		if (r->err || len > (1 << 24)) {
+			r->err = 1;
+			return SLY_VOID;
+		}
+		v = make_byte_vector(ss, len, len);
+		byte_vector *bv = GET_PTR(v);
+		if (tag == img_string) bv->type = tt_string;
+		add_object(r, v);
+		get_bytes(r, bv->elems, len);
+	} break;
+	case img_vector: {
+		u64 len = get_u64(r);
+		if (r->err || len > (1 << 24)) {
+			r->err = 1;
+			return SLY_VOID;
+		}
+		v = make_vector(ss, len, len < 8 ? 8 : len);
+		add_object(r, v);
+		for (size_t i = 0; i < len && !r->err; ++i) {
+			vector_set(v, i, read_value(r));
+		}
+	} break;
+	case img_dictionary: {
+		u64 len = get_u64(r);
+		v = make_dictionary(ss);
+		add_object(r, v);
+		for (size_t i = 0; i < len && !r->err; ++i) {
+			sly_value key = read_value(r);
+			sly_value val = read_value(r);
+			if (null_p(key) || void_p(key)) {
+				r->err = 1;
+				return SLY_VOID;
+			}
+			dictionary_set(ss, v, key, val);
+		}
+	} break;
+	case img_syntax: {
+		token tok = {0};
+		tok.tag = get_u32(r);
+		tok.so = get_u32(r);
+		tok.eo = get_u32(r);
+		tok.ln = get_u32(r);
+		tok.cn = get_u32(r);
+		i32 src = get_u32(r);
+		if (src >= 0 && (size_t)src < r->nsrcs) {
+			tok.src = r->srcs[src].text;
+		}
+		v = make_syntax(ss, tok, SLY_NULL);
+		syntax *stx = GET_PTR(v);
+		stx->context = get_u32(r);
+		add_object(r, v);
+		stx->scope_set = read_value(r);
+		stx->datum = read_value(r);
+	} break;
+	case img_prototype: {
+		sly_value uplist = get_raw_vector(r);
+		sly_value code = get_raw_vector(r);
+		size_t entry = get_u64(r);
+		size_t nregs = get_u64(r);
+		size_t nargs = get_u64(r);
+		size_t nvars = get_u64(r);
+		int has_varg = get_u32(r);
+		v = make_prototype(ss, uplist, SLY_NULL, code,
+						   nregs, nargs, entry, has_varg);
+		prototype *proto = GET_PTR(v);
+		proto->nvars = nvars;
+		add_object(r, v);
+		proto->K = read_value(r);
+		proto->syntax_info = read_value(r);
+		proto->binding = read_value(r);
+		if (!vector_p(proto->K) || !vector_p(proto->syntax_info)) {
+			r->err = 1;
+		}
+	} break;
+	default: {
+		r->err = 1;
+	} break;
+	}
+	return r->err ? SLY_VOID : v;
+}
+
+sly_value
+sly_image_read(Sly_State *ss, char *image_path, image_source *srcs,
+			   size_t *nsrcs, sly_value specials)
+{ /* srcs[0] is the module itself, the other sources are read
+   * from the paths recorded in the image. Returns SLY_VOID if the
+   * image does not exist or does not match the sources. The payload
+   * is checked against the hash in the header before any of it is
+   * decoded, a damaged image is treated as a missing one.
+   */
+	struct image_reader r = {0};
+	r.file = fopen(image_path, "rb");
+	if (r.file == NULL) {
+		return SLY_VOID;
+	}
+	r.ss = ss;
+	r.srcs = srcs;
+	r.specials = specials;
+	sly_value root = SLY_VOID;
+	if (get_u32(&r) != IMAGE_MAGIC
+		|| get_u32(&r) != IMAGE_VERSION
+		|| get_u32(&r) != OP_COUNT) {
+		goto done;
+	}
+	r.nsrcs = get_u32(&r);
+	if (r.err || r.nsrcs == 0 || r.nsrcs > IMAGE_MAX_SOURCES) {
+		goto done;
+	}
+	for (size_t i = 0; i < r.nsrcs; ++i) {
+		size_t len = get_u32(&r);
+		if (r.err || len > IMAGE_MAX_PATH) {
+			goto done;
+		}
+		char *path = GC_MALLOC(len + 1);
+		get_bytes(&r, path, len);
+		u64 hash = get_u64(&r);
+		if (i == 0) {
+			if (r.err || hash != srcs[0].hash) goto done;
+			continue;
+		}
+		size_t size;
+		char *text = read_file(path, &size);
+		if (r.err || text == NULL || sly_image_hash(text, size) != hash) {
+			goto done;
+		}
+		srcs[i].path = path;
+		srcs[i].text = text;
+		srcs[i].hash = hash;
+	}
+	u64 payload_len = get_u64(&r);
+	u64 payload_sum = get_u64(&r);
+	if (r.err || payload_len == 0 || payload_len > IMAGE_MAX_PAYLOAD) {
+		goto done;
+	}
+	char *payload = GC_MALLOC_ATOMIC(payload_len);
+	get_bytes(&r, payload, payload_len);
+	if (r.err || fgetc(r.file) != EOF
+		|| hash_bytes(FNV_OFFSET, payload, payload_len) != payload_sum) {
+		goto done;
+	}
+	fclose(r.file);
+	r.file = fmemopen(payload, payload_len, "rb");
+	if (r.file == NULL) {
+		return SLY_VOID;
+	}
+	r.cap = MEMO_INIT_SIZE;
+	r.objs = GC_MALLOC(r.cap * sizeof(*r.objs));
+	root = read_value(&r);
+	if (r.err || fgetc(r.file) != EOF) {
+		root = SLY_VOID;
+	}
+	*nsrcs = r.nsrcs;
+done:
+	fclose(r.file);
+	return root;
+}
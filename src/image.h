@@ -0,0 +1,27 @@
+#ifndef SLY_IMAGE_H_
+#define SLY_IMAGE_H_
+
+/* An image is the serialized result of compiling a required
+ * module. It is stored next to the source file (with a `c'
+ * appended to the name) or in $SLY_CACHE_DIR when that is set.
+ * An image is only valid for the exact contents of the sources
+ * it was built from (the module and any files it includes).
+ */
+
+typedef struct _image_source {
+	char *path;
+	char *text;     // source code that tokens point into
+	u64 hash;       // content hash of text
+} image_source;
+
+#define IMAGE_MAX_SOURCES 64
+
+u64 sly_image_hash(char *text, size_t len);
+char *sly_cache_path(char *file_path, char *suffix);
+char *sly_image_path(char *file_path);
+int sly_image_write(Sly_State *ss, char *image_path, image_source *srcs,
+					size_t nsrcs, sly_value specials, sly_value root);
+sly_value sly_image_read(Sly_State *ss, char *image_path, image_source *srcs,
+						 size_t *nsrcs, sly_value specials);
+
+#endif /* SLY_IMAGE_H_ */
@@ -4,49 +4,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#ifdef SLY_LEXER_REGEX
 #include <sys/types.h>
 #include <regex.h>
+#endif
 #include <gc.h>
 #include "../common/common_def.h"
 #include "lexer.h"
 
 #define LINE_SIZE 1024
 
-static char retok[] =
-	"^(')"													// 1  quote
-	"|^(`)"													// 2  quasiquote
-	"|^(,@)"												// 3  unquote-splice
-	"|^(,)"													// 4  unquote
-	"|^(#')"												// 5  syntax-quote
-	"|^(#`)"												// 6  syntax-quasiquote
-	"|^(#,@)"												// 7  syntax-unquote-splice
-	"|^(#,)"												// 8  syntax-unquote
-	"|^(;.*)$"												// 9  comment
-	"|^([[({])"												// 10 left brace
-	"|^([])}])"												// 11 right brace
-	"|^(\\.)"												// 12 dot
-	"|^(#\\()"												// 13 vector
-	"|^(#v?u8\\()"											// 14 byte-vector
-	"|^(#dict\\()"											// 15 dictionary
-	"|^(#t|#f)"												// 18 boolean
-	"|^(#;)"												// 19 sexp-comment
-	"|^(#[xX][0-9A-Fa-f]+)"									// 20 hex
-	"|^([-+]?[0-9]+\\.[0-9]+)"								// 21 float
-	"|^([-+]?[0-9]+)"										// 22 int
-	"|^(#\\\\[^[:space:]][^][(){};[:space:]]*)"				// 23 char
-	"|^(#:[^][(){};'`\"#,[:space:]][^][(){};[:space:]]*)"	// 25 keyword
-	"|^([^][(){};'`\"#,[:space:]][^][(){};[:space:]]*)"		// 26 identifier
-	"|^(\"([^\"]|\\\\.)*\")";								// 26 string
-
-static regmatch_t pmatch[tok_max] = {0};
-static regex_t rexpr = {0};
 static size_t off = 0;
 static int line_number = 0;
 static int column_number = 0;
 static char *text;
 
-static void strip_ws(void);
-
 char *
 tok_to_string(enum token t)
 {
@@ -92,10 +64,21 @@ chin(int c, char *cstr)
 	return 0;
 }
 
+static int
+space_p(int c)
+{ // [:space:] in the C locale
+	switch (c) {
+	case ' ': case '\t': case '\v': case '\r': case '\f': case '\n':
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 static void
 strip_ws(void)
 {
-	for (; chin(text[off], " \t\v\r\f\n"); off++) {
+	for (; space_p(text[off]); off++) {
 		if (text[off] == '\n') {
 			line_number++;
 			column_number = 0;
@@ -103,8 +86,41 @@ strip_ws(void)
 	}
 }
 
+/* The tokenizer used to be a single POSIX regex, it is kept
+ * for testing the scanner against. Define SLY_LEXER_REGEX to use it.
+ */
+#ifdef SLY_LEXER_REGEX
+static char retok[] =
+	"^(')"													// 1  quote
+	"|^(`)"													// 2  quasiquote
+	"|^(,@)"												// 3  unquote-splice
+	"|^(,)"													// 4  unquote
+	"|^(#')"												// 5  syntax-quote
+	"|^(#`)"												// 6  syntax-quasiquote
+	"|^(#,@)"												// 7  syntax-unquote-splice
+	"|^(#,)"												// 8  syntax-unquote
+	"|^(;.*)$"												// 9  comment
+	"|^([[({])"												// 10 left brace
+	"|^([])}])"												// 11 right brace
+	"|^(\\.)"												// 12 dot
+	"|^(#\\()"												// 13 vector
+	"|^(#v?u8\\()"											// 14 byte-vector
+	"|^(#dict\\()"											// 15 dictionary
+	"|^(#t|#f)"												// 18 boolean
+	"|^(#;)"												// 19 sexp-comment
+	"|^(#[xX][0-9A-Fa-f]+)"									// 20 hex
+	"|^([-+]?[0-9]+\\.[0-9]+)"								// 21 float
+	"|^([-+]?[0-9]+)"										// 22 int
+	"|^(#\\\\[^[:space:]][^][(){};[:space:]]*)"				// 23 char
+	"|^(#:[^][(){};'`\"#,[:space:]][^][(){};[:space:]]*)"	// 25 keyword
+	"|^([^][(){};'`\"#,[:space:]][^][(){};[:space:]]*)"		// 26 identifier
+	"|^(\"([^\"]|\\\\.)*\")";								// 26 string
+
+static regmatch_t pmatch[tok_max] = {0};
+static regex_t rexpr = {0};
+
 static token
-next_token(void)
+next_token_regex(void)
 {
 	token t = {
 		.so = -1,
@@ -113,11 +129,6 @@ next_token(void)
 		.cn = -1,
 		.src = text,
 	};
-	strip_ws();
-	if (text[off] == '\0') {
-		t.tag = tok_eof;
-		return t;
-	}
 	int r = regexec(&rexpr, &text[off], tok_max, pmatch, 0);
 	if (r) {
 		if (r == REG_NOMATCH) {
@@ -152,6 +163,222 @@ next_token(void)
 	}
 }
 
+#else
+
+static int
+delimiter_p(int c)
+{ // characters that end an identifier
+	return c == '\0' || space_p(c) || chin(c, "[](){};");
+}
+
+static int
+ident_start_p(int c)
+{
+	return !delimiter_p(c) && !chin(c, "'`\",#");
+}
+
+static int
+ident_rest_len(char *s)
+{
+	int n = 0;
+	while (!delimiter_p(s[n])) n++;
+	return n;
+}
+
+static int
+digits_len(char *s)
+{
+	int n = 0;
+	while (isdigit((u8)s[n])) n++;
+	return n;
+}
+
+static enum token
+scan_string(char *s, int *len)
+{ /* Strings can't span lines. The regex picks the longest match
+   * so a quote only ends the string if it is not escaped, or if
+   * no quote follows it on the line.
+   */
+	int end = -1;
+	for (int i = 1; s[i] != '\0' && s[i] != '\n'; ++i) {
+		if (s[i] == '"') {
+			end = i + 1;
+			if (s[i-1] != '\\') break;
+		}
+	}
+	if (end == -1) {
+		return tok_nomatch;
+	}
+	*len = end;
+	return tok_string;
+}
+
+static enum token
+scan_hash(char *s, int *len)
+{
+	int n;
+	switch (s[1]) {
+	case '\'': *len = 2; return tok_syntax_quote;
+	case '`': *len = 2; return tok_syntax_quasiquote;
+	case ',':
+		if (s[2] == '@') {
+			*len = 3;
+			return tok_syntax_unquote_splice;
+		}
+		*len = 2;
+		return tok_syntax_unquote;
+	case '(': *len = 2; return tok_vector;
+	case ';': *len = 2; return tok_sexp_comment;
+	case 't':
+	case 'f': *len = 2; return tok_bool;
+	case 'x':
+	case 'X':
+		for (n = 2; isxdigit((u8)s[n]); ++n);
+		if (n == 2) break;
+		*len = n;
+		return tok_hex;
+	case 'u':
+		if (strncmp(s, "#u8(", 4) != 0) break;
+		*len = 4;
+		return tok_byte_vector;
+	case 'v':
+		if (strncmp(s, "#vu8(", 5) != 0) break;
+		*len = 5;
+		return tok_byte_vector;
+	case 'd':
+		if (strncmp(s, "#dict(", 6) != 0) break;
+		*len = 6;
+		return tok_dictionary;
+	case '\\':
+		if (s[2] == '\0' || space_p(s[2])) break;
+		*len = 3 + ident_rest_len(&s[3]);
+		return tok_char;
+	case ':':
+		if (!ident_start_p(s[2])) break;
+		*len = 3 + ident_rest_len(&s[3]);
+		return tok_keyword;
+	default: break;
+	}
+	return tok_nomatch;
+}
+
+static enum token
+scan_token(char *s, int *len)
+{ /* Match the token at s the way the regex did: the longest
+   * alternative wins, on a tie the one listed first.
+   */
+	switch (s[0]) {
+	case '\'': *len = 1; return tok_quote;
+	case '`': *len = 1; return tok_quasiquote;
+	case ',':
+		if (s[1] == '@') {
+			*len = 2;
+			return tok_unquote_splice;
+		}
+		*len = 1;
+		return tok_unquote;
+	case ';': {
+		int n = 1;
+		while (s[n] != '\0' && s[n] != '\n') n++;
+		*len = n;
+		return tok_comment;
+	}
+	case '(': case '[': case '{': *len = 1; return tok_lbracket;
+	case ')': case ']': case '}': *len = 1; return tok_rbracket;
+	case '"': return scan_string(s, len);
+	case '#': return scan_hash(s, len);
+	default: break;
+	}
+	if (!ident_start_p(s[0])) {
+		return tok_nomatch;
+	}
+	/* numbers and the dot are also identifiers,
+	 * they win if they are as long as the identifier */
+	*len = 1 + ident_rest_len(&s[1]);
+	if (s[0] == '.') {
+		return *len == 1 ? tok_dot : tok_ident;
+	}
+	int sign = s[0] == '-' || s[0] == '+';
+	int n = digits_len(&s[sign]);
+	if (n == 0) {
+		return tok_ident;
+	}
+	n += sign;
+	if (n == *len) {
+		return tok_int;
+	}
+	if (s[n] == '.') {
+		int f = digits_len(&s[n+1]);
+		if (f && n + 1 + f == *len) {
+			return tok_float;
+		}
+	}
+	return tok_ident;
+}
+
+static token
+next_token_scan(void)
+{
+	token t = {
+		.so = -1,
+		.eo = -1,
+		.ln = -1,
+		.cn = -1,
+		.src = text,
+	};
+	int len;
+	enum token tag = scan_token(&text[off], &len);
+	if (tag == tok_nomatch) {
+		/* regexec went on to look for a match at the start of each
+		 * following line, the skipped text became part of the token */
+		for (char *p = strchr(&text[off], '\n'); p; p = strchr(p + 1, '\n')) {
+			tag = scan_token(p + 1, &len);
+			if (tag != tok_nomatch) {
+				len += p + 1 - &text[off];
+				break;
+			}
+		}
+	}
+	if (tag == tok_nomatch) {
+		printf("reg nomatch (%d, %d)\n", line_number, column_number);
+		printf("%s\n", &text[off]);
+		t.tag = tok_nomatch;
+		return t;
+	}
+	t.tag = tag;
+	t.so = off;
+	off += len;
+	t.eo = off;
+	t.ln = line_number;
+	t.cn = column_number;
+	column_number += len;
+	return t;
+}
+
+#endif
+
+static token
+next_token(void)
+{
+	strip_ws();
+	if (text[off] == '\0') {
+		token t = {
+			.tag = tok_eof,
+			.so = -1,
+			.eo = -1,
+			.ln = -1,
+			.cn = -1,
+			.src = text,
+		};
+		return t;
+	}
+#ifdef SLY_LEXER_REGEX
+	return next_token_regex();
+#else
+	return next_token_scan();
+#endif
+}
+
 static void
 grow_token_buff(token_buff *tokens)
 {
@@ -176,6 +403,7 @@ int
 lex_str(char *str, token_buff *_tokens)
 {
 	text = str;
+#ifdef SLY_LEXER_REGEX
 	char err_str[255];
 	int r = regcomp(&rexpr, retok, REG_EXTENDED|REG_NEWLINE);
 	if (r) {
@@ -184,6 +412,7 @@ lex_str(char *str, token_buff *_tokens)
 		printf("%s\n", err_str);
 		return 1;
 	}
+#endif
 	off = 0;
 	line_number = 0;
 	column_number = 0;
@@ -198,6 +427,8 @@ lex_str(char *str, token_buff *_tokens)
 	} while (t.tag != tok_eof
 			 && t.tag != tok_nomatch);
 	*_tokens = tokens;
+#ifdef SLY_LEXER_REGEX
 	regfree(&rexpr);
+#endif
 	return 0;
 }
@@ -6,6 +6,7 @@
 #include "sly_types.h"
 #include "cps.h"
 #include "cbackend.h"
+#include "sly_compile.h"
 
 static char *
 next_arg(int *argc, char **argv[])
@@ -23,6 +24,18 @@ int
 main(int argc, char *argv[])
 {
 	next_arg(&argc, &argv);
+	if (argc && strcmp(*argv, "--vm") == 0) {
+		/* run the files on the bytecode VM instead of compiling
+		 * them to C, required modules are loaded as well */
+		next_arg(&argc, &argv);
+		if (argc == 0) {
+			printf("No source file provided.\nExiting ...\n");
+		}
+		while (argc) {
+			sly_do_file(next_arg(&argc, &argv), 0);
+		}
+		return 0;
+	}
 	if (argc) {
 		while (argc) {
 			Sly_State ss = {0};
@@ -38,7 +51,7 @@ main(int argc, char *argv[])
 					fprintf(stderr, "Error opening file\n");
 					return 1;
 				}
-				cps_emit_c(&ss, graph, entry, free_var_lookup, file, 1);
+				cps_emit_c(&ss, graph, entry, var_info, free_var_lookup, file, 1);
 				fclose(file);
 				int r = system("./scheme/build_runtime.sh -s");
 				sly_assert(r == 0, "compile error");
@@ -61,7 +74,7 @@ main(int argc, char *argv[])
 				trampoline(load_dynamic());
 				dlclose(handle);
 #else
-				sly_value graph = make_dictionary(&ss);
+				sly_value graph = make_eq_dictionary(&ss);
 				sly_value name = make_symbol(&ss, "$tkexit", 7);
 				CPS_Kont *kont = cps_make_ktail(&ss, 0);
 				kont->name = name;
@@ -74,13 +87,14 @@ main(int argc, char *argv[])
 				graph = cps_opt_contraction_phase(&ss, graph, entry, 1);
 				cps_display(&ss, graph, entry);
 				printf("\n");
+				sly_value global_var_info = make_dictionary(&ss);
 				sly_value var_info = cps_collect_var_info(&ss, graph,
-														  make_dictionary(&ss),
+														  global_var_info,
 														  make_dictionary(&ss),
 														  make_dictionary(&ss), NULL, entry);
 				sly_value free_var_lookup = cps_collect_free_variables(&ss, graph, var_info, entry);
 				FILE *file = fopen("test.sly.c", "w");
-				cps_emit_c(&ss, graph, entry, free_var_lookup, file, 0);
+				cps_emit_c(&ss, graph, entry, global_var_info, free_var_lookup, file, 0);
 				fclose(file);
 				int r = system("./scheme/build_runtime.sh");
 				sly_assert(r == 0, "compile error");
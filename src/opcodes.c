@@ -2,22 +2,6 @@
 #include "sly_types.h"
 #include "opcodes.h"
 
-stack_frame *
-make_stack(Sly_State *ss, size_t nregs)
-{
-	if (nregs >= REG_MAX) {
-		sly_raise_exception(ss, EXC_ALLOC, "Stack too big");
-	}
-	stack_frame *frame = GC_MALLOC(sizeof(*frame));
-	frame->type = tt_stack_frame;
-	frame->cont = SLY_NULL;
-	frame->R = make_vector(ss, nregs*2, nregs*2);
-	for (size_t i = 0; i < nregs; ++i) {
-		vector_set(frame->R, i, SLY_VOID);
-	}
-	return frame;
-}
-
 void
 dis(INSTR ins, sly_value si)
 {
@@ -98,6 +82,16 @@ dis(INSTR ins, sly_value si)
 		u8 c = GET_C(instr);
 		printf("(DICTSET %d %d %d)%n", a, b, c, &pad);
 	} break;
+	case OP_GETGLOBAL: {
+		u8 a = GET_A(instr);
+		size_t b = GET_Bx(instr);
+		printf("(GETGLOBAL %d %zu)%n", a, b, &pad);
+	} break;
+	case OP_SETGLOBAL: {
+		u8 a = GET_A(instr);
+		size_t b = GET_Bx(instr);
+		printf("(SETGLOBAL %d %zu)%n", a, b, &pad);
+	} break;
 	case OP_JMP: {
 		u64 a = GET_Ax(instr);
 		printf("(JMP %lu)%n", a, &pad);
@@ -144,6 +138,29 @@ dis(INSTR ins, sly_value si)
 		u64 b = GET_Bx(instr);
 		printf("(CLOSURE %d %lu)%n", a, b, &pad);
 	} break;
+	case OP_ADD:
+	case OP_SUB:
+	case OP_MUL:
+	case OP_NUMEQ:
+	case OP_LT:
+	case OP_GT:
+	case OP_LEQ:
+	case OP_GEQ: {
+		static const char *names[] = {
+			"ADD", "SUB", "MUL", "NUMEQ", "LT", "GT", "LEQ", "GEQ",
+		};
+		u8 a = GET_A(instr);
+		u8 b = GET_B(instr);
+		u8 c = GET_C(instr);
+		printf("(%s %d %d %d)%n", names[op - OP_ADD], a, b, c, &pad);
+	} break;
+	case OP_ADDI:
+	case OP_SUBI: {
+		u8 a = GET_A(instr);
+		u8 b = GET_B(instr);
+		i8 c = GET_C(instr);
+		printf("(%s %d %d %d)%n", op == OP_ADDI ? "ADDI" : "SUBI", a, b, c, &pad);
+	} break;
 	case OP_COUNT:
 	default: {
 		sly_assert(0, "Error invalid opcode");
@@ -17,6 +17,8 @@ enum opcode {
 	OP_SETUPDICT,	// iABC | <dictionary> U[A][R[B]] := R[C]
 	OP_DICTREF,	    // iABC | R[A] := <dictionary> R[B][R[C]]
 	OP_DICTSET,  	// iABC | <dictionary> R[A][R[B]] := R[C]
+	OP_GETGLOBAL,	// iABx | R[A] := <global cell> K[Bx]
+	OP_SETGLOBAL,	// iABx | <global cell> K[Bx] := R[A]
 	OP_JMP,			// iAx  | PC := <u64> Ax
 	OP_FJMP,		// iABx | if R[A] == #f then PC := Bx
 	OP_CALL,		// iAB  | R[A] := (R[A] R[A+1] ... R[A+B-1])
@@ -28,21 +30,23 @@ enum opcode {
 //	OP_RETURN,		// iAB  | return R[A] ... R[A+B-1]
 	OP_EXIT,        // iAB
 	OP_CLOSURE,		// iABx | R[A] := make_closure(<prototype> K[Bx])
+	/* Builtin operators. R[A] holds the procedure the source called.
+	 * If it is no longer the builtin the procedure is called with
+	 * the operands instead.
+	 */
+	OP_ADD,			// iABC | R[A] := R[B] + R[C]
+	OP_SUB,			// iABC | R[A] := R[B] - R[C]
+	OP_MUL,			// iABC | R[A] := R[B] * R[C]
+	OP_NUMEQ,		// iABC | R[A] := R[B] = R[C]
+	OP_LT,			// iABC | R[A] := R[B] < R[C]
+	OP_GT,			// iABC | R[A] := R[B] > R[C]
+	OP_LEQ,			// iABC | R[A] := R[B] <= R[C]
+	OP_GEQ,			// iABC | R[A] := R[B] >= R[C]
+	OP_ADDI,		// iABC | R[A] := R[B] + <i8> C
+	OP_SUBI,		// iABC | R[A] := R[B] - <i8> C
 	OP_COUNT,
 };
 
-typedef struct _stack_frame {
-	OBJ_HEADER;
-	sly_value cont; // <continuation>
-	sly_value K;    // <vector> constants
-	sly_value code; // <vector> byte code
-	sly_value U;	// <vector> upvalues
-	sly_value R;	// <vector> registers
-	sly_value clos; // closure
-	size_t pc;		// program counter
-	u32 level;
-} stack_frame;
-
 typedef sly_value INSTR;
 
 union instr {
@@ -59,6 +63,37 @@ union instr {
 	} i;
 };
 
+typedef struct _dinstr { /* pre-decoded instruction */
+	const void *label;	// handler address (threaded dispatch only)
+	union instr instr;
+} dinstr;
+
+typedef struct _stack_frame {
+	OBJ_HEADER;
+	sly_value cont; // <continuation>
+	sly_value K;    // <vector> constants
+	sly_value code; // <vector> byte code
+	dinstr *dcode;  // decoded byte code
+	sly_value U;	// <vector> upvalues
+	sly_value *R;	// registers
+	size_t nregs;	// number of registers
+	sly_value clos; // closure
+	size_t pc;		// program counter
+	u32 level;
+	int heap;		// frame was moved off the vm stack
+	stack_pos pos;	// stack frame: start of the frame
+					// heap frame: where the stack resumes
+	continuation ret; // return point, cont usually points here
+} stack_frame;
+
+typedef struct _stack_chunk { /* segment of the vm stack */
+	struct _stack_chunk *next;
+	size_t cap;			// capacity in words
+	sly_value data[];
+} stack_chunk;
+
+#define FRAME_WORDS ((sizeof(stack_frame) + sizeof(sly_value) - 1) / sizeof(sly_value))
+
 #define AxMAX   16777215
 #define sAxMAX  8388607
 #define sAxMIN -8388608
@@ -78,7 +113,6 @@ union instr {
 #define GET_Bx(instr)   ((instr).i.u.as_u16[1])
 #define GET_sBx(instr)  ((instr).i.u.as_i16[1])
 
-stack_frame *make_stack(Sly_State *ss, size_t nregs);
 void dis(INSTR instr, sly_value si);
 void dis_code(sly_value code, sly_value si);
 void dis_all(stack_frame *frame, int lstk);
@@ -374,20 +374,31 @@ cat_files(int num_files, ...)
 	return buffer;
 }
 
+char *
+read_file(char *file_path, size_t *size)
+{ // returns NULL if the file could not be opened
+	FILE *file = fopen(file_path, "r");
+	if (file == NULL) {
+		return NULL;
+	}
+	size_t len = get_file_size(file);
+	char *str = GC_MALLOC(len+1);
+	assert(str != NULL);
+	len = fread(str, 1, len, file);
+	str[len] = '\0';
+	fclose(file);
+	if (size) *size = len;
+	return str;
+}
+
 sly_value
 parse_file(Sly_State *ss, char *file_path, char **contents)
 {
-	FILE *file = fopen(file_path, "r");
-	if (file == NULL) {
+	char *str = read_file(file_path, NULL);
+	if (str == NULL) {
 		fprintf(stderr, "%s\n", strerror(errno));
 		sly_raise_exception(ss, EXC_COMPILE, "Error unable to open source file");
 	}
-	size_t size = get_file_size(file);
-	char *str = GC_MALLOC(size+1);
-	assert(str != NULL);
-	fread(str, 1, size, file);
-	str[size] = '\0';
-	fclose(file);
 	*contents = str;
 	return parse(ss, str);
 }
@@ -2,6 +2,7 @@
 #define SLY_PARSER_H_
 
 char *cat_files(int num_files, ...);
+char *read_file(char *file_path, size_t *size);
 sly_value parse(Sly_State *ss, char *cstr);
 sly_value parse_file(Sly_State *ss, char *file_path, char **contents);
 
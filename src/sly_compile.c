@@ -91,8 +91,24 @@ keywords(int idx)
 	return NULL;
 }
 
+static const struct {
+	char *name;
+	enum opcode op;
+	enum opcode op_imm;		// form with an <i8> operand or OP_NOP
+} primop_info[VMOP_COUNT] = {
+	[vmop_add]   = { "+",  OP_ADD,   OP_ADDI },
+	[vmop_sub]   = { "-",  OP_SUB,   OP_SUBI },
+	[vmop_mul]   = { "*",  OP_MUL,   OP_NOP },
+	[vmop_numeq] = { "=",  OP_NUMEQ, OP_NOP },
+	[vmop_lt]    = { "<",  OP_LT,    OP_NOP },
+	[vmop_gt]    = { ">",  OP_GT,    OP_NOP },
+	[vmop_leq]   = { "<=", OP_LEQ,   OP_NOP },
+	[vmop_geq]   = { ">=", OP_GEQ,   OP_NOP },
+};
+
 static sly_value last_compiled_prototype = SLY_NULL;
 static sly_value kw_symbols[KW_COUNT];
+static sly_value primop_symbols[VMOP_COUNT];
 
 int comp_expr(Sly_State *ss, sly_value form, int reg);
 static int comp_atom(Sly_State *ss, sly_value form, int reg);
@@ -115,12 +131,11 @@ is_keyword(sly_value sym)
 static sly_value
 symbol_lookup_props(Sly_State *ss, sly_value sym, u32 *level, sly_value *uplist)
 {
-	sly_value entry;
+	sly_value props;
 	struct compile *cc = ss->cc;
 	struct scope *scope = cc->cscope;
 	while (scope) {
-		entry = dictionary_entry_ref(scope->symtable, sym);
-		if (!slot_is_free(entry)) {
+		if (dictionary_lookup(scope->symtable, sym, &props)) {
 			if (level)  {
 				*level = scope->level;
 			}
@@ -128,7 +143,7 @@ symbol_lookup_props(Sly_State *ss, sly_value sym, u32 *level, sly_value *uplist)
 				prototype *proto = GET_PTR(scope->proto);
 				*uplist = proto->uplist;
 			}
-			return cdr(entry);
+			return props;
 		}
 		scope = scope->parent;
 	}
@@ -140,7 +155,9 @@ intern_in_vector(Sly_State *ss, sly_value vec, sly_value value)
 {
 	size_t len = vector_len(vec);
 	for (size_t i = 0; i < len; ++i) {
-		if (sly_equal(value, vector_ref(vec, i))) {
+		sly_value elem = vector_ref(vec, i);
+		/* pairs may be global cells, match those by identity */
+		if (pair_p(elem) ? elem == value : sly_equal(value, elem)) {
 			return i;
 		}
 	}
@@ -164,6 +181,22 @@ intern_syntax(Sly_State *ss, sly_value value)
 	return intern_in_vector(ss, proto->syntax_info, value);
 }
 
+static size_t
+intern_global(Sly_State *ss, sly_value sym)
+{ /* Global variables are accessed through their entry
+   * in the globals dictionary. The entry is a stable cell
+   * (globals is a cell dictionary) so every later
+   * (re)definition of the variable is seen through it.
+   */
+	sly_value globals = ss->cc->globals;
+	sly_value entry = dictionary_entry_ref(globals, sym);
+	if (slot_is_free(entry)) {
+		dictionary_set(ss, globals, sym, SLY_VOID);
+		entry = dictionary_entry_ref(globals, sym);
+	}
+	return intern_constant(ss, entry);
+}
+
 static struct scope *
 make_scope(Sly_State *ss)
 {
@@ -238,10 +271,10 @@ comp_define(Sly_State *ss, sly_value form, int reg)
 		if (pair_p(datum) || symbol_p(datum)) {
 			dictionary_set(ss, globals, var, SLY_VOID);
 			comp_expr(ss, CAR(form), reg);
-			if ((size_t)reg + 1 >= proto->nregs) proto->nregs = reg + 2;
+			if ((size_t)reg >= proto->nregs) proto->nregs = reg + 1;
 			int t = intern_syntax(ss, stx);
-			vector_append(ss, proto->code, iABx(OP_LOADK, reg + 1, st_prop.p.reg, t));
-			vector_append(ss, proto->code, iABC(OP_SETUPDICT, 0, reg + 1, reg, t));
+			vector_append(ss, proto->code,
+						  iABx(OP_SETGLOBAL, reg, intern_global(ss, var), t));
 		} else {
 			dictionary_set(ss, globals, var, datum);
 		}
@@ -389,17 +422,14 @@ comp_set(Sly_State *ss, sly_value form, int reg)
 			vector_append(ss, proto->code, iAB(OP_MOVE, st_prop.p.reg, val, src_info));
 		}
 	} else if (st_prop.p.type == sym_global) {
-		st_prop.p.reg = intern_constant(ss, datum);
+		st_prop.p.reg = intern_global(ss, datum);
 		if (!IS_GLOBAL(cc->cscope)) {
 			dictionary_set(ss, cc->cscope->symtable, datum, st_prop.v);
 		}
-		if (val == -1) val = reg++;
-		if (val == reg) reg++;
-		if ((size_t)reg + 1 >= proto->nregs) proto->nregs = reg + 2;
-		vector_append(ss, proto->code,
-					  iABx(OP_LOADK, reg, st_prop.p.reg, src_info));
+		if (val == -1) val = reg;
+		if ((size_t)reg >= proto->nregs) proto->nregs = reg + 1;
 		vector_append(ss, proto->code,
-					  iABC(OP_SETUPDICT, 0, reg, val, src_info));
+					  iABx(OP_SETGLOBAL, val, st_prop.p.reg, src_info));
 	} else if (st_prop.p.type == sym_upval) {
 		vector_append(ss, proto->code,
 					  iAB(OP_SETUPVAL, st_prop.p.reg, val, src_info));
@@ -457,12 +487,11 @@ comp_atom(Sly_State *ss, sly_value form, int reg)
 			return reg;
 		} break;
 		case sym_global: {
-			st_prop.p.reg = intern_constant(ss, datum);
+			st_prop.p.reg = intern_global(ss, datum);
 			if (!IS_GLOBAL(cc->cscope)) {
 				dictionary_set(ss, cc->cscope->symtable, datum, st_prop.v);
 			}
-			vector_append(ss, proto->code, iABx(OP_LOADK, reg, st_prop.p.reg, src_info));
-			vector_append(ss, proto->code, iABC(OP_GETUPDICT, reg, 0, reg, src_info));
+			vector_append(ss, proto->code, iABx(OP_GETGLOBAL, reg, st_prop.p.reg, src_info));
 		} break;
 		}
 	} else { /* constant */
@@ -491,6 +520,67 @@ comp_atom(Sly_State *ss, sly_value form, int reg)
 	return reg;
 }
 
+static int
+primop_lookup(Sly_State *ss, sly_value form)
+{ /* Binary call to a global that names an operator builtin.
+   * Locally bound names are left alone.
+   */
+	sly_value head = CAR(form);
+	if (!identifier_p(head)) return -1;
+	int nargs = 0;
+	for (sly_value args = CDR(form); !null_p(args); args = CDR(args)) {
+		nargs++;
+	}
+	if (nargs != 2) return -1;
+	sly_value sym = syntax_to_datum(head);
+	for (int i = 0; i < VMOP_COUNT; ++i) {
+		if (symbol_eq(sym, primop_symbols[i])) {
+			union symbol_properties st_prop;
+			st_prop.v = symbol_lookup_props(ss, sym, NULL, NULL);
+			if (!void_p(st_prop.v) && st_prop.p.type != sym_global) {
+				return -1;
+			}
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int
+comp_primop(Sly_State *ss, sly_value form, int reg, enum vm_primop prim)
+{ /* The operator is still loaded into R[reg], the opcode
+   * checks it at runtime in case the builtin was redefined.
+   */
+	struct compile *cc = ss->cc;
+	prototype *proto = GET_PTR(cc->cscope->proto);
+	sly_value head = CAR(form);
+	sly_value x = CAR(CDR(form));
+	sly_value y = CAR(CDR(CDR(form)));
+	int src_info = intern_syntax(ss, head);
+	int r = comp_expr(ss, head, reg);
+	if (r != -1 && r != reg) {
+		vector_append(ss, proto->code, iAB(OP_MOVE, reg, r, src_info));
+	}
+	int b = comp_expr(ss, x, reg + 1);
+	if (b == -1) b = reg + 1;
+	sly_value imm = syntax_p(y) ? syntax_to_datum(y) : y;
+	if (primop_info[prim].op_imm != OP_NOP
+		&& int_p(imm)
+		&& get_int(imm) >= INT8_MIN && get_int(imm) <= INT8_MAX) {
+		vector_append(ss, proto->code,
+					  iABC(primop_info[prim].op_imm, reg, b,
+						   (u8)(i8)get_int(imm), src_info));
+	} else {
+		int c = comp_expr(ss, y, reg + 2);
+		if (c == -1) c = reg + 2;
+		vector_append(ss, proto->code,
+					  iABC(primop_info[prim].op, reg, b, c, src_info));
+	}
+	/* R[reg+1] and R[reg+2] are used if the operator is redefined */
+	if ((size_t)reg + 3 > proto->nregs) proto->nregs = reg + 3;
+	return reg;
+}
+
 static int
 comp_funcall(Sly_State *ss, sly_value form, int reg)
 {
@@ -637,16 +727,16 @@ forward_scan_block(Sly_State *ss, sly_value form)
 			if (identifier_p(CAR(expr))) {
 				name = syntax_to_datum(CAR(expr));
 				expr = CDR(expr);
-				if (symbol_eq(name, cstr_to_symbol("begin"))) {
+				if (symbol_eq(name, static_symbol(ss, ssym_begin))) {
 					forward_scan_block(ss, expr);
-				} else if (symbol_eq(name, cstr_to_symbol("define-syntax"))) {
+				} else if (symbol_eq(name, static_symbol(ss, ssym_define_syntax))) {
 					name = CAR(expr);
 					if (pair_p(name) || syntax_pair_p(name)) {
 						name = CAR(name);
 					}
 					st_prop.p.issyntax = 1;
 					goto defvar;
-				} else if (symbol_eq(name, cstr_to_symbol("define"))) {
+				} else if (symbol_eq(name, static_symbol(ss, ssym_define))) {
 					name = CAR(expr);
 					if (pair_p(name) || syntax_pair_p(name)) {
 						name = CAR(name);
@@ -657,8 +747,8 @@ forward_scan_block(Sly_State *ss, sly_value form)
 					var = syntax_to_datum(name);
 					if (IS_GLOBAL(scope)) {
 						st_prop.p.type = sym_global;
-						st_prop.p.reg = intern_constant(ss, var);
 						dictionary_set(ss, globals, var, SLY_VOID);
+						st_prop.p.reg = intern_global(ss, var);
 					} else {
 						st_prop.p.type = sym_variable;
 						st_prop.p.reg = proto->nregs++;
@@ -814,7 +904,12 @@ comp_expr(Sly_State *ss, sly_value form, int reg)
 		} break;
 		}
 	} else {
-		comp_funcall(ss, form, reg);
+		int prim = primop_lookup(ss, form);
+		if (prim != -1) {
+			comp_primop(ss, form, reg, prim);
+		} else {
+			comp_funcall(ss, form, reg);
+		}
 	}
 	return reg;
 }
@@ -825,7 +920,7 @@ void
 sly_init_state(Sly_State *ss)
 {
 	ss->cc = GC_MALLOC(sizeof(*ss->cc));
-	ss->cc->globals = make_dictionary(ss);
+	ss->cc->globals = make_cell_dictionary(ss);
 	ss->cc->cscope = make_scope(ss);
 	ss->cc->cscope->symtable = make_dictionary(ss);
 	init_symtable(ss, ss->cc->cscope->symtable);
@@ -836,7 +931,7 @@ sly_init_state(Sly_State *ss)
 sly_value
 sly_expand_only(Sly_State *ss, char *file_path)
 {
-	ss->interned = make_dictionary(ss);
+	sly_init_symbols(ss);
 	sly_init_state(ss);
 	sly_value env = make_dictionary(ss);
 	sly_expand_init(ss, env);
@@ -855,7 +950,7 @@ void
 sly_do_file(char *file_path, int debug_info)
 {
 	Sly_State ss = {0};
-	ss.interned = make_dictionary(&ss);
+	sly_init_symbols(&ss);
 	sly_init_state(&ss);
 	sly_value env = make_dictionary(&ss);
 	sly_expand_init(&ss, env);
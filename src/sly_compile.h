@@ -9,10 +9,23 @@ union uplookup {
 	} u;
 };
 
+enum vm_primop { /* builtins with their own opcodes */
+	vmop_add = 0,
+	vmop_sub,
+	vmop_mul,
+	vmop_numeq,
+	vmop_lt,
+	vmop_gt,
+	vmop_leq,
+	vmop_geq,
+	VMOP_COUNT,
+};
+
 struct compile {
 	sly_value globals;  // <dictionary>
 	sly_value builtins;  // <dictionary>
 	struct scope *cscope;
+	sly_value primops[VMOP_COUNT]; // <cclosure> original builtins
 };
 
 void sly_init_state(Sly_State *ss);
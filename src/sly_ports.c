@@ -3,7 +3,7 @@
 #include "sly_types.h"
 #include "sly_ports.h"
 
-#define EOF_OBJECT(ss) dictionary_ref((ss)->cc->globals, cstr_to_symbol("eof"), SLY_VOID)
+#define EOF_OBJECT(ss) dictionary_ref((ss)->cc->globals, static_symbol((ss), ssym_eof), SLY_VOID)
 
 struct output_string {
 	FILE *stream;
@@ -18,8 +18,8 @@ input_port_p(Sly_State *ss, sly_value port)
 		return 0;
 	}
 	sly_value plist = user_data_get_properties(port);
-	sly_value v = plist_get(plist, cstr_to_symbol("type:"));
-	return sly_eq(v, cstr_to_symbol("input-port"));
+	sly_value v = plist_get(plist, static_symbol(ss, ssym_type));
+	return sly_eq(v, static_symbol(ss, ssym_input_port));
 }
 
 int
@@ -29,8 +29,8 @@ output_port_p(Sly_State *ss, sly_value port)
 		return 0;
 	}
 	sly_value plist = user_data_get_properties(port);
-	sly_value v = plist_get(plist, cstr_to_symbol("type:"));
-	return sly_eq(v, cstr_to_symbol("output-port"));
+	sly_value v = plist_get(plist, static_symbol(ss, ssym_type));
+	return sly_eq(v, static_symbol(ss, ssym_output_port));
 }
 
 int
@@ -40,9 +40,9 @@ port_p(Sly_State *ss, sly_value port)
 		return 0;
 	}
 	sly_value plist = user_data_get_properties(port);
-	sly_value prop = cstr_to_symbol("type:");
-	return sly_eq(plist_get(plist, prop), cstr_to_symbol("output-port"))
-		|| sly_eq(plist_get(plist, prop), cstr_to_symbol("input-port"));
+	sly_value prop = static_symbol(ss, ssym_type);
+	return sly_eq(plist_get(plist, prop), static_symbol(ss, ssym_output_port))
+		|| sly_eq(plist_get(plist, prop), static_symbol(ss, ssym_input_port));
 }
 
 int
@@ -50,8 +50,8 @@ string_port_p(Sly_State *ss, sly_value port)
 {
 	if (port_p(ss, port)) {
 		sly_value plist = user_data_get_properties(port);
-		return sly_eq(plist_get(plist, cstr_to_symbol("port-type:")),
-					  cstr_to_symbol("file-stream-port"));
+		return sly_eq(plist_get(plist, static_symbol(ss, ssym_port_type)),
+					  static_symbol(ss, ssym_file_stream_port));
 	} else {
 		return 0;
 	}
@@ -69,7 +69,7 @@ file_stream_port_p(Sly_State *ss, sly_value port)
 {
 	if (port_p(ss, port)) {
 		sly_value plist = user_data_get_properties(port);
-		return string_p(plist_get(plist, cstr_to_symbol("file-path:")));
+		return string_p(plist_get(plist, static_symbol(ss, ssym_file_path)));
 	} else {
 		return 0;
 	}
@@ -100,8 +100,8 @@ make_input_port(Sly_State *ss)
 	sly_value port = make_user_data(ss, sizeof(FILE *));
 	sly_value plist = SLY_NULL;
 	plist = plist_put(ss, plist,
-					  cstr_to_symbol("type:"),
-					  cstr_to_symbol("input-port"));
+					  static_symbol(ss, ssym_type),
+					  static_symbol(ss, ssym_input_port));
 	user_data_set_properties(port, plist);
 	return port;
 }
@@ -112,8 +112,8 @@ make_output_port(Sly_State *ss)
 	sly_value port = make_user_data(ss, sizeof(FILE *));
 	sly_value plist = SLY_NULL;
 	plist = plist_put(ss, plist,
-					  cstr_to_symbol("type:"),
-					  cstr_to_symbol("output-port"));
+					  static_symbol(ss, ssym_type),
+					  static_symbol(ss, ssym_output_port));
 	user_data_set_properties(port, plist);
 	return port;
 }
@@ -124,11 +124,11 @@ open_input_file(Sly_State *ss, sly_value file_path)
 	sly_value port = make_input_port(ss);
 	sly_value plist = user_data_get_properties(port);
 	plist = plist_put(ss, plist,
-					  cstr_to_symbol("file-path:"),
+					  static_symbol(ss, ssym_file_path),
 					  file_path);
 	plist = plist_put(ss, plist,
-					  cstr_to_symbol("port-type:"),
-					  cstr_to_symbol("file-stream-port"));
+					  static_symbol(ss, ssym_port_type),
+					  static_symbol(ss, ssym_file_stream_port));
 	user_data_set_properties(port, plist);
 	char *str = string_to_cstr(file_path);
 	FILE *f = fopen(str, "r");
@@ -142,11 +142,11 @@ open_output_string(Sly_State *ss)
 	sly_value port = make_user_data(ss, sizeof(struct output_string));
 	sly_value plist = user_data_get_properties(port);
 	plist = plist_put(ss, plist,
-					  cstr_to_symbol("type:"),
-					  cstr_to_symbol("output-port"));
+					  static_symbol(ss, ssym_type),
+					  static_symbol(ss, ssym_output_port));
 	plist = plist_put(ss, plist,
-					  cstr_to_symbol("port-type:"),
-					  cstr_to_symbol("string-port"));
+					  static_symbol(ss, ssym_port_type),
+					  static_symbol(ss, ssym_string_port));
 	user_data_set_properties(port, plist);
 	struct output_string *data = user_data_get(port);
 	data->stream = open_memstream(&data->str, &data->size);
@@ -159,11 +159,11 @@ open_output_file(Sly_State *ss, sly_value file_path, int append)
 	sly_value port = make_output_port(ss);
 	sly_value plist = user_data_get_properties(port);
 	plist = plist_put(ss, plist,
-					  cstr_to_symbol("file-path:"),
+					  static_symbol(ss, ssym_file_path),
 					  file_path);
 	plist = plist_put(ss, plist,
-					  cstr_to_symbol("port-type:"),
-					  cstr_to_symbol("file-stream-port"));
+					  static_symbol(ss, ssym_port_type),
+					  static_symbol(ss, ssym_file_stream_port));
 	user_data_set_properties(port, plist);
 	char *str = string_to_cstr(file_path);
 	FILE *f;
@@ -5,7 +5,7 @@
 #include "sly_types.h"
 #include "opcodes.h"
 
-#define DICT_INIT_SIZE 32
+#define DICT_INIT_SIZE 32      // must be a power of two
 #define DICT_LOAD_FACTOR 0.70
 
 static u8
@@ -21,15 +21,84 @@ rand_byte(void)
 
 #define DH(h, c) ((((h) << 5) + (h)) + (c))
 
+/* Byte string hashing after wyhash. The input is read a word at a
+ * time and every byte of it counts, along with the length.
+ */
+__extension__ typedef unsigned __int128 u128;
+
+#define HASH_P0 0xa0761d6478bd642fLU
+#define HASH_P1 0xe7037ed1a0b428dbLU
+#define HASH_P2 0x8ebc6af09c88c6e3LU
+#define HASH_P3 0x589965cc75374cc3LU
+
+static inline u64
+hash_mix(u64 a, u64 b)
+{
+	u128 r = (u128)a * b;
+	return (u64)r ^ (u64)(r >> 64);
+}
+
+static inline u64
+hash_read64(u8 *p)
+{
+	u64 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline u64
+hash_read32(u8 *p)
+{
+	u32 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
 static u64
 hash(void *buff, size_t size)
 {
-	u8 *str = buff;
-	u64 h = 5381;
-	while (size--) {
-		h = DH(h, *str++);
+	u8 *p = buff;
+	u64 seed = hash_mix(HASH_P0, HASH_P1);
+	u64 a, b;
+	if (size <= 16) {
+		if (size >= 4) {
+			size_t mid = (size >> 3) << 2;
+			a = (hash_read32(p) << 32) | hash_read32(p + mid);
+			b = (hash_read32(p + size - 4) << 32)
+				| hash_read32(p + size - 4 - mid);
+		} else if (size > 0) {
+			a = ((u64)p[0] << 16) | ((u64)p[size >> 1] << 8) | p[size - 1];
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t i = size;
+		if (i > 48) {
+			u64 s1 = seed, s2 = seed;
+			do {
+				seed = hash_mix(hash_read64(p) ^ HASH_P1,
+								hash_read64(p + 8) ^ seed);
+				s1 = hash_mix(hash_read64(p + 16) ^ HASH_P2,
+							  hash_read64(p + 24) ^ s1);
+				s2 = hash_mix(hash_read64(p + 32) ^ HASH_P3,
+							  hash_read64(p + 40) ^ s2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= s1 ^ s2;
+		}
+		while (i > 16) {
+			seed = hash_mix(hash_read64(p) ^ HASH_P1,
+							hash_read64(p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
+		a = hash_read64(p + i - 16);
+		b = hash_read64(p + i - 8);
 	}
-	return h;
+	u128 r = (u128)(a ^ HASH_P1) * (b ^ seed);
+	return hash_mix((u64)r ^ HASH_P0 ^ size, (u64)(r >> 64) ^ HASH_P1);
 }
 
 #define hash_str(str, len) hash(str, len)
@@ -182,15 +251,13 @@ sly_display(sly_value v, int lit)
 		}
 		printf("\b)");
 	} else if (dictionary_p(v)) {
-		vector *vec = GET_PTR(v);
 		printf("#dict(");
-		if (vec->len) {
-			for (size_t i = 0; i < vec->cap; ++i) {
-				sly_value v = vec->elems[i];
-				if (!slot_is_free(v)) {
-					sly_display(vec->elems[i], 1);
-					printf(" ");
-				}
+		if (dictionary_len(v)) {
+			sly_value key, value;
+			for (size_t i = 0; dictionary_next(v, &i, &key, &value);) {
+				pair entry = { .type = tt_pair, .car = key, .cdr = value };
+				sly_display((sly_value)&entry, 1);
+				printf(" ");
 			}
 			printf("\b)");
 		} else {
@@ -230,11 +297,7 @@ sly_displayln(sly_value v)
 static u64
 hash_hash(u64 h, u64 x)
 {
-	u8 *bytes = (u8 *)(&x);
-	for (size_t i = 0; i < sizeof(x); ++i) {
-		h = DH(h, bytes[i]);
-	}
-	return h;
+	return hash_mix(h ^ HASH_P0, x ^ HASH_P1);
 }
 
 static u64
@@ -250,13 +313,11 @@ hash_vector(sly_value v)
 
 static u64
 hash_dict(sly_value v)
-{
-	vector *vec = GET_PTR(v);
+{ // summed so that the order of the slots does not matter
 	u64 h = 5381;
-	for (size_t i = 0; i < vec->cap; ++i) {
-		if (!slot_is_free(vec->elems[i])) {
-			h = hash_hash(h, sly_hash(vec->elems[i]));
-		}
+	sly_value key, value;
+	for (size_t i = 0; dictionary_next(v, &i, &key, &value);) {
+		h += hash_hash(key, value);
 	}
 	return h;
 }
@@ -289,13 +350,7 @@ sly_hash(sly_value v)
 		return sym->hash;
 	} else if (string_p(v)) {
 		byte_vector *bv = GET_PTR(v);
-		size_t len;
-		if (bv->len > 32) {
-			len = 32;
-		} else {
-			len = bv->len;
-		}
-		return hash_str(bv->elems, len);
+		return hash_str(bv->elems, bv->len);
 	} else if (byte_vector_p(v)) {
 		byte_vector *bv = GET_PTR(v);
 		return hash_str(bv->elems, bv->len);
@@ -320,6 +375,9 @@ symbol_eq(sly_value o1, sly_value o2)
 {
 	sly_assert(symbol_p(o1), "Type Error: Expected symbol");
 	sly_assert(symbol_p(o2), "Type Error: Expected symbol");
+	if (o1 == o2) {
+		return 1;
+	}
 	symbol *s1 = GET_PTR(o1);
 	symbol *s2 = GET_PTR(o2);
 	return s1->hash == s2->hash;
@@ -340,10 +398,8 @@ i64
 get_int(sly_value v)
 {
 	sly_assert(int_p(v), "Type Error: Expected Integer");
-	if (imm_p(v)) {
-		union imm_value i;
-		i.v = v;
-		return i.i.val.as_int;
+	if (fixnum_p(v)) {
+		return fixnum_get(v);
 	}
 	number *i = GET_PTR(v);
 	return i->val.as_int;
@@ -362,10 +418,8 @@ f64
 get_float(sly_value v)
 {
 	sly_assert(float_p(v), "Type Error: Expected Float");
-	if (imm_p(v)) {
-		union imm_value i;
-		i.v = v;
-		return i.i.val.as_float;
+	if (flonum_p(v)) {
+		return flonum_get(v);
 	}
 	number *i = GET_PTR(v);
 	return i->val.as_float;
@@ -374,12 +428,8 @@ get_float(sly_value v)
 sly_value
 make_int(UNUSED_ATTR Sly_State *ss, i64 i)
 {
-	if (i >= INT32_MIN && i <= INT32_MAX) {
-		/* small int */
-		union imm_value v = {0};
-		v.i.type = imm_int;
-		v.i.val.as_int = i;
-		return (v.v & ~TAG_MASK) | st_imm;
+	if (i >= FIXNUM_MIN && i <= FIXNUM_MAX) {
+		return make_fixnum(i);
 	}
 	number *n = GC_MALLOC(sizeof(*n));
 	n->type = tt_int;
@@ -391,7 +441,7 @@ sly_value
 make_byte(Sly_State *ss, i8 i)
 {
 	UNUSED(ss);
-	union imm_value v;
+	union imm_value v = {0};
 	v.i.type = imm_byte;
 	v.i.val.as_byte = i;
 	return (v.v & ~TAG_MASK) | st_imm;
@@ -406,24 +456,28 @@ make_big_float(UNUSED_ATTR Sly_State *ss, f64 f)
 	return (sly_value)n;
 }
 
-sly_value
-make_small_float(UNUSED_ATTR Sly_State *ss, f32 f)
-{
-	union imm_value v = {0};
-	v.i.type = imm_float;
-	v.i.val.as_float = f;
-	sly_value n = v.v;
-	return (n & ~TAG_MASK) | st_imm;
-}
+/* The doubles that do not fit in a flonum and come up often enough
+ * that they should not be allocated each time.
+ */
+static number float_zero = { .type = tt_float, .val.as_float = 0.0 };
+static number float_neg_zero = { .type = tt_float, .val.as_float = -0.0 };
+static number float_inf = { .type = tt_float, .val.as_float = INFINITY };
+static number float_neg_inf = { .type = tt_float, .val.as_float = -INFINITY };
+static number float_nan = { .type = tt_float, .val.as_float = NAN };
 
 sly_value
 make_float(Sly_State *ss, f64 f)
 {
-	if ((f32)f == INFINITY) {
-		return make_big_float(ss, f);
-	} else {
-		return make_small_float(ss, (f32)f);
+	if (flonum_fits(f)) {
+		return make_flonum(f);
+	} else if (f == 0.0) {
+		return (sly_value)(signbit(f) ? &float_neg_zero : &float_zero);
+	} else if (isinf(f)) {
+		return (sly_value)(f < 0 ? &float_neg_inf : &float_inf);
+	} else if (isnan(f)) {
+		return (sly_value)&float_nan;
 	}
+	return make_big_float(ss, f);
 }
 
 sly_value
@@ -904,25 +958,109 @@ make_uninterned_symbol(Sly_State *ss, char *cstr, size_t len)
 sly_value
 make_symbol(Sly_State *ss, char *cstr, size_t len)
 {
-	sly_value sym = SLY_NULL;
-	sly_value str = make_string(ss, cstr, len);
 	sly_value interned = ss->interned;
-	sly_value entry = dictionary_entry_ref(interned, str);
-	if (slot_is_free(entry)) {
-		sym = make_uninterned_symbol(ss, cstr, len);
-		dictionary_set(ss, interned, str, sym);
-	} else {
-		sym = cdr(entry);
+	sly_value sym = dictionary_string_ref(interned, cstr, len, SLY_VOID);
+	if (!void_p(sym)) {
+		return sym;
 	}
+	sym = make_uninterned_symbol(ss, cstr, len);
+	dictionary_set(ss, interned, make_string(ss, cstr, len), sym);
 	return sym;
 }
 
+static char *
+static_symbol_name(int idx)
+{
+	switch ((enum static_symbol)idx) {
+	case ssym_set: return "set!";
+	case ssym_call_cc: return "call/cc";
+	case ssym_call_with_current_continuation:
+		return "call-with-current-continuation";
+	case ssym_values: return "values";
+	case ssym_call_with_values: return "call-with-values";
+	case ssym_apply: return "apply";
+	case ssym_lambda: return "lambda";
+	case ssym_begin: return "begin";
+	case ssym_if: return "if";
+	case ssym_quote: return "quote";
+	case ssym_syntax_quote: return "syntax-quote";
+	case ssym_define: return "define";
+	case ssym_define_syntax: return "define-syntax";
+	case ssym_ellipsis: return "...";
+	case ssym_empty_pattern: return "_";
+	case ssym_expansion_end: return "* END OF EXPANSION *";
+	case ssym_single: return "* SINGLE *";
+	case ssym_required: return "*REQUIRED*";
+	case ssym_eof: return "eof";
+	case ssym_type: return "type:";
+	case ssym_port_type: return "port-type:";
+	case ssym_file_path: return "file-path:";
+	case ssym_input_port: return "input-port";
+	case ssym_output_port: return "output-port";
+	case ssym_file_stream_port: return "file-stream-port";
+	case ssym_string_port: return "string-port";
+	case SSYM_COUNT: break;
+	}
+	sly_assert(0, "Error, No such static symbol");
+	return NULL;
+}
+
+void
+sly_init_symbols(Sly_State *ss)
+{
+	ss->interned = make_dictionary(ss);
+	for (int i = 0; i < SSYM_COUNT; ++i) {
+		ss->static_syms[i] = cstr_to_symbol(static_symbol_name(i));
+	}
+}
+
 static size_t gensym_counter = 0;
+static struct gensym_tag *gensym_tag = NULL;
+static sly_value tagged_symbols = SLY_NULL;
+
+struct gensym_tag *
+gensym_set_tag(struct gensym_tag *tag)
+{ /* While a tag is set symbols are named <base><n>_<tag>
+   * with n counting from zero for that tag. The names are
+   * reproducible so symbols in module images can be matched
+   * up with the ones made when compiling the module.
+   */
+	struct gensym_tag *old = gensym_tag;
+	gensym_tag = tag;
+	return old;
+}
 
 sly_value
-gensym(Sly_State *ss, sly_value base)
+tagged_symbol(Sly_State *ss, char *name, size_t len)
+{ // the one symbol with this name, made by a tagged gensym or an image
+	if (null_p(tagged_symbols)) {
+		tagged_symbols = make_dictionary(ss);
+	}
+	sly_value sym = dictionary_string_ref(tagged_symbols, name, len, SLY_VOID);
+	if (!void_p(sym)) {
+		return sym;
+	}
+	sym = make_uninterned_symbol(ss, name, len);
+	dictionary_set(ss, tagged_symbols, make_string(ss, name, len), sym);
+	return sym;
+}
+
+static sly_value
+make_gensym(Sly_State *ss, char *base, size_t len)
 {
 	char buf[255] = {0};
+	if (gensym_tag) {
+		snprintf(buf, sizeof(buf), "%.*s%zu_%s", (int)len, base,
+				 gensym_tag->counter++, gensym_tag->name);
+		return tagged_symbol(ss, buf, strlen(buf));
+	}
+	snprintf(buf, sizeof(buf), "%.*s%zu", (int)len, base, gensym_counter++);
+	return make_uninterned_symbol(ss, buf, strlen(buf));
+}
+
+sly_value
+gensym(Sly_State *ss, sly_value base)
+{
 	symbol *s;
 	if (identifier_p(base)) {
 		s = GET_PTR(syntax_to_datum(base));
@@ -931,16 +1069,13 @@ gensym(Sly_State *ss, sly_value base)
 	} else {
 		sly_assert(0, "Type error expected symbol");
 	}
-	snprintf(buf, sizeof(buf), "%.*s%zu", (int)s->len, s->name, gensym_counter++);
-	return make_uninterned_symbol(ss, buf, strlen(buf));
+	return make_gensym(ss, (char *)s->name, s->len);
 }
 
 sly_value
 gensym_from_cstr(Sly_State *ss, char *base)
 {
-	char buf[255] = {0};
-	snprintf(buf, sizeof(buf), "%s%zu", base, gensym_counter++);
-	return make_uninterned_symbol(ss, buf, strlen(buf));
+	return make_gensym(ss, base, strlen(base));
 }
 
 
@@ -1130,6 +1265,8 @@ make_prototype(Sly_State *ss, sly_value uplist, sly_value constants, sly_value c
 	proto->has_varg = has_varg;
 	proto->syntax_info = make_vector(ss, 0, 8);
 	proto->binding = SLY_NULL;
+	proto->dcode = NULL;
+	proto->dlen = 0;
 	return (sly_value)proto;
 }
 
@@ -1159,6 +1296,18 @@ make_cclosure(Sly_State *ss, cfunc fn, size_t nargs, int has_varg)
 	return (sly_value)clos;
 }
 
+sly_value
+make_cclosure_argv(Sly_State *ss, cfunc_argv fn, size_t nargs, int has_varg)
+{
+	UNUSED(ss);
+	cclosure *clos = GC_MALLOC(sizeof(*clos));
+	clos->type = tt_cclosure;
+	clos->afn = fn;
+	clos->nargs = nargs;
+	clos->has_varg = has_varg;
+	return (sly_value)clos;
+}
+
 sly_value
 make_continuation(Sly_State *ss, struct _stack_frame *frame, size_t pc, size_t ret_slot)
 {
@@ -1234,7 +1383,7 @@ addix(Sly_State *ss, i64 x, sly_value y)
 	if (int_p(y)) {
 		i64 res;
 		if (__builtin_add_overflow(x, get_int(y), &res)) {
-			sly_assert(0, "Error overflow");
+			sly_raise_exception(ss, EXC_GENERIC, "Error overflow");
 		} else {
 			return make_int(ss, res);
 		}
@@ -1278,7 +1427,7 @@ subix(Sly_State *ss, i64 x, sly_value y)
 	if (int_p(y)) {
 		i64 res;
 		if (__builtin_sub_overflow(x, get_int(y), &res)) {
-			sly_assert(0, "Error overflow");
+			sly_raise_exception(ss, EXC_GENERIC, "Error overflow");
 		} else {
 			return make_int(ss, res);
 		}
@@ -1322,7 +1471,7 @@ mulix(Sly_State *ss, i64 x, sly_value y)
 	if (int_p(y)) {
 		i64 res;
 		if (__builtin_mul_overflow(x, get_int(y), &res)) {
-			sly_assert(0, "Error overflow");
+			sly_raise_exception(ss, EXC_GENERIC, "Error overflow");
 		} else {
 			return make_int(ss, res);
 		}
@@ -1597,7 +1746,7 @@ sly_eqv(sly_value o1, sly_value o2)
 static int
 set_contains(sly_value set, sly_value value)
 { // check if set contains a value
-	return !slot_is_free(dictionary_entry_ref(set, value));
+	return dictionary_has(set, value);
 }
 
 static int
@@ -1606,16 +1755,12 @@ is_subset(sly_value set1, sly_value set2)
 	if (!dictionary_p(set1) || !dictionary_p(set2)) {
 		return 0;
 	}
-	vector *v1 = GET_PTR(set1);
-	vector *vec = GET_PTR(set2);
-	if (v1->len != vec->len) {
+	if (dictionary_len(set1) != dictionary_len(set2)) {
 		return 0;
 	}
-	sly_value entry;
-	for (size_t i = 0; i < vec->cap; ++i) {
-		entry = vec->elems[i];
-		if (!slot_is_free(entry)
-			&& !set_contains(set1, car(entry))) {
+	sly_value key;
+	for (size_t i = 0; dictionary_next(set2, &i, &key, NULL);) {
+		if (!set_contains(set1, key)) {
 			/* if set2 has a value not found in slot1 */
 			return 0;
 		}
@@ -1797,49 +1942,100 @@ sly_value
 copy_dictionary(Sly_State *ss, sly_value dict)
 {
 	sly_assert(dictionary_p(dict), "Type error expected dictionary");
-	sly_value entry, cpy = make_dictionary(ss);
-	vector *entries = GET_PTR(dict);
-	for (size_t i = 0; i < entries->cap; ++i) {
-		entry = entries->elems[i];
-		if (!slot_is_free(entry)) {
-			dictionary_set(ss, cpy, car(entry), cdr(entry));
-		}
+	dictionary *src = GET_PTR(dict);
+	/* a copy of a cell dictionary gets cells of its own */
+	sly_value cpy = src->cells ? make_cell_dictionary(ss)
+		: src->eq ? make_eq_dictionary(ss) : make_dictionary(ss);
+	sly_value key, value;
+	for (size_t i = 0; dictionary_next(dict, &i, &key, &value);) {
+		dictionary_set(ss, cpy, key, value);
 	}
 	return cpy;
 }
 
+static void
+dict_alloc_slots(dictionary *dict, size_t size)
+{ /* Empty slots have a void key, which GC_MALLOC's zeroed memory
+   * already is. Hashes are only read for full slots and hold no
+   * pointers, so the collector does not need to scan them.
+   */
+	dict->cap = size;
+	dict->slots = GC_MALLOC(sizeof(*dict->slots) * size);
+	dict->hashes = GC_MALLOC_ATOMIC(sizeof(*dict->hashes) * size);
+}
+
 static sly_value
-make_dictionary_sz(Sly_State *ss, size_t size)
+make_dictionary_sz(Sly_State *ss, size_t size, int eq, int cells)
 {
-	sly_value v = make_vector(ss, 0, size);
-	vector *dict = GET_PTR(v);
+	UNUSED(ss);
+	dictionary *dict = GC_MALLOC(sizeof(*dict));
 	dict->type = tt_dictionary;
-	for (size_t i = 0; i < dict->cap; ++i) {
-		dict->elems[i] = SLY_NULL;
-	}
-	return v;
+	dict->len = 0;
+	dict->eq = eq;
+	dict->cells = cells;
+	dict_alloc_slots(dict, size);
+	return (sly_value)dict;
 }
 
 sly_value
 make_dictionary(Sly_State *ss)
 {
-	return make_dictionary_sz(ss, DICT_INIT_SIZE);
+	return make_dictionary_sz(ss, DICT_INIT_SIZE, 0, 0);
+}
+
+sly_value
+make_eq_dictionary(Sly_State *ss)
+{ /* Keys are only compared with eq?. Meant for tables keyed by
+   * symbols, which are unique per name once interned.
+   */
+	return make_dictionary_sz(ss, DICT_INIT_SIZE, 1, 0);
+}
+
+sly_value
+make_cell_dictionary(Sly_State *ss)
+{ /* Each value lives in a (key . value) pair that dictionary_entry_ref
+   * hands out. The pair stays valid while the slots move around, the
+   * compiler holds on to the ones in the globals table as variable
+   * cells.
+   */
+	return make_dictionary_sz(ss, DICT_INIT_SIZE, 0, 1);
 }
 
 size_t
 dictionary_len(sly_value d)
 {
 	sly_assert(dictionary_p(d), "Type error expected dictionary");
-	vector *v = GET_PTR(d);
-	return v->len;
+	dictionary *dict = GET_PTR(d);
+	return dict->len;
 }
 
 size_t
 dictionary_cap(sly_value d)
 {
 	sly_assert(dictionary_p(d), "Type error expected dictionary");
-	vector *v = GET_PTR(d);
-	return v->cap;
+	dictionary *dict = GET_PTR(d);
+	return dict->cap;
+}
+
+int
+dictionary_next(sly_value d, size_t *iter, sly_value *key, sly_value *value)
+{ /* for (size_t i = 0; dictionary_next(d, &i, &key, &value);) visits
+   * every entry of d. The dictionary must not be changed while it is
+   * being walked, key and value may be NULL.
+   */
+	sly_assert(dictionary_p(d), "Type error expected dictionary");
+	dictionary *dict = GET_PTR(d);
+	for (size_t i = *iter; i < dict->cap; ++i) {
+		dict_slot *slot = &dict->slots[i];
+		if (!void_p(slot->key)) {
+			*iter = i + 1;
+			if (key) *key = slot->key;
+			if (value) *value = dict->cells ? cdr(slot->value) : slot->value;
+			return 1;
+		}
+	}
+	*iter = dict->cap;
+	return 0;
 }
 
 sly_value
@@ -1847,76 +2043,104 @@ dictionary_to_alist(Sly_State *ss, sly_value d)
 {
 	sly_assert(dictionary_p(d), "Type error expected dictionary");
 	sly_value alist = SLY_NULL;
-	sly_value entry;
-	vector *dict = GET_PTR(d);
-	for (size_t i = 0; i < dict->cap; ++i) {
-		entry = dict->elems[i];
-		if (!slot_is_free(entry)) {
-			alist = cons(ss, cons(ss, car(entry), cdr(entry)), alist);
-		}
+	sly_value key, value;
+	for (size_t i = 0; dictionary_next(d, &i, &key, &value);) {
+		alist = cons(ss, cons(ss, key, value), alist);
 	}
 	return alist;
 }
 
 int
 slot_is_free(sly_value slot)
-{
+{ // for the cells of a cell dictionary, see dictionary_entry_ref
 	return null_p(slot) || null_p(car(slot));
 }
 
+/* The table is indexed by the low bits of the hash, spread the bits
+ * of the hash around first since pointers and small integers share
+ * their low bits.
+ */
+static u64
+dict_mix(u64 h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdLU;
+	h ^= h >> 33;
+	return h;
+}
+
+static u64
+dict_hash(dictionary *dict, sly_value key)
+{
+	if (dict->eq) {
+		return dict_mix(symbol_p(key) ? symbol_hash(key) : key);
+	}
+	return dict_mix(sly_hash(key));
+}
+
+#define DICT_NOT_FOUND ((size_t)-1)
+
+/* how far the key in a full slot is from the slot it hashes to */
+#define dict_probe_len(dict, i) (((i) - (dict)->hashes[i]) & ((dict)->cap - 1))
+
 static size_t
-dict_get_slot(sly_value d, sly_value key)
-{
-	vector *dict = GET_PTR(d);
-	u64 h = sly_hash(key);
-	size_t idx = h % dict->cap;
-	i64 free_slot = -1;
-	size_t i = idx;
-	size_t end = dict->cap;
-	/* search from hash index to end of array */
-loop:
-	for (; i < end; ++i) {
-		if (null_p(dict->elems[i])) {
-			if (free_slot == -1) {
-				return i;
-			}
-			return free_slot;
-		} else if (null_p(car(dict->elems[i]))) {
-			if (free_slot == -1) {
-				free_slot = i;
-			}
-		} else if (sly_equal(key, car(dict->elems[i]))) {
+dict_find(dictionary *dict, sly_value key, u64 h)
+{
+	size_t mask = dict->cap - 1;
+	for (size_t i = h & mask, dist = 0;; i = (i + 1) & mask, ++dist) {
+		sly_value k = dict->slots[i].key;
+		/* a key is never further from home than the keys it passed */
+		if (void_p(k) || dict_probe_len(dict, i) < dist) {
+			return DICT_NOT_FOUND;
+		}
+		if (dict->hashes[i] == h
+			&& (k == key || (!dict->eq && sly_equal(key, k)))) {
 			return i;
 		}
 	}
-	if (i == dict->cap) {
-		/* search again from begining to hash index */
-		i = 0;
-		end = idx;
-		goto loop;
+}
+
+static void
+dict_insert(dictionary *dict, sly_value key, sly_value value, u64 h)
+{ /* Robin Hood insertion: a key that has come further than the one
+   * in the slot takes the slot and the displaced key moves on.
+   */
+	size_t mask = dict->cap - 1;
+	dict_slot cur = { key, value };
+	for (size_t i = h & mask, dist = 0;; i = (i + 1) & mask, ++dist) {
+		dict_slot *slot = &dict->slots[i];
+		if (void_p(slot->key)) {
+			*slot = cur;
+			dict->hashes[i] = h;
+			dict->len++;
+			return;
+		}
+		size_t d = dict_probe_len(dict, i);
+		if (d < dist) {
+			dict_slot tmp = *slot;
+			u64 th = dict->hashes[i];
+			*slot = cur;
+			dict->hashes[i] = h;
+			cur = tmp;
+			h = th;
+			dist = d;
+		}
 	}
-	/* we should *never* reach this point if dictionary is properly maintianed */
-	sly_assert(0, "Dictionary Key Error key not found");
-	return -1;
 }
 
 static void
-dict_resize(Sly_State *ss, sly_value d)
-{
-	vector *old = GET_PTR(d);
-	d = make_dictionary_sz(ss, old->cap * 2);
-	vector *new = GET_PTR(d);
-	for (size_t i = 0; i < old->cap; ++i) {
-		sly_value entry = old->elems[i];
-		if (!slot_is_free(entry)) {
-			dictionary_set(ss, d, car(entry), cdr(entry));
+dict_resize(dictionary *dict)
+{
+	dict_slot *slots = dict->slots;
+	u64 *hashes = dict->hashes;
+	size_t cap = dict->cap;
+	dict_alloc_slots(dict, cap * 2);
+	dict->len = 0;
+	for (size_t i = 0; i < cap; ++i) {
+		if (!void_p(slots[i].key)) {
+			dict_insert(dict, slots[i].key, slots[i].value, hashes[i]);
 		}
 	}
-	void *tmp = old->elems;
-	old->cap = new->cap;
-	old->len = new->len;
-	old->elems = new->elems;
-	new->elems = tmp;
 }
 
 void
@@ -1925,39 +2149,96 @@ dictionary_set(Sly_State *ss, sly_value d, sly_value key, sly_value value)
 	sly_assert(dictionary_p(d), "Type Error expected <dictionary>");
 	sly_assert(!null_p(key), "Type Error key cannot be <null>");
 	sly_assert(!void_p(key), "Type Error key cannot be <void>");
-	vector *dict = GET_PTR(d);
-	size_t idx = dict_get_slot(d, key);
-	sly_value entry = dict->elems[idx];
-	if (slot_is_free(entry)) {
-		dict->elems[idx] = cons(ss, key, value);
-		dict->len++;
-		if (((f64)dict->len / (f64)dict->cap) > DICT_LOAD_FACTOR) {
-			dict_resize(ss, d);
+	dictionary *dict = GET_PTR(d);
+	u64 h = dict_hash(dict, key);
+	size_t i = dict_find(dict, key, h);
+	if (i != DICT_NOT_FOUND) {
+		if (dict->cells) {
+			set_cdr(dict->slots[i].value, value);
+		} else {
+			dict->slots[i].value = value;
 		}
-	} else {
-		set_cdr(entry, value);
+		return;
+	}
+	if (dict->cells) {
+		value = cons(ss, key, value);
 	}
+	if (((f64)(dict->len + 1) / (f64)dict->cap) > DICT_LOAD_FACTOR) {
+		dict_resize(dict);
+	}
+	dict_insert(dict, key, value, h);
 }
 
 sly_value
 dictionary_entry_ref(sly_value d, sly_value key)
-{
+{ /* The (key . value) cell of key in a cell dictionary, or null. The
+   * cell can be held on to, setting its cdr sets the entry and its car
+   * becomes null when the entry is removed (see slot_is_free).
+   */
+	sly_assert(dictionary_p(d), "Type Error expected <dictionary>");
+	sly_assert(!null_p(key), "Type Error key cannot be <null>");
+	sly_assert(!void_p(key), "Type Error key cannot be <void>");
+	dictionary *dict = GET_PTR(d);
+	sly_assert(dict->cells, "Type Error expected cell <dictionary>");
+	size_t i = dict_find(dict, key, dict_hash(dict, key));
+	return i == DICT_NOT_FOUND ? SLY_NULL : dict->slots[i].value;
+}
+
+int
+dictionary_lookup(sly_value d, sly_value key, sly_value *value)
+{ // 1 and the value of key in *value, or 0 when key is not in d
 	sly_assert(dictionary_p(d), "Type Error expected <dictionary>");
 	sly_assert(!null_p(key), "Type Error key cannot be <null>");
 	sly_assert(!void_p(key), "Type Error key cannot be <void>");
-	size_t idx = dict_get_slot(d, key);
-	vector *dict = GET_PTR(d);
-	return dict->elems[idx];
+	dictionary *dict = GET_PTR(d);
+	size_t i = dict_find(dict, key, dict_hash(dict, key));
+	if (i == DICT_NOT_FOUND) {
+		return 0;
+	}
+	if (value) {
+		sly_value v = dict->slots[i].value;
+		*value = dict->cells ? cdr(v) : v;
+	}
+	return 1;
+}
+
+int
+dictionary_has(sly_value d, sly_value key)
+{
+	return dictionary_lookup(d, key, NULL);
 }
 
 sly_value
 dictionary_ref(sly_value d, sly_value key, sly_value not_found)
 {
-	sly_value entry = dictionary_entry_ref(d, key);
-	if (slot_is_free(entry)) {
-		return not_found;
+	sly_value value;
+	if (dictionary_lookup(d, key, &value)) {
+		return value;
+	}
+	return not_found;
+}
+
+sly_value
+dictionary_string_ref(sly_value d, char *cstr, size_t len, sly_value not_found)
+{ // dictionary_ref for a <string> key, without making the string
+	sly_assert(dictionary_p(d), "Type Error expected <dictionary>");
+	dictionary *dict = GET_PTR(d);
+	sly_assert(!dict->eq && !dict->cells,
+			   "Type Error expected <dictionary> compared with equal?");
+	u64 h = dict_mix(hash_str(cstr, len));
+	size_t mask = dict->cap - 1;
+	for (size_t i = h & mask, dist = 0;; i = (i + 1) & mask, ++dist) {
+		sly_value key = dict->slots[i].key;
+		if (void_p(key) || dict_probe_len(dict, i) < dist) {
+			return not_found;
+		}
+		if (dict->hashes[i] == h && string_p(key)) {
+			byte_vector *bv = GET_PTR(key);
+			if (bv->len == len && memcmp(bv->elems, cstr, len) == 0) {
+				return dict->slots[i].value;
+			}
+		}
 	}
-	return cdr(entry);
 }
 
 void
@@ -1966,10 +2247,23 @@ dictionary_remove(sly_value d, sly_value key)
 	sly_assert(dictionary_p(d), "Type Error expected <dictionary>");
 	sly_assert(!null_p(key), "Type Error key cannot be <null>");
 	sly_assert(!void_p(key), "Type Error key cannot be <void>");
-	size_t idx = dict_get_slot(d, key);
-	vector *dict = GET_PTR(d);
-	sly_assert(!slot_is_free(dict->elems[idx]), "Dictionary Key Error key not found");
-	set_car(dict->elems[idx], SLY_NULL); // null key indicates slot is free
+	dictionary *dict = GET_PTR(d);
+	size_t i = dict_find(dict, key, dict_hash(dict, key));
+	sly_assert(i != DICT_NOT_FOUND, "Dictionary Key Error key not found");
+	if (dict->cells) {
+		set_car(dict->slots[i].value, SLY_NULL); // for anyone holding the cell
+	}
+	/* shift the rest of the probe sequence back by one, so lookups
+	 * never have to step over removed entries */
+	size_t mask = dict->cap - 1;
+	for (size_t j = (i + 1) & mask;
+		 !void_p(dict->slots[j].key) && dict_probe_len(dict, j) > 0;
+		 i = j, j = (j + 1) & mask) {
+		dict->slots[i] = dict->slots[j];
+		dict->hashes[i] = dict->hashes[j];
+	}
+	dict->slots[i].key = SLY_VOID;
+	dict->slots[i].value = SLY_VOID;
 	dict->len--;
 }
 
@@ -1977,13 +2271,9 @@ void
 dictionary_import(Sly_State *ss, sly_value dst, sly_value src)
 {
 	sly_assert(dictionary_p(dst), "Type Error expected <dictionary>");
-	sly_assert(dictionary_p(src), "Type Error expected <dictionary>");
-	vector *vsrc = GET_PTR(src);
-	for (size_t i = 0; i < vsrc->cap; ++i) {
-		sly_value entry = vsrc->elems[i];
-		if (!slot_is_free(entry)) {
-			dictionary_set(ss, dst, car(entry), cdr(entry));
-		}
+	sly_value key, value;
+	for (size_t i = 0; dictionary_next(src, &i, &key, &value);) {
+		dictionary_set(ss, dst, key, value);
 	}
 }
 
@@ -1998,31 +2288,16 @@ dictionary_union(Sly_State *ss, sly_value d1, sly_value d2)
 sly_value
 dictionary_get_entries(Sly_State *ss, sly_value d)
 {
-	sly_assert(dictionary_p(d), "Type Error expected <dictionary>");
-	vector *dict = GET_PTR(d);
-	sly_value list = SLY_NULL;
-	sly_value entry;
-	for (size_t i = 0; i < dict->cap; ++i) {
-		entry = dict->elems[i];
-		if (!slot_is_free(entry)) {
-			list = cons(ss, entry, list);
-		}
-	}
-	return list;
+	return dictionary_to_alist(ss, d);
 }
 
 sly_value
 dictionary_get_keys(Sly_State *ss, sly_value d)
 {
-	sly_assert(dictionary_p(d), "Type Error expected <dictionary>");
-	vector *dict = GET_PTR(d);
 	sly_value list = SLY_NULL;
-	sly_value entry;
-	for (size_t i = 0; i < dict->cap; ++i) {
-		entry = dict->elems[i];
-		if (!slot_is_free(entry)) {
-			list = cons(ss, car(entry), list);
-		}
+	sly_value key;
+	for (size_t i = 0; dictionary_next(d, &i, &key, NULL);) {
+		list = cons(ss, key, list);
 	}
 	return list;
 }
@@ -2030,15 +2305,10 @@ dictionary_get_keys(Sly_State *ss, sly_value d)
 sly_value
 dictionary_get_values(Sly_State *ss, sly_value d)
 {
-	sly_assert(dictionary_p(d), "Type Error expected <dictionary>");
-	vector *dict = GET_PTR(d);
 	sly_value list = SLY_NULL;
-	sly_value entry;
-	for (size_t i = 0; i < dict->cap; ++i) {
-		entry = dict->elems[i];
-		if (!slot_is_free(entry)) {
-			list = cons(ss, cdr(entry), list);
-		}
+	sly_value value;
+	for (size_t i = 0; dictionary_next(d, &i, NULL, &value);) {
+		list = cons(ss, value, list);
 	}
 	return list;
 }
@@ -2211,10 +2481,10 @@ plist_put(Sly_State *ss, sly_value plist, sly_value prop, sly_value value)
 	}
 }
 
-#define ELLIPSIS cstr_to_symbol("...")
-#define EMPTY_PATTERN cstr_to_symbol("_")
-#define EXPANSION_END cstr_to_symbol("* END OF EXPANSION *")
-#define SINGLE cstr_to_symbol("* SINGLE *")
+#define ELLIPSIS static_symbol(ss, ssym_ellipsis)
+#define EMPTY_PATTERN static_symbol(ss, ssym_empty_pattern)
+#define EXPANSION_END static_symbol(ss, ssym_expansion_end)
+#define SINGLE static_symbol(ss, ssym_single)
 
 static int
 match_id_symbol(sly_value pattern, sly_value sym)
@@ -2267,18 +2537,19 @@ static void
 pvar_bind(Sly_State *ss, sly_value pvars, sly_value p, sly_value f, int repeat)
 {
 	sly_value key = strip_syntax(p);
-	sly_value entry = dictionary_entry_ref(pvars, key);
+	sly_value value;
+	int found = dictionary_lookup(pvars, key, &value);
 	if (repeat) {
-		if (slot_is_free(entry)) {
+		if (!found) {
 			dictionary_set(ss, pvars, key, cons(ss, f, SLY_NULL));
 		} else {
-			append(cdr(entry), cons(ss, f, SLY_NULL));
+			append(value, cons(ss, f, SLY_NULL));
 		}
 	} else if (match_id_ellipsis(ss, p)) {
-		if (slot_is_free(entry)) {
+		if (!found) {
 			dictionary_set(ss, pvars, key, f);
 		} else {
-			dictionary_import(ss, cdr(entry), f);
+			dictionary_import(ss, value, f);
 		}
 	} else {
 		/* Single */
@@ -2290,11 +2561,10 @@ static sly_value
 pvar_value(Sly_State *ss, sly_value pvars, sly_value t, size_t idx)
 {
 	sly_value key = strip_syntax(t);
-	sly_value entry = dictionary_entry_ref(pvars, key);
-	if (slot_is_free(entry)) {
+	sly_value v;
+	if (!dictionary_lookup(pvars, key, &v)) {
 		return SLY_VOID;
 	}
-	sly_value v = cdr(entry);
 	if (pair_p(v)) {
 		if (match_id_symbol(car(v), SINGLE)) {
 			return cdr(v);
@@ -10,23 +10,37 @@
 
 typedef u64 sly_value;
 
-#define st_ptr   0x0
-#define st_null  0x1
-#define st_imm   0x2
-#define st_false 0x3
-#define st_true  0x4
-#define TAG_MASK 0x7
+/* The low three bits of a value are its tag:
+ *   000         pointer to a heap object (or void)
+ *   001         fixnum, a 61 bit integer in the upper bits
+ *   100         null, false or true
+ *   101         other immediates (see union imm_value)
+ *   x1x         flonum, a double rotated left by 3 plus one
+ * Rotating a double brings its sign and the top two bits of its
+ * exponent down into the tag. Those two bits differ for every
+ * magnitude from 2^-511 to 2^513, so all of those doubles can be
+ * stored as is. Anything else (zero, subnormal, huge, inf or nan)
+ * is a heap number, see make_float.
+ */
+#define st_ptr    0x0
+#define st_fixnum 0x1
+#define st_flonum 0x2
+#define st_const  0x4
+#define st_imm    0x5
+#define TAG_MASK  0x7
+#define TAG_BITS  3
+
+#define FIXNUM_MIN (-((i64)1 << 60))
+#define FIXNUM_MAX (((i64)1 << 60) - 1)
 
 enum imm_type {
-	imm_int = 0,
-	imm_byte,
-	imm_float,
+	imm_byte = 0,
 };
 
-#define SLY_NULL  ((sly_value)st_null)
+#define SLY_NULL  ((sly_value)((0 << TAG_BITS) | st_const))
 #define SLY_VOID  ((sly_value)0)
-#define SLY_FALSE ((sly_value)st_false)
-#define SLY_TRUE  ((sly_value)st_true)
+#define SLY_FALSE ((sly_value)((1 << TAG_BITS) | st_const))
+#define SLY_TRUE  ((sly_value)((2 << TAG_BITS) | st_const))
 #define ctobool(b) ((b) ? SLY_TRUE : SLY_FALSE)
 #define booltoc(b) ((b) == SLY_FALSE ? 0 : 1)
 #define HANDLE_EXCEPTION(ss, code)				\
@@ -53,15 +67,57 @@ enum exc_code { /* exception code */
 	EXCEPTION_COUNT,
 };
 
+typedef struct _stack_pos { /* position in the vm stack */
+	struct _stack_chunk *chunk;
+	size_t top;
+} stack_pos;
+
+/* Symbols that are looked up by name on hot paths. They are
+ * interned once per state by sly_init_symbols, get them with
+ * static_symbol.
+ */
+enum static_symbol {
+	ssym_set = 0,
+	ssym_call_cc,
+	ssym_call_with_current_continuation,
+	ssym_values,
+	ssym_call_with_values,
+	ssym_apply,
+	ssym_lambda,
+	ssym_begin,
+	ssym_if,
+	ssym_quote,
+	ssym_syntax_quote,
+	ssym_define,
+	ssym_define_syntax,
+	ssym_ellipsis,
+	ssym_empty_pattern,
+	ssym_expansion_end,
+	ssym_single,
+	ssym_required,
+	ssym_eof,
+	ssym_type,
+	ssym_port_type,
+	ssym_file_path,
+	ssym_input_port,
+	ssym_output_port,
+	ssym_file_stream_port,
+	ssym_string_port,
+	SSYM_COUNT,
+};
+
 typedef struct _sly_state {
 	char *file_path;
 	char *source_code;
 	struct compile *cc;
 	struct _stack_frame *frame;
+	stack_pos sp;            /* top of the vm stack */
+	stack_pos base;          /* bottom of the running vm activation */
 	struct _upvalue *open_upvals;
 	sly_value proto;
 	sly_value entry_point;   /* closure */
 	sly_value interned;
+	sly_value static_syms[SSYM_COUNT];
 	jmp_buf jbuf;
 	char *excpt_msg;
 	int handle_except;
@@ -147,6 +203,32 @@ typedef struct _vector {
 	sly_value *elems;
 } vector;
 
+typedef struct _dict_slot {
+	sly_value key;          // void when the slot is empty
+	sly_value value;
+} dict_slot;
+
+/* A dictionary is an open addressed hash table. Keys and values are
+ * stored in the slots themselves and the hash of each key is kept in
+ * a parallel array. The capacity is a power of two and collisions are
+ * resolved with Robin Hood probing, so slots move around as keys are
+ * added and removed. Walk a dictionary with dictionary_next.
+ *
+ * An eq dictionary compares keys by identity only, see
+ * make_eq_dictionary. A cell dictionary stores each value in a
+ * (key . value) pair that stays put for the life of the entry, see
+ * make_cell_dictionary and dictionary_entry_ref.
+ */
+typedef struct _dictionary {
+	OBJ_HEADER;
+	size_t len;
+	size_t cap;
+	dict_slot *slots;
+	u64 *hashes;
+	u8 eq;
+	u8 cells;
+} dictionary;
+
 typedef struct _proto {
 	OBJ_HEADER;
 	sly_value uplist;		// <vector> list of upval locations
@@ -159,6 +241,8 @@ typedef struct _proto {
 	int has_varg;			// has variable argument
 	sly_value syntax_info;	// <vector> syntax
 	sly_value binding;		// symbol
+	struct _dinstr *dcode;	// decoded code, filled in on first call
+	size_t dlen;			// length of code when it was decoded
 } prototype;
 
 typedef struct _upvalue {
@@ -187,12 +271,17 @@ typedef struct _cont {
 } continuation;
 
 typedef sly_value (*cfunc)(Sly_State *ss, sly_value args);
+/* Arguments are passed in place (a pointer into the caller's
+ * registers), varargs are not collected into a list.
+ */
+typedef sly_value (*cfunc_argv)(Sly_State *ss, sly_value *args, size_t nargs);
 
 typedef struct _cclos {
 	OBJ_HEADER;
 	int has_varg;
-	size_t nargs; // <vector> arglist
-	cfunc fn;     // pointer to c function
+	size_t nargs;    // <vector> arglist
+	cfunc fn;        // pointer to c function
+	cfunc_argv afn;  // used instead of fn when not NULL
 } cclosure;
 
 struct scope {
@@ -217,6 +306,11 @@ typedef struct _syntax {
 	u32 context;
 } syntax;
 
+struct gensym_tag {
+	char name[17];
+	size_t counter;
+};
+
 typedef struct _user_data {
 	OBJ_HEADER;
 	sly_value properties;    // plist
@@ -239,7 +333,6 @@ sly_value make_int(Sly_State *ss, i64 i);
 sly_value make_byte(Sly_State *ss, i8 i);
 sly_value make_float(Sly_State *ss, f64 f);
 sly_value make_big_float(Sly_State *ss, f64 f);
-sly_value make_small_float(Sly_State *ss, f32  f);
 sly_value cons(Sly_State *ss, sly_value car, sly_value cdr);
 sly_value car(sly_value obj);
 sly_value cdr(sly_value obj);
@@ -281,9 +374,11 @@ sly_value vector_discard_values(Sly_State *ss, sly_value v);
 int vector_contains(Sly_State *ss, sly_value vec, sly_value value);
 sly_value make_uninterned_symbol(Sly_State *ss, char *cstr, size_t len);
 sly_value make_symbol(Sly_State *ss, char *cstr, size_t len);
+struct gensym_tag *gensym_set_tag(struct gensym_tag *tag);
+sly_value tagged_symbol(Sly_State *ss, char *name, size_t len);
 sly_value gensym(Sly_State *ss, sly_value base);
 sly_value gensym_from_cstr(Sly_State *ss, char *base);
-sly_value get_interned_symbol(sly_value alist, char *name, size_t len);
+void sly_init_symbols(Sly_State *ss);
 void intern_symbol(Sly_State *ss, sly_value sym_v);
 u64 symbol_hash(sly_value sym);
 char *char_name_cstr(char c);
@@ -302,6 +397,7 @@ sly_value make_prototype(Sly_State *ss, sly_value uplist, sly_value constants,
 						 size_t entry, int has_varg);
 sly_value make_closure(Sly_State *ss, sly_value _proto);
 sly_value make_cclosure(Sly_State *ss, cfunc fn, size_t nargs, int has_varg);
+sly_value make_cclosure_argv(Sly_State *ss, cfunc_argv fn, size_t nargs, int has_varg);
 sly_value make_continuation(Sly_State *ss,
 							struct _stack_frame *frame,
 							size_t pc,
@@ -339,6 +435,8 @@ char *symbol_to_cstr(sly_value sym);
 void symbol_set_alias(sly_value sym, sly_value alias);
 sly_value symbol_get_alias(sly_value sym);
 sly_value make_dictionary(Sly_State *ss);
+sly_value make_eq_dictionary(Sly_State *ss);
+sly_value make_cell_dictionary(Sly_State *ss);
 size_t dictionary_len(sly_value d);
 size_t dictionary_cap(sly_value d);
 sly_value dictionary_to_alist(Sly_State *ss, sly_value d);
@@ -346,7 +444,12 @@ sly_value copy_dictionary(Sly_State *ss, sly_value dict);
 int slot_is_free(sly_value slot);
 void dictionary_set(Sly_State *ss, sly_value d, sly_value key, sly_value value);
 sly_value dictionary_entry_ref(sly_value d, sly_value key);
+sly_value dictionary_string_ref(sly_value d, char *cstr, size_t len,
+								sly_value not_found);
 sly_value dictionary_ref(sly_value d, sly_value key, sly_value not_found);
+int dictionary_lookup(sly_value d, sly_value key, sly_value *value);
+int dictionary_has(sly_value d, sly_value key);
+int dictionary_next(sly_value d, size_t *iter, sly_value *key, sly_value *value);
 void dictionary_remove(sly_value d, sly_value key);
 void dictionary_import(Sly_State *ss, sly_value dst, sly_value src);
 sly_value dictionary_union(Sly_State *ss, sly_value d1, sly_value d2);
@@ -375,6 +478,7 @@ sly_value construct_syntax(Sly_State *ss, sly_value template, sly_value pvars,
 
 #define sly_assert(p, msg) _sly_assert(p, msg, __LINE__, __func__, __FILE__)
 #define cstr_to_symbol(cstr) (make_symbol(ss, (cstr), strlen(cstr)))
+#define static_symbol(ss, id) ((ss)->static_syms[(id)])
 
 /* type predicates */
 #define null_p(v)        ((v) == SLY_NULL)
@@ -384,8 +488,10 @@ sly_value construct_syntax(Sly_State *ss, sly_value template, sly_value pvars,
 #define GET_PTR(v)       ((void *)((v) & ~TAG_MASK))
 #define TYPEOF(v)        (*((int *)GET_PTR(v)))
 #define imm_p(v)         (((v) & TAG_MASK) == st_imm)
-#define true_p(v)        (((v) & TAG_MASK) == st_true)
-#define false_p(v)       (((v) & TAG_MASK) == st_false)
+#define true_p(v)        ((v) == SLY_TRUE)
+#define false_p(v)       ((v) == SLY_FALSE)
+#define fixnum_p(v)      (((v) & TAG_MASK) == st_fixnum)
+#define flonum_p(v)      (((v) & st_flonum) != 0)
 #define bool_p(v)        (true_p(v) || false_p(v))
 #define number_p(v)      (int_p(v) || float_p(v) || byte_p(v))
 #define pair_p(v)        (ptr_p(v) && TYPEOF(v) == tt_pair)
@@ -406,47 +512,65 @@ sly_value construct_syntax(Sly_State *ss, sly_value template, sly_value pvars,
 #define identifier_p(v)  (syntax_p(v) && symbol_p(syntax_to_datum(v)))
 #define ir_closure_p(v)  (ptr_p(v) && TYPEOF(v) == tt_ir_closure)
 
+static inline sly_value
+make_fixnum(i64 i)
+{
+	return ((u64)i << TAG_BITS) | st_fixnum;
+}
+
+static inline i64
+fixnum_get(sly_value v)
+{
+	return (i64)v >> TAG_BITS;
+}
+
+static inline int
+flonum_fits(f64 f)
+{
+	u64 b;
+	memcpy(&b, &f, sizeof(b));
+	return ((b >> 61) ^ (b >> 62)) & 1;
+}
+
+static inline sly_value
+make_flonum(f64 f)
+{
+	u64 b;
+	memcpy(&b, &f, sizeof(b));
+	return ((b << TAG_BITS) | (b >> (64 - TAG_BITS))) + 1;
+}
+
+static inline f64
+flonum_get(sly_value v)
+{
+	u64 b = v - 1;
+	b = (b >> TAG_BITS) | (b << (64 - TAG_BITS));
+	f64 f;
+	memcpy(&f, &b, sizeof(f));
+	return f;
+}
+
 static inline int
 int_p(sly_value val)
 {
-	if (null_p(val) || void_p(val)) return 0;
-	if (imm_p(val)) {
-		union imm_value v;
-		v.v = val;
-		return v.i.type == imm_int;
-	} else if (val & TAG_MASK) {
-		return 0;
-	}
-	return TYPEOF(val) == tt_int;
+	return fixnum_p(val) || (ptr_p(val) && TYPEOF(val) == tt_int);
 }
 
 static inline int
 float_p(sly_value val)
 {
-	if (null_p(val) || void_p(val)) return 0;
-	if (imm_p(val)) {
-		union imm_value v;
-		v.v = val;
-		return v.i.type == imm_float;
-	} else if (val & TAG_MASK) {
-		return 0;
-	}
-	return TYPEOF(val) == tt_float;
+	return flonum_p(val) || (ptr_p(val) && TYPEOF(val) == tt_float);
 }
 
 static inline int
 byte_p(sly_value val)
 {
-	if (null_p(val) || void_p(val)) return 0;
 	if (imm_p(val)) {
 		union imm_value v;
 		v.v = val;
 		return v.i.type == imm_byte;
-	}  else if (val & TAG_MASK) {
-		return 0;
 	}
-	return TYPEOF(val) == tt_byte;
-	return 0;
+	return ptr_p(val) && TYPEOF(val) == tt_byte;
 }
 
 #endif /* SLY_TYPES_H_ */
@@ -7,10 +7,9 @@
 #include "eval.h"
 #include "opcodes.h"
 
-#define next_instr()    vector_ref(ss->frame->code, ss->frame->pc++)
 #define get_const(i)    vector_ref(ss->frame->K, (i))
-#define get_reg(i)      vector_ref(ss->frame->R, (i))
-#define set_reg(i, v)   vector_set(ss->frame->R, (i), (v))
+#define get_reg(i)      (ss->frame->R[(i)])
+#define set_reg(i, v)   (ss->frame->R[(i)] = (v))
 #define get_upval(i)    upvalue_get(vector_ref(ss->frame->U, (i)))
 #define set_upval(i, v) upvalue_set(vector_ref(ss->frame->U, (i)), (v))
 #define TOP_LEVEL_P(frame) ((frame)->level == 0 || (frame)->cont == SLY_NULL)
@@ -34,6 +33,193 @@ vm_bt(stack_frame *frame)
 	}
 }
 
+/* The VM stack is a list of chunks. Frames are pushed onto the
+ * top of the current chunk with their registers laid out right
+ * after the frame header. A frame normally returns through its
+ * inline continuation (frame->ret), so ordinary calls and returns
+ * allocate nothing. Chunks never move, register addresses stay
+ * valid for as long as the frame is on the stack.
+ *
+ * A frame is moved to the heap when its registers must outlive
+ * the stack: when a closure captures one of its variables, or when
+ * a continuation is captured with call/cc or invoked out of order.
+ * In the latter case every frame reachable from the current one is
+ * moved (see reify_frames).
+ */
+#define STACK_CHUNK_WORDS (1 << 16)
+
+static stack_chunk *
+stack_next_chunk(stack_chunk *chunk, size_t words)
+{
+	if (chunk && chunk->next && chunk->next->cap >= words) {
+		return chunk->next;
+	}
+	size_t cap = words > STACK_CHUNK_WORDS ? words : STACK_CHUNK_WORDS;
+	stack_chunk *nchunk = GC_MALLOC(sizeof(*nchunk) + cap * sizeof(sly_value));
+	nchunk->cap = cap;
+	if (chunk) {
+		nchunk->next = chunk->next;
+		chunk->next = nchunk;
+	}
+	return nchunk;
+}
+
+stack_pos
+vm_stack_mark(Sly_State *ss)
+{
+	if (ss->sp.chunk == NULL) {
+		ss->sp.chunk = stack_next_chunk(NULL, STACK_CHUNK_WORDS);
+		ss->sp.top = 0;
+	}
+	return ss->sp;
+}
+
+stack_frame *
+vm_push_frame(Sly_State *ss, size_t nregs)
+{
+	if (nregs >= REG_MAX * 2) {
+		sly_raise_exception(ss, EXC_ALLOC, "Stack too big");
+	}
+	size_t words = FRAME_WORDS + nregs;
+	stack_pos sp = vm_stack_mark(ss);
+	if (sp.top + words > sp.chunk->cap) {
+		sp.chunk = stack_next_chunk(sp.chunk, words);
+		sp.top = 0;
+	}
+	stack_frame *frame = (stack_frame *)&sp.chunk->data[sp.top];
+	memset(frame, 0, words * sizeof(sly_value));
+	frame->type = tt_stack_frame;
+	frame->cont = SLY_NULL;
+	frame->R = (sly_value *)frame + FRAME_WORDS;
+	frame->nregs = nregs;
+	frame->pos = sp;
+	ss->sp.chunk = sp.chunk;
+	ss->sp.top = sp.top + words;
+	return frame;
+}
+
+static void
+vm_set_frame(Sly_State *ss, stack_frame *frame)
+{ /* Make frame the running frame, dropping everything
+   * above it from the stack.
+   */
+	ss->frame = frame;
+	if (!frame->heap) {
+		ss->sp.chunk = frame->pos.chunk;
+		ss->sp.top = frame->pos.top + FRAME_WORDS + frame->nregs;
+	} else if (frame->pos.chunk) {
+		ss->sp = frame->pos;
+	} else {
+		ss->sp = ss->base;
+	}
+}
+
+static void
+frame_set_ret(stack_frame *frame, stack_frame *caller, size_t ret_slot)
+{
+	frame->ret.type = tt_continuation;
+	frame->ret.frame = caller;
+	frame->ret.pc = caller->pc;
+	frame->ret.ret_slot = ret_slot;
+	frame->ret.nargs = 1;
+	frame->ret.has_varg = 0;
+	frame->cont = (sly_value)&frame->ret;
+}
+
+static void
+frame_inherit_cont(stack_frame *nframe, stack_frame *frame)
+{ /* nframe replaces frame (tail call) */
+	nframe->level = frame->level;
+	if (frame->cont == (sly_value)&frame->ret) {
+		nframe->ret = frame->ret;
+		nframe->cont = (sly_value)&nframe->ret;
+	} else {
+		nframe->cont = frame->cont;
+	}
+}
+
+static stack_frame *
+frame_replace(Sly_State *ss, stack_frame *nframe, stack_frame *frame)
+{ /* Slide nframe, which was pushed right above frame,
+   * down over frame so tail calls run in constant space.
+   */
+	size_t words = FRAME_WORDS + nframe->nregs;
+	if (frame->heap
+		|| frame->pos.top + words > frame->pos.chunk->cap
+		|| ss->sp.chunk != nframe->pos.chunk
+		|| ss->sp.top != nframe->pos.top + words) {
+		return nframe;
+	}
+	stack_frame *dst = frame;
+	stack_pos pos = frame->pos;
+	int own_ret = nframe->cont == (sly_value)&nframe->ret;
+	memmove(dst, nframe, words * sizeof(sly_value));
+	dst->R = (sly_value *)dst + FRAME_WORDS;
+	dst->pos = pos;
+	if (own_ret) {
+		dst->cont = (sly_value)&dst->ret;
+	}
+	ss->sp.chunk = pos.chunk;
+	ss->sp.top = pos.top + words;
+	return dst;
+}
+
+static stack_frame *
+frame_to_heap(Sly_State *ss, stack_frame *frame)
+{
+	UNUSED(ss);
+	size_t words = FRAME_WORDS + frame->nregs;
+	stack_frame *hframe = GC_MALLOC(words * sizeof(sly_value));
+	memcpy(hframe, frame, words * sizeof(sly_value));
+	hframe->R = (sly_value *)hframe + FRAME_WORDS;
+	hframe->heap = 1;
+	sly_value old_ret = (sly_value)&frame->ret;
+	if (frame->cont == old_ret) {
+		hframe->cont = (sly_value)&hframe->ret;
+	}
+	for (size_t i = 0; i < hframe->nregs; ++i) {
+		if (hframe->R[i] == old_ret) {
+			hframe->R[i] = (sly_value)&hframe->ret;
+		}
+	}
+	return hframe;
+}
+
+static void
+capture_frame(Sly_State *ss)
+{ /* Move the running frame to the heap. It is the top of
+   * the stack, so its space is released right away.
+   */
+	if (ss->frame->heap) return;
+	stack_frame *frame = frame_to_heap(ss, ss->frame);
+	ss->sp = frame->pos;
+	ss->frame = frame;
+}
+
+static void
+reify_frames(Sly_State *ss)
+{ /* Move the running frame and all the frames it can
+   * return to onto the heap. Heap frames with no stack
+   * position have been through here already.
+   */
+	stack_frame *frame = ss->frame;
+	if (!frame->heap) {
+		frame = frame_to_heap(ss, frame);
+		ss->frame = frame;
+	}
+	while (frame->pos.chunk) {
+		frame->pos.chunk = NULL;
+		frame->pos.top = 0;
+		if (!continuation_p(frame->cont)) break;
+		continuation *cc = GET_PTR(frame->cont);
+		if (!cc->frame->heap) {
+			cc->frame = frame_to_heap(ss, cc->frame);
+		}
+		frame = cc->frame;
+	}
+	ss->sp = ss->base;
+}
+
 sly_value
 form_closure(Sly_State *ss, sly_value _proto)
 {
@@ -47,11 +233,11 @@ form_closure(Sly_State *ss, sly_value _proto)
 		upinfo.v = vector_ref(proto->uplist, i);
 		sly_value uv;
 		vector *ups =  GET_PTR(ss->frame->U);
-		vector *regs = GET_PTR(ss->frame->R);
 		if (upinfo.u.isup) {
 			uv = ups->elems[upinfo.u.reg];
 		} else {
-			uv = make_open_upvalue(ss, &regs->elems[upinfo.u.reg]);
+			capture_frame(ss);
+			uv = make_open_upvalue(ss, &ss->frame->R[upinfo.u.reg]);
 		}
 		vector_set(clos->upvals, i + 1, uv);
 	}
@@ -70,23 +256,22 @@ is_tailpos(stack_frame *frame, size_t a)
 }
 #endif
 
-static void
-vector_force(Sly_State *ss, sly_value v, size_t idx, sly_value value)
-{
-	if (idx < vector_len(v)) {
-		vector_set(v, idx, value);
-	} else {
-		vector_append(ss, v, value);
-	}
-}
-
 static int
 funcall(Sly_State *ss, u32 idx, u32 nargs, int is_tailpos)
 {
 	int a = idx;
 	int b = idx + nargs + 1;
 	sly_value val = get_reg(a);
-	if (cclosure_p(val)) {
+	if (cclosure_p(val) && ((cclosure *)GET_PTR(val))->afn) {
+		/* arguments are passed in place */
+		cclosure *clos = GET_PTR(val);
+		if (clos->has_varg ? nargs < clos->nargs : nargs != clos->nargs) {
+			sly_displayln(val);
+			sly_assert(0, "Error wrong number of arguments");
+		}
+		sly_value r = clos->afn(ss, &ss->frame->R[a + 1], nargs);
+		set_reg(a, r);
+	} else if (cclosure_p(val)) {
 		cclosure *clos = GET_PTR(val);
 		sly_value args;
 		if (clos->has_varg) {
@@ -118,7 +303,8 @@ funcall(Sly_State *ss, u32 idx, u32 nargs, int is_tailpos)
 	} else if (closure_p(val)) {
 		closure *clos = GET_PTR(val);
 		prototype *proto = GET_PTR(clos->proto);
-		stack_frame *nframe = make_stack(ss, proto->nregs);
+		stack_frame *frame = ss->frame;
+		stack_frame *nframe = vm_push_frame(ss, proto->nregs * 2);
 		nframe->clos = val;
 		nframe->U = clos->upvals;
 		if (proto->has_varg) {
@@ -129,7 +315,7 @@ funcall(Sly_State *ss, u32 idx, u32 nargs, int is_tailpos)
 			for (size_t i = b - 1; nvargs--; --i) {
 				vargs = cons(ss, get_reg(i), vargs);
 			}
-			vector_set(nframe->R, proto->nargs, vargs);
+			nframe->R[proto->nargs] = vargs;
 		} else if (nargs != proto->nargs) {
 			printf("nargs :: %u\n", nargs);
 			printf("expected :: %zu\n", proto->nargs);
@@ -140,45 +326,56 @@ funcall(Sly_State *ss, u32 idx, u32 nargs, int is_tailpos)
 			sly_assert(0, "Error wrong number of arguments (188)");
 		}
 		for (size_t i = 0; i < proto->nargs; ++i) {
-			vector_set(nframe->R, i, get_reg(a + 1 + i));
+			nframe->R[i] = get_reg(a + 1 + i);
 		}
 		nframe->K = proto->K;
 		nframe->code = proto->code;
 		nframe->pc = proto->entry;
-		if (!TOP_LEVEL_P(ss->frame) && is_tailpos) {
-			nframe->level = ss->frame->level;
-			nframe->cont = ss->frame->cont;
-			close_upvalues(ss, ss->frame);
+		if (!TOP_LEVEL_P(frame) && is_tailpos) {
+			frame_inherit_cont(nframe, frame);
+			close_upvalues(ss, frame);
+			nframe = frame_replace(ss, nframe, frame);
 		} else {
-			nframe->cont = make_continuation(ss, ss->frame, ss->frame->pc, a);
-			nframe->level = ss->frame->level + 1;
+			frame_set_ret(nframe, frame, a);
+			nframe->level = frame->level + 1;
 		}
 		ss->frame = nframe;
 	} else if (continuation_p(val)) {
 		continuation *cc = GET_PTR(val);
+		if (ss->frame->cont != val) {
+			/* Jumping to a captured continuation. The current
+			 * frames may be resumed from it later on.
+			 */
+			reify_frames(ss);
+		}
+		stack_frame *target = cc->frame;
 		sly_value arg;
 		int i;
 		for (i = 0; i < cc->nargs; ++i) {
 			arg = get_reg(a + 1 + i);
-			vector_force(ss, cc->frame->R, cc->ret_slot + i, arg);
+			sly_assert((size_t)(cc->ret_slot + i) < target->nregs,
+					   "Error too many return values");
+			target->R[cc->ret_slot + i] = arg;
 		}
 		if (cc->has_varg) {
 			sly_value list = SLY_NULL;
 			for (int j = nargs - 1; i <= j; --j) {
 				list = cons(ss, get_reg(a + 1 + j), list);
 			}
-			vector_force(ss, cc->frame->R, i, list);
+			sly_assert((size_t)i < target->nregs,
+					   "Error too many return values");
+			target->R[i] = list;
 		}
 		if (ss->frame->cont == val) {
 			close_upvalues(ss, ss->frame);
 		} else if (!TOP_LEVEL_P(ss->frame) && is_tailpos) {
-			cc->frame->cont = ss->frame->cont;
+			target->cont = ss->frame->cont;
 		} else {
-			cc->frame->cont = make_continuation(ss, ss->frame, ss->frame->pc, a);
+			target->cont = make_continuation(ss, ss->frame, ss->frame->pc, a);
 		}
 		close_upvalues(ss, ss->frame);
-		ss->frame = cc->frame;
-		ss->frame->pc = cc->pc;
+		vm_set_frame(ss, target);
+		target->pc = cc->pc;
 	} else {
 		printf("pc :: %zu\n", ss->frame->pc);
 		sly_displayln(val);
@@ -192,15 +389,15 @@ funcall(Sly_State *ss, u32 idx, u32 nargs, int is_tailpos)
 static void
 close_upvalues(Sly_State *ss, stack_frame *frame)
 {
-	if (null_p(frame->clos)) return;
-	vector *vec = GET_PTR(frame->R);
+	/* Only heap frames can have open upvalues. */
+	if (!frame->heap || null_p(frame->clos)) return;
 	upvalue *uv = NULL;
 	upvalue *parent = NULL;
 	closure *clos = GET_PTR(frame->clos);
 	prototype *proto = GET_PTR(clos->proto);
 	size_t nvars = proto->nvars + proto->has_varg;
 	for (size_t i = 0; i < nvars; ++i) {
-		uv = find_open_upvalue(ss, &vec->elems[i], &parent);
+		uv = find_open_upvalue(ss, &frame->R[i], &parent);
 		if (uv) {
 			if (parent == NULL) {
 				ss->open_upvals = uv->next;
@@ -212,32 +409,202 @@ close_upvalues(Sly_State *ss, stack_frame *frame)
 	}
 }
 
+static inline sly_value
+fixnum_mul(Sly_State *ss, i64 i, i64 j)
+{ // fixnums are 61 bits wide so the product may not fit in 64
+	i64 r;
+	if (__builtin_mul_overflow(i, j, &r)) {
+		sly_raise_exception(ss, EXC_GENERIC, "Error overflow");
+	}
+	return make_int(ss, r);
+}
+
+static int
+primop_slow(Sly_State *ss, enum vm_primop prim, u8 a, sly_value x, sly_value y)
+{ /* Slow path of the operator opcodes. If the operator was
+   * redefined, call it like OP_CALL would and return 1.
+   */
+	if (get_reg(a) != ss->cc->primops[prim]) {
+		set_reg(a + 1, x);
+		set_reg(a + 2, y);
+		funcall(ss, a, 2, 0);
+		return 1;
+	}
+	sly_value r = SLY_VOID;
+	switch (prim) {
+	case vmop_add: r = sly_add(ss, x, y); break;
+	case vmop_sub: r = sly_sub(ss, x, y); break;
+	case vmop_mul: r = sly_mul(ss, x, y); break;
+	case vmop_numeq: r = ctobool(sly_num_eq(x, y)); break;
+	case vmop_lt: r = ctobool(sly_num_lt(x, y)); break;
+	case vmop_gt: r = ctobool(sly_num_gt(x, y)); break;
+	case vmop_leq: r = ctobool(sly_num_lt(x, y) || sly_num_eq(x, y)); break;
+	case vmop_geq: r = ctobool(sly_num_gt(x, y) || sly_num_eq(x, y)); break;
+	case VMOP_COUNT: sly_assert(0, "Error invalid primop"); break;
+	}
+	set_reg(a, r);
+	return 0;
+}
+
+static dinstr *
+decode_code(Sly_State *ss, sly_value code, const void *const *labels)
+{
+	size_t len = vector_len(code);
+	vector *vec = GET_PTR(code);
+	dinstr *dcode = GC_MALLOC(sizeof(*dcode) * len);
+	for (size_t i = 0; i < len; ++i) {
+		dcode[i].instr.v = vec->elems[i];
+		enum opcode op = GET_OP(dcode[i].instr);
+		if (op >= OP_COUNT) {
+			sly_raise_exception(ss, EXC_GENERIC, "Error invalid opcode");
+		}
+		dcode[i].label = labels ? labels[op] : NULL;
+	}
+	return dcode;
+}
+
+static void
+frame_load_code(Sly_State *ss, stack_frame *frame, const void *const *labels)
+{ /* Frames running a closure share the decoded code cached
+   * in its prototype. Other frames (eval stacks) decode their
+   * own code vector.
+   */
+	if (frame->dcode) return;
+	if (closure_p(frame->clos)) {
+		prototype *proto = GET_PTR(get_prototype(frame->clos));
+		if (proto->code == frame->code) {
+			size_t len = vector_len(proto->code);
+			if (proto->dcode == NULL || proto->dlen != len) {
+				proto->dcode = decode_code(ss, proto->code, labels);
+				proto->dlen = len;
+			}
+			frame->dcode = proto->dcode;
+			return;
+		}
+	}
+	frame->dcode = decode_code(ss, frame->code, labels);
+}
+
+/* Dispatch mode is selected at build time. With GCC or clang the
+ * VM uses direct threading: every decoded instruction carries the
+ * address of its handler and each handler jumps straight to the next
+ * one. Define SLY_VM_SWITCH_DISPATCH to use the portable switch loop.
+ */
+#if defined(__GNUC__) && !defined(SLY_VM_SWITCH_DISPATCH)
+#define SLY_VM_THREADED 1
+#endif
+
+#ifdef SLY_VM_THREADED
+#define VM_FETCH()									\
+	do {											\
+		dp = &ss->frame->dcode[ss->frame->pc++];	\
+		instr = dp->instr;							\
+	} while (0)
+#define VM_SWITCH(op)  goto *dp->label;
+#define VM_CASE(op)    L_##op
+#define VM_NEXT        do { VM_FETCH(); goto *dp->label; } while (0)
+#define VM_LABELS      labels
+#else
+#define VM_FETCH()     (instr = ss->frame->dcode[ss->frame->pc++].instr)
+#define VM_SWITCH(op)  switch (op)
+#define VM_CASE(op)    case op
+#define VM_NEXT        break
+#define VM_LABELS      NULL
+#endif
+#define VM_LOAD_CODE() frame_load_code(ss, ss->frame, VM_LABELS)
+
+/* Operator opcodes: fast path for two fixnums while R[A]
+ * still holds the builtin, primop_slow otherwise.
+ */
+#define VM_PRIMOP(prim, yexpr, fast)							\
+	do {														\
+		u8 a = GET_A(instr);									\
+		sly_value x = get_reg(GET_B(instr));					\
+		sly_value y = (yexpr);									\
+		if (fixnum_p(x) && fixnum_p(y)							\
+			&& get_reg(a) == ss->cc->primops[prim]) {			\
+			i64 i = fixnum_get(x);								\
+			i64 j = fixnum_get(y);								\
+			set_reg(a, (fast));									\
+		} else if (primop_slow(ss, prim, a, x, y)) {			\
+			VM_LOAD_CODE();										\
+		}														\
+	} while (0)
+#define REG_C    get_reg(GET_C(instr))
+#define IMM_C    make_int(ss, (i8)GET_C(instr))
+
+#ifdef SLY_VM_THREADED
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
 sly_value
 vm_run(Sly_State *ss)
 {
 	sly_value ret_val = SLY_VOID;
 	union instr instr;
-	int is_tailpos = 0;
+#ifdef SLY_VM_THREADED
+	static const void *const labels[OP_COUNT] = {
+		[OP_NOP]          = &&L_OP_NOP,
+		[OP_MOVE]         = &&L_OP_MOVE,
+		[OP_LOADI]        = &&L_OP_LOADI,
+		[OP_LOADK]        = &&L_OP_LOADK,
+		[OP_LOADFALSE]    = &&L_OP_LOADFALSE,
+		[OP_LOADTRUE]     = &&L_OP_LOADTRUE,
+		[OP_LOADNULL]     = &&L_OP_LOADNULL,
+		[OP_LOADVOID]     = &&L_OP_LOADVOID,
+		[OP_LOADCONT]     = &&L_OP_LOADCONT,
+		[OP_GETUPVAL]     = &&L_OP_GETUPVAL,
+		[OP_SETUPVAL]     = &&L_OP_SETUPVAL,
+		[OP_GETUPDICT]    = &&L_OP_GETUPDICT,
+		[OP_SETUPDICT]    = &&L_OP_SETUPDICT,
+		[OP_DICTREF]      = &&L_OP_DICTREF,
+		[OP_DICTSET]      = &&L_OP_DICTSET,
+		[OP_GETGLOBAL]    = &&L_OP_GETGLOBAL,
+		[OP_SETGLOBAL]    = &&L_OP_SETGLOBAL,
+		[OP_JMP]          = &&L_OP_JMP,
+		[OP_FJMP]         = &&L_OP_FJMP,
+		[OP_CALL]         = &&L_OP_CALL,
+		[OP_TAILCALL]     = &&L_OP_TAILCALL,
+		[OP_CALLWCC]      = &&L_OP_CALLWCC,
+		[OP_CALLWVALUES]  = &&L_OP_CALLWVALUES,
+		[OP_CALLWVALUES0] = &&L_OP_CALLWVALUES0,
+		[OP_APPLY]        = &&L_OP_APPLY,
+		[OP_EXIT]         = &&L_OP_EXIT,
+		[OP_CLOSURE]      = &&L_OP_CLOSURE,
+		[OP_ADD]          = &&L_OP_ADD,
+		[OP_SUB]          = &&L_OP_SUB,
+		[OP_MUL]          = &&L_OP_MUL,
+		[OP_NUMEQ]        = &&L_OP_NUMEQ,
+		[OP_LT]           = &&L_OP_LT,
+		[OP_GT]           = &&L_OP_GT,
+		[OP_LEQ]          = &&L_OP_LEQ,
+		[OP_GEQ]          = &&L_OP_GEQ,
+		[OP_ADDI]         = &&L_OP_ADDI,
+		[OP_SUBI]         = &&L_OP_SUBI,
+	};
+	dinstr *dp;
+#endif
 	if (vector_len(ss->frame->code) == 0) {
 		return ret_val;
 	}
-    for (;;) {
-		instr.v = next_instr();
-		enum opcode i = GET_OP(instr);
-		switch (i) {
-		case OP_NOP: break;
-		case OP_MOVE: {
+	VM_LOAD_CODE();
+	for (;;) {
+		VM_FETCH();
+		VM_SWITCH(GET_OP(instr)) {
+		VM_CASE(OP_NOP): VM_NEXT;
+		VM_CASE(OP_MOVE): {
 			u8 a, b;
 			a = GET_A(instr);
 			b = GET_B(instr);
 			set_reg(a, get_reg(b));
-		} break;
-		case OP_LOADI: {
+		} VM_NEXT;
+		VM_CASE(OP_LOADI): {
 			u8 a = GET_A(instr);
 			i64 b = GET_sBx(instr);
 			set_reg(a, make_int(ss, b));
-		} break;
-		case OP_LOADK: {
+		} VM_NEXT;
+		VM_CASE(OP_LOADK): {
 			u8 a = GET_A(instr);
 			size_t b = GET_Bx(instr);
 			sly_value val = get_const(b);
@@ -245,93 +612,107 @@ vm_run(Sly_State *ss)
 				val = copy_list(ss, val);
 			}
 			set_reg(a, val);
-		} break;
-		case OP_LOADFALSE: {
+		} VM_NEXT;
+		VM_CASE(OP_LOADFALSE): {
 			u8 a = GET_A(instr);
 			set_reg(a, SLY_FALSE);
-		} break;
-		case OP_LOADTRUE: {
+		} VM_NEXT;
+		VM_CASE(OP_LOADTRUE): {
 			u8 a = GET_A(instr);
 			set_reg(a, SLY_TRUE);
-		} break;
-		case OP_LOADNULL: {
+		} VM_NEXT;
+		VM_CASE(OP_LOADNULL): {
 			u8 a = GET_A(instr);
 			set_reg(a, SLY_NULL);
-		} break;
-		case OP_LOADVOID: {
+		} VM_NEXT;
+		VM_CASE(OP_LOADVOID): {
 			u8 a = GET_A(instr);
 			set_reg(a, SLY_VOID);
-		} break;
-		case OP_LOADCONT: {
+		} VM_NEXT;
+		VM_CASE(OP_LOADCONT): {
 			u8 a = GET_A(instr);
 			set_reg(a, ss->frame->cont);
-		} break;
-		case OP_GETUPVAL: {
+		} VM_NEXT;
+		VM_CASE(OP_GETUPVAL): {
 			u8 a = GET_A(instr);
 			u8 b = GET_B(instr);
 			set_reg(a, get_upval(b));
-		} break;
-		case OP_SETUPVAL: {
+		} VM_NEXT;
+		VM_CASE(OP_SETUPVAL): {
 			u8 a = GET_A(instr);
 			u8 b = GET_B(instr);
 			set_upval(a, get_reg(b));
-		} break;
-		case OP_GETUPDICT: {
+		} VM_NEXT;
+		VM_CASE(OP_GETUPDICT): {
 			u8 a = GET_A(instr);
 			u8 b = GET_B(instr);
 			u8 c = GET_C(instr);
 			sly_value dict = get_upval(b);
 			set_reg(a, dictionary_ref(dict, get_reg(c), SLY_VOID));
-		} break;
-		case OP_SETUPDICT: {
+		} VM_NEXT;
+		VM_CASE(OP_SETUPDICT): {
 			u8 a = GET_A(instr);
 			u8 b = GET_B(instr);
 			u8 c = GET_C(instr);
 			sly_value dict = get_upval(a);
 			dictionary_set(ss, dict, get_reg(b), get_reg(c));
-		} break;
-		case OP_DICTREF: {
+		} VM_NEXT;
+		VM_CASE(OP_DICTREF): {
 			u8 a = GET_A(instr);
 			u8 b = GET_B(instr);
 			u8 c = GET_C(instr);
 			sly_value dict = get_reg(b);
 			set_reg(a, dictionary_ref(dict, get_reg(c), SLY_VOID));
-		} break;
-		case OP_DICTSET: {
+		} VM_NEXT;
+		VM_CASE(OP_DICTSET): {
 			u8 a = GET_A(instr);
 			u8 b = GET_B(instr);
 			u8 c = GET_C(instr);
 			sly_value dict = get_reg(a);
 			dictionary_set(ss, dict, get_reg(b), get_reg(c));
-		} break;
-		case OP_JMP: {
+		} VM_NEXT;
+		VM_CASE(OP_GETGLOBAL): {
+			u8 a = GET_A(instr);
+			size_t b = GET_Bx(instr);
+			pair *cell = GET_PTR(get_const(b));
+			set_reg(a, cell->cdr);
+		} VM_NEXT;
+		VM_CASE(OP_SETGLOBAL): {
+			u8 a = GET_A(instr);
+			size_t b = GET_Bx(instr);
+			pair *cell = GET_PTR(get_const(b));
+			cell->cdr = get_reg(a);
+		} VM_NEXT;
+		VM_CASE(OP_JMP): {
 			u64 a = GET_Ax(instr);
 			ss->frame->pc = a;
-		} break;
-		case OP_FJMP: {
+		} VM_NEXT;
+		VM_CASE(OP_FJMP): {
 			u8 a = GET_A(instr);
 			u64 b = GET_Bx(instr);
 			if (get_reg(a) == SLY_FALSE) {
 				ss->frame->pc = b;
 			}
-		} break;
-		case OP_CALL: {
+		} VM_NEXT;
+		VM_CASE(OP_CALL): {
 			u8 a = GET_A(instr);
 			u8 b = GET_B(instr);
 			if (null_p(get_reg(a))) {
 				return get_reg(a+1);
 			}
 			funcall(ss, a, b - a - 1, 0);
-		} break;
-		case OP_TAILCALL: {
+			VM_LOAD_CODE();
+		} VM_NEXT;
+		VM_CASE(OP_TAILCALL): {
 			u8 a = GET_A(instr);
 			u8 b = GET_B(instr);
 			if (null_p(get_reg(a))) {
 				return get_reg(a+1);
 			}
 			funcall(ss, a, b - a - 1, 1);
-		} break;
-		case OP_CALLWCC: {
+			VM_LOAD_CODE();
+		} VM_NEXT;
+		VM_CASE(OP_CALLWCC): {
 			u8 a = GET_A(instr);
 			u8 b = GET_B(instr);
 			u8 c = GET_C(instr);
@@ -340,34 +721,36 @@ vm_run(Sly_State *ss)
 				closure *clos = GET_PTR(proc);
 				prototype *proto = GET_PTR(clos->proto);
 				sly_assert(proto->nargs = 1, "Error wrong number of argument");
-				stack_frame *nframe = make_stack(ss, proto->nregs);
+				reify_frames(ss);
+				stack_frame *frame = ss->frame;
+				stack_frame *nframe = vm_push_frame(ss, proto->nregs * 2);
 				nframe->clos = proc;
 				nframe->U = clos->upvals;
 				nframe->K = proto->K;
 				nframe->code = proto->code;
 				nframe->pc = proto->entry;
 				sly_value cc;
-				if (!TOP_LEVEL_P(ss->frame) && c) {
-					nframe->level = ss->frame->level;
-					cc = ss->frame->cont;
-					close_upvalues(ss, ss->frame);
+				if (!TOP_LEVEL_P(frame) && c) {
+					nframe->level = frame->level;
+					cc = frame->cont;
+					close_upvalues(ss, frame);
 				} else {
-					cc = make_continuation(ss, ss->frame, ss->frame->pc, a);
-					nframe->level = ss->frame->level + 1;
+					cc = make_continuation(ss, frame, frame->pc, a);
+					nframe->level = frame->level + 1;
 				}
 				nframe->cont = cc;
-				vector_set(nframe->R, 0, cc);
+				nframe->R[0] = cc;
 				ss->frame = nframe;
+				VM_LOAD_CODE();
 			} else {
 				sly_assert(0, "CALL/CC Not implemented for procedure type");
 			}
-		} break;
-		case OP_CALLWVALUES0:
-			is_tailpos = 1;
-			__attribute__((fallthrough));
-		case OP_CALLWVALUES: {
+		} VM_NEXT;
+		VM_CASE(OP_CALLWVALUES0):
+		VM_CASE(OP_CALLWVALUES): {
 			/* TODO: appears to be working. Needs more testing.
 			 */
+			int is_tailpos = GET_OP(instr) == OP_CALLWVALUES0;
 			u8 a = GET_A(instr);
 			u8 b = GET_B(instr);
 			u8 c = GET_C(instr);
@@ -376,71 +759,72 @@ vm_run(Sly_State *ss)
 			/* TODO: Make this work with builtins and continuations
 			 */
 			sly_assert(closure_p(receiver), "Type Error expected <closure>");
+			stack_frame *frame = ss->frame;
 			closure *clos = GET_PTR(receiver);
 			prototype *rproto = GET_PTR(clos->proto);
-			stack_frame *rframe = make_stack(ss, rproto->nregs);
+			stack_frame *rframe = vm_push_frame(ss, rproto->nregs * 2);
 			rframe->clos = receiver;
 			rframe->U = clos->upvals;
 			rframe->K = rproto->K;
 			rframe->code = rproto->code;
 			rframe->pc = rproto->entry;
-			if (!TOP_LEVEL_P(ss->frame) && is_tailpos) {
-				rframe->level = ss->frame->level;
-				rframe->cont = ss->frame->cont;
-				close_upvalues(ss, ss->frame);
+			if (!TOP_LEVEL_P(frame) && is_tailpos) {
+				frame_inherit_cont(rframe, frame);
+				close_upvalues(ss, frame);
 			} else {
-				rframe->cont = make_continuation(ss, ss->frame, ss->frame->pc, a);
-				rframe->level = ss->frame->level + 1;
+				frame_set_ret(rframe, frame, a);
+				rframe->level = frame->level + 1;
 			}
-			is_tailpos = 0;
 			clos = GET_PTR(producer);
 			prototype *pproto = GET_PTR(clos->proto);
-			stack_frame *pframe = make_stack(ss, pproto->nregs);
+			stack_frame *pframe = vm_push_frame(ss, pproto->nregs * 2);
 			pframe->clos = producer;
 			pframe->U = clos->upvals;
 			pframe->K = pproto->K;
 			pframe->code = pproto->code;
 			pframe->pc = pproto->entry;
 			pframe->level = rframe->level + 1;
-			pframe->cont = make_continuation(ss, rframe, rframe->pc, 0);
-			continuation *cc = GET_PTR(pframe->cont);
-			cc->nargs = rproto->nargs;
-			cc->has_varg = rproto->has_varg;
+			frame_set_ret(pframe, rframe, 0);
+			pframe->ret.nargs = rproto->nargs;
+			pframe->ret.has_varg = rproto->has_varg;
 			ss->frame = pframe;
-		} break;
-		case OP_APPLY: {
+			VM_LOAD_CODE();
+		} VM_NEXT;
+		VM_CASE(OP_APPLY): {
 			u8 a = GET_A(instr);
 			u8 b = GET_B(instr);
 			u8 c = GET_C(instr);
-			sly_value args = make_vector(ss, 0, 8);
-			vector_append(ss, args, SLY_NULL);
-			int nargs = 0;
-			for (int i = a; i < b - 1; ++i) {
-				vector_append(ss, args, vector_ref(ss->frame->R, i));
+			stack_frame *frame = ss->frame;
+			int nargs = b - 1 - a;
+			sly_value list = get_reg(b - 1);
+			sly_assert(pair_p(list) || null_p(list), "Error Expected list");
+			for (sly_value l = list; pair_p(l); l = cdr(l)) {
 				nargs++;
 			}
-			sly_value list = vector_ref(ss->frame->R, b - 1);
-			sly_assert(pair_p(list) || null_p(list), "Error Expected list");
+			stack_frame *nframe = make_eval_stack(ss, nargs + 1);
+			int n = 1;
+			for (int i = a; i < b - 1; ++i) {
+				nframe->R[n++] = get_reg(i);
+			}
 			while (!null_p(list)) {
-				vector_append(ss, args, car(list));
+				nframe->R[n++] = car(list);
 				list = cdr(list);
-				nargs++;
 			}
-			stack_frame *nframe = make_eval_stack(ss, args);
 			vector_append(ss, nframe->code, iA(OP_LOADCONT, 0, -1));
 			vector_append(ss, nframe->code, iAB(OP_TAILCALL, 1, nargs + 1, -1));
 			vector_append(ss, nframe->code, iAB(OP_TAILCALL, 0, 1, -1));
-			if (!TOP_LEVEL_P(ss->frame) && c) {
-				nframe->level = ss->frame->level;
-				nframe->cont = ss->frame->cont;
-				close_upvalues(ss, ss->frame);
+			if (!TOP_LEVEL_P(frame) && c) {
+				frame_inherit_cont(nframe, frame);
+				close_upvalues(ss, frame);
+				nframe = frame_replace(ss, nframe, frame);
 			} else {
-				nframe->cont = make_continuation(ss, ss->frame, ss->frame->pc, a);
-				nframe->level = ss->frame->level + 1;
+				frame_set_ret(nframe, frame, a);
+				nframe->level = frame->level + 1;
 			}
 			ss->frame = nframe;
-		} break;
-		case OP_EXIT: {
+			VM_LOAD_CODE();
+		} VM_NEXT;
+		VM_CASE(OP_EXIT): {
 			u8 a = GET_A(instr);
 			//u8 b = GET_B(instr);
 			if (TOP_LEVEL_P(ss->frame)) {
@@ -448,19 +832,55 @@ vm_run(Sly_State *ss)
 			} else {
 				sly_assert(0, "Exit from non toplevel");
 			}
-		} break;
-		case OP_CLOSURE: {
+		} VM_NEXT;
+		VM_CASE(OP_CLOSURE): {
 			u8 a = GET_A(instr);
 			size_t b = GET_Bx(instr);
 			sly_value _proto = get_const(b);
 			sly_value clos = form_closure(ss, _proto);
 			set_reg(a, clos);
-		} break;
+		} VM_NEXT;
+		VM_CASE(OP_ADD): {
+			VM_PRIMOP(vmop_add, REG_C, make_int(ss, i + j));
+		} VM_NEXT;
+		VM_CASE(OP_SUB): {
+			VM_PRIMOP(vmop_sub, REG_C, make_int(ss, i - j));
+		} VM_NEXT;
+		VM_CASE(OP_MUL): {
+			VM_PRIMOP(vmop_mul, REG_C, fixnum_mul(ss, i, j));
+		} VM_NEXT;
+		VM_CASE(OP_NUMEQ): {
+			VM_PRIMOP(vmop_numeq, REG_C, ctobool(i == j));
+		} VM_NEXT;
+		VM_CASE(OP_LT): {
+			VM_PRIMOP(vmop_lt, REG_C, ctobool(i < j));
+		} VM_NEXT;
+		VM_CASE(OP_GT): {
+			VM_PRIMOP(vmop_gt, REG_C, ctobool(i > j));
+		} VM_NEXT;
+		VM_CASE(OP_LEQ): {
+			VM_PRIMOP(vmop_leq, REG_C, ctobool(i <= j));
+		} VM_NEXT;
+		VM_CASE(OP_GEQ): {
+			VM_PRIMOP(vmop_geq, REG_C, ctobool(i >= j));
+		} VM_NEXT;
+		VM_CASE(OP_ADDI): {
+			VM_PRIMOP(vmop_add, IMM_C, make_int(ss, i + j));
+		} VM_NEXT;
+		VM_CASE(OP_SUBI): {
+			VM_PRIMOP(vmop_sub, IMM_C, make_int(ss, i - j));
+		} VM_NEXT;
+#ifndef SLY_VM_THREADED
 		case OP_COUNT:
 		default: {
 			sly_assert(0, "Error invalid opcode");
-		} break;
+		} VM_NEXT;
+#endif
 		}
 	}
 	return ret_val;
 }
+
+#ifdef SLY_VM_THREADED
+#pragma GCC diagnostic pop
+#endif
@@ -2,6 +2,8 @@
 #define SLY_VM_H_
 
 void vm_bt(stack_frame *frame);
+stack_pos vm_stack_mark(Sly_State *ss);
+stack_frame *vm_push_frame(Sly_State *ss, size_t nregs);
 sly_value form_closure(Sly_State *ss, sly_value _proto);
 sly_value vm_run(Sly_State *ss);
 
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <string.h>
 #include "sly_types.h"
 #include "opcodes.h"
@@ -6,10 +7,11 @@
 #include "syntax_expander.h"
 #include "eval.h"
 #include "sly_vm.h"
+#include "image.h"
 
 #define scope() gensym_from_cstr(ss, "scope")
 #define add_binding(id, binding)						\
-		dictionary_set(ss, all_bindings, id, binding);
+		module_add_binding(ss, id, binding);
 #define core_symbol(cf_i)						\
 	vector_ref(core_forms, cf_i)
 
@@ -149,6 +151,31 @@ static sly_value core_scope = SLY_NULL;
 static sly_value variable = SLY_NULL;
 static sly_value undefined = SLY_NULL;
 static sly_value all_bindings = SLY_NULL;
+static sly_value image_specials = SLY_NULL;
+static sly_value module_keys = SLY_NULL;  // <dictionary> path -> key of required modules
+
+/* Expander state produced while compiling a required module.
+ * Replaying it is all that is needed to load the module from
+ * its image instead of expanding it again.
+ */
+struct module_record {
+	sly_value requires;  // <list> modules required, most recent first
+	sly_value includes;  // <vector> (path . source) of included files
+	sly_value bindings;  // <vector> (identifier . binding)
+	sly_value env;       // <vector> (binding . value)
+};
+
+static struct module_record *recording = NULL;
+
+enum module_image { /* layout of an image root */
+	mi_requires = 0,
+	mi_bindings,
+	mi_env,
+	mi_defs,
+	mi_provides,
+	mi_proto,
+	MI_COUNT,
+};
 
 typedef sly_value (*set_op)(Sly_State *, sly_value, sly_value);
 
@@ -188,18 +215,15 @@ static int
 set_contains(Sly_State *ss, sly_value set, sly_value value)
 { // check if set contains a value
 	UNUSED(ss);
-	return !slot_is_free(dictionary_entry_ref(set, value));
+	return dictionary_has(set, value);
 }
 
 static int
 is_subset(Sly_State *ss, sly_value set1, sly_value set2)
 { // check if set2 is a subset of set1
-	vector *vec = GET_PTR(set2);
-	sly_value entry;
-	for (size_t i = 0; i < vec->cap; ++i) {
-		entry = vec->elems[i];
-		if (!slot_is_free(entry)
-			&& !set_contains(ss, set1, car(entry))) {
+	sly_value value;
+	for (size_t i = 0; dictionary_next(set2, &i, &value, NULL);) {
+		if (!set_contains(ss, set1, value)) {
 			/* if set2 has a value not found in slot1 */
 			return 0;
 		}
@@ -226,12 +250,9 @@ static sly_value
 set_join(Sly_State *ss, sly_value set1, sly_value set2)
 {
 	sly_assert(dictionary_p(set2), "Type error expected <dictionary>");
-	vector *s = GET_PTR(set2);
-	for (size_t i = 0; i < s->cap; ++i) {
-		sly_value entry = s->elems[i];
-		if (!slot_is_free(entry)) {
-			set_add(ss, set1, car(entry));
-		}
+	sly_value value;
+	for (size_t i = 0; dictionary_next(set2, &i, &value, NULL);) {
+		set_add(ss, set1, value);
 	}
 	return set1;
 }
@@ -315,16 +336,11 @@ get_max_id(sly_value ids)
 static sly_value
 find_all_matching_bindings(Sly_State *ss, sly_value id)
 {
-	vector *vec = GET_PTR(all_bindings);
-	sly_value entry, c_id, matches = SLY_NULL;
-	for (size_t i = 0; i < vec->cap; ++i) {
-		entry = vec->elems[i];
-		if (!slot_is_free(entry)) {
-			c_id = car(entry);
-			if (sly_equal(syntax_to_datum(id), syntax_to_datum(c_id))
-				&& is_subset(ss, syntax_scopes(id), syntax_scopes(c_id))) {
-				matches = cons(ss, c_id, matches);
-			}
+	sly_value c_id, matches = SLY_NULL;
+	for (size_t i = 0; dictionary_next(all_bindings, &i, &c_id, NULL);) {
+		if (sly_equal(syntax_to_datum(id), syntax_to_datum(c_id))
+			&& is_subset(ss, syntax_scopes(id), syntax_scopes(c_id))) {
+			matches = cons(ss, c_id, matches);
 		}
 	}
 	return matches;
@@ -361,21 +377,29 @@ introduce(Sly_State *ss, sly_value s)
 	return add_scope(ss, s, core_scope);
 }
 
+static void
+module_add_binding(Sly_State *ss, sly_value id, sly_value binding)
+{
+	dictionary_set(ss, all_bindings, id, binding);
+	if (recording) {
+		vector_append(ss, recording->bindings, cons(ss, id, binding));
+	}
+}
+
 static sly_value
 env_extend(Sly_State *ss, sly_value env, sly_value key, sly_value value)
 {
 	dictionary_set(ss, env, key, value);
+	if (recording) {
+		vector_append(ss, recording->env, cons(ss, key, value));
+	}
 	return env;
 }
 
 static sly_value
 env_lookup(sly_value env, sly_value key)
 {
-	sly_value entry = dictionary_entry_ref(env, key);
-	if (slot_is_free(entry)) {
-		return SLY_VOID;
-	}
-	return cdr(entry);
+	return dictionary_ref(env, key, SLY_VOID);
 }
 
 static sly_value
@@ -526,50 +550,265 @@ expand_core_form(Sly_State *ss, sly_value s, sly_value env)
 static sly_value
 get_provides(Sly_State *ss, sly_value file_path)
 {
-	sly_value key = cstr_to_symbol("*REQUIRED*");
-	sly_value required = dictionary_entry_ref(ss->cc->globals, key);
-	required = cdr(required);
-	sly_value provides = dictionary_entry_ref(required, file_path);
-	if (slot_is_free(provides)) {
-		return SLY_VOID;
-	} else {
-		return cdr(provides);
-	}
+	sly_value key = static_symbol(ss, ssym_required);
+	sly_value required = dictionary_ref(ss->cc->globals, key, SLY_VOID);
+	return dictionary_ref(required, file_path, SLY_VOID);
 }
 
 static void
 set_provides(Sly_State *ss, sly_value file_path, sly_value provides)
 {
-	sly_value key = cstr_to_symbol("*REQUIRED*");
-	sly_value required = dictionary_entry_ref(ss->cc->globals, key);
-	required = cdr(required);
+	sly_value key = static_symbol(ss, ssym_required);
+	sly_value required = dictionary_ref(ss->cc->globals, key, SLY_VOID);
 	dictionary_set(ss, required, file_path, provides);
 }
 
+static sly_value
+get_image_specials(Sly_State *ss)
+{ /* objects of the expander that images refer to by index */
+	if (null_p(image_specials)) {
+		image_specials = make_vector(ss, 0, 4);
+		vector_append(ss, image_specials, core_scope);
+		vector_append(ss, image_specials, variable);
+		vector_append(ss, image_specials, undefined);
+	}
+	return image_specials;
+}
+
+static u64
+module_key(image_source *srcs, size_t nsrcs, sly_value requires)
+{ /* A module's key changes with its own sources and with the
+   * keys of the modules it requires. An image is only used if
+   * the modules it was compiled against still have the same key.
+   */
+	u64 key = 0xcbf29ce484222325;
+	for (size_t i = 0; i < nsrcs; ++i) {
+		key = (key ^ srcs[i].hash) * 0x100000001b3;
+	}
+	while (!null_p(requires)) {
+		key = (key ^ (u64)get_int(cdr(car(requires)))) * 0x100000001b3;
+		requires = cdr(requires);
+	}
+	return key;
+}
+
+static sly_value
+module_closure(Sly_State *ss, sly_value proto)
+{
+	sly_value cval = make_closure(ss, proto);
+	closure *clos = GET_PTR(cval);
+	vector_set(clos->upvals, 0,
+			   make_closed_upvalue(ss, ss->cc->globals));
+	return cval;
+}
+
+static void require_module(Sly_State *ss, sly_value file_path, sly_value env);
+
+static int
+image_valid_p(sly_value image)
+{
+	if (!vector_p(image) || vector_len(image) != MI_COUNT) {
+		return 0;
+	}
+	sly_value requires = vector_ref(image, mi_requires);
+	while (pair_p(requires)) {
+		sly_value req = car(requires);
+		if (!pair_p(req) || !string_p(car(req)) || !int_p(cdr(req))) return 0;
+		requires = cdr(requires);
+	}
+	if (!null_p(requires)) return 0;
+	for (int i = mi_bindings; i <= mi_defs; ++i) {
+		sly_value vec = vector_ref(image, i);
+		if (!vector_p(vec)) return 0;
+		for (size_t j = 0; j < vector_len(vec); ++j) {
+			sly_value p = vector_ref(vec, j);
+			if (!pair_p(p) || null_p(car(p)) || void_p(car(p))) return 0;
+			if (i == mi_defs && (!pair_p(cdr(p)) || !int_p(car(cdr(p))))) return 0;
+		}
+	}
+	return prototype_p(vector_ref(image, mi_proto));
+}
+
+static int
+load_requires(Sly_State *ss, sly_value image, sly_value env)
+{ /* Require the modules an image depends on and check
+   * they are the same as when the image was made.
+   */
+	sly_value requires = vector_ref(image, mi_requires);
+	while (!null_p(requires)) {
+		sly_value file_path = car(car(requires));
+		if (void_p(get_provides(ss, file_path))) {
+			require_module(ss, file_path, env);
+		}
+		sly_value key = dictionary_ref(module_keys, file_path, SLY_VOID);
+		if (void_p(key) || get_int(key) != get_int(cdr(car(requires)))) {
+			return 0;
+		}
+		requires = cdr(requires);
+	}
+	return 1;
+}
+
+static sly_value
+load_image(Sly_State *ss, sly_value file_path, sly_value image, sly_value env)
+{ /* Replay the expander state recorded in a module image.
+   * Returns the module's entry point.
+   */
+	sly_value vec = vector_ref(image, mi_bindings);
+	for (size_t i = 0; i < vector_len(vec); ++i) {
+		sly_value p = vector_ref(vec, i);
+		dictionary_set(ss, all_bindings, car(p), cdr(p));
+	}
+	vec = vector_ref(image, mi_env);
+	for (size_t i = 0; i < vector_len(vec); ++i) {
+		sly_value p = vector_ref(vec, i);
+		dictionary_set(ss, env, car(p), cdr(p));
+	}
+	/* top-level symbol table and compile time values of globals */
+	sly_value symtable = ss->cc->cscope->symtable;
+	vec = vector_ref(image, mi_defs);
+	for (size_t i = 0; i < vector_len(vec); ++i) {
+		sly_value p = vector_ref(vec, i);
+		dictionary_set(ss, symtable, car(p), (sly_value)get_int(car(cdr(p))));
+		dictionary_set(ss, ss->cc->globals, car(p), cdr(cdr(p)));
+	}
+	set_provides(ss, file_path, vector_ref(image, mi_provides));
+	return module_closure(ss, vector_ref(image, mi_proto));
+}
+
+static void
+save_image(Sly_State *ss, char *image_path, image_source *srcs, size_t nsrcs,
+		   sly_value requires, sly_value defs, sly_value proto)
+{
+	sly_value image = make_vector(ss, MI_COUNT, MI_COUNT);
+	vector_set(image, mi_requires, requires);
+	vector_set(image, mi_bindings, recording->bindings);
+	vector_set(image, mi_env, recording->env);
+	vector_set(image, mi_defs, defs);
+	vector_set(image, mi_provides,
+			   get_provides(ss, make_string(ss, srcs[0].path, strlen(srcs[0].path))));
+	vector_set(image, mi_proto, proto);
+	/* an image that cannot be written is not an error,
+	 * the module is just compiled again next time */
+	sly_image_write(ss, image_path, srcs, nsrcs, get_image_specials(ss), image);
+}
+
+static sly_value
+compile_module(Sly_State *ss, char *image_path, image_source *srcs, u64 *key, sly_value env)
+{
+	struct module_record rec = {
+		.requires = SLY_NULL,
+		.includes = make_vector(ss, 0, 4),
+		.bindings = make_vector(ss, 0, 64),
+		.env = make_vector(ss, 0, 64),
+	};
+	struct module_record *outer = recording;
+	struct gensym_tag tag = {0};
+	snprintf(tag.name, sizeof(tag.name), "%08x",
+			 (u32)(srcs[0].hash ^ sly_image_hash(srcs[0].path, strlen(srcs[0].path))));
+	struct gensym_tag *old_tag = gensym_set_tag(&tag);
+	recording = &rec;
+	sly_value ast = parse(ss, srcs[0].text);
+	ast = sly_expand(ss, env, ast);
+	/* modules required by this one have been loaded by now */
+	sly_value symtable_before = copy_dictionary(ss, ss->cc->cscope->symtable);
+	sly_value entry_point = sly_compile(ss, ast);
+	gensym_set_tag(old_tag);
+	size_t nsrcs = 1;
+	for (size_t i = 0; i < vector_len(rec.includes) && nsrcs < IMAGE_MAX_SOURCES; ++i) {
+		sly_value inc = vector_ref(rec.includes, i);
+		byte_vector *text = GET_PTR(cdr(inc));
+		srcs[nsrcs].path = string_to_cstr(car(inc));
+		srcs[nsrcs].text = (char *)text->elems;
+		srcs[nsrcs].hash = sly_image_hash((char *)text->elems, text->len);
+		nsrcs++;
+	}
+	sly_value requires = SLY_NULL;
+	int cacheable = vector_len(rec.includes) < IMAGE_MAX_SOURCES;
+	for (sly_value r = rec.requires; !null_p(r); r = cdr(r)) {
+		sly_value rkey = dictionary_ref(module_keys, car(r), SLY_VOID);
+		if (void_p(rkey)) { // required module is still being compiled
+			cacheable = 0;
+			rkey = make_int(ss, 0);
+		}
+		requires = cons(ss, cons(ss, car(r), rkey), requires);
+	}
+	*key = module_key(srcs, nsrcs, requires);
+	/* definitions the compiler made in the top-level scope */
+	sly_value defs = make_vector(ss, 0, 16);
+	sly_value sym, idx;
+	for (size_t i = 0; dictionary_next(ss->cc->cscope->symtable, &i, &sym, &idx);) {
+		if (dictionary_ref(symtable_before, sym, SLY_VOID) == idx) {
+			continue;
+		}
+		vector_append(ss, defs,
+					  cons(ss, sym,
+						   cons(ss, make_int(ss, (i64)idx),
+								dictionary_ref(ss->cc->globals, sym, SLY_VOID))));
+	}
+	if (cacheable) {
+		save_image(ss, image_path, srcs, nsrcs, requires, defs,
+				   get_prototype(entry_point));
+	}
+	recording = outer;
+	return entry_point;
+}
+
+static void
+require_module(Sly_State *ss, sly_value file_path, sly_value env)
+{ /* Compile and run a required module, or load
+   * it from its image if the image is up to date.
+   */
+	char *old_file_path = ss->file_path;
+	sly_value old_proto = ss->cc->cscope->proto;
+	sly_value old_entry_point = ss->entry_point;
+	ss->file_path = string_to_cstr(file_path);
+	ss->cc->cscope->proto = make_prototype(ss,
+										   make_vector(ss, 0, 8),
+										   make_vector(ss, 0, 8),
+										   make_vector(ss, 0, 8),
+										   0, 0, 0, 0);
+	size_t size;
+	char *text = read_file(ss->file_path, &size);
+	if (text == NULL) {
+		fprintf(stderr, "%s\n", strerror(errno));
+		sly_raise_exception(ss, EXC_COMPILE, "Error unable to open source file");
+	}
+	ss->source_code = text;
+	image_source srcs[IMAGE_MAX_SOURCES];
+	srcs[0].path = ss->file_path;
+	srcs[0].text = text;
+	srcs[0].hash = sly_image_hash(text, size);
+	size_t nsrcs = 1;
+	u64 key;
+	char *image_path = sly_image_path(ss->file_path);
+	sly_value image = sly_image_read(ss, image_path, srcs, &nsrcs,
+									 get_image_specials(ss));
+	if (image_valid_p(image) && load_requires(ss, image, env)) {
+		ss->entry_point = load_image(ss, file_path, image, env);
+		key = module_key(srcs, nsrcs, vector_ref(image, mi_requires));
+	} else {
+		ss->entry_point = compile_module(ss, image_path, srcs, &key, env);
+	}
+	dictionary_set(ss, module_keys, file_path, make_int(ss, (i64)key));
+	eval_closure(ss, ss->entry_point, SLY_NULL);
+	ss->file_path = old_file_path;
+	ss->cc->cscope->proto = old_proto;
+	ss->entry_point = old_entry_point;
+}
+
 static sly_value
 expand_require(Sly_State *ss, sly_value s, sly_value env)
 {
 	sly_value file_path = syntax_to_datum(car(cdr(s)));
 	sly_assert(string_p(file_path),
 			   "Type Error expected file path as string in require form");
+	if (recording) {
+		recording->requires = cons(ss, file_path, recording->requires);
+	}
 	sly_value provides = get_provides(ss, file_path);
 	if (void_p(provides)) {
-		char *old_file_path = ss->file_path;
-		sly_value old_proto = ss->cc->cscope->proto;
-		sly_value old_entry_point = ss->entry_point;
-		ss->file_path = string_to_cstr(file_path);
-		ss->cc->cscope->proto = make_prototype(ss,
-											   make_vector(ss, 0, 8),
-											   make_vector(ss, 0, 8),
-											   make_vector(ss, 0, 8),
-											   0, 0, 0, 0);
-		sly_value ast = parse_file(ss, ss->file_path, &ss->source_code);
-		ast = sly_expand(ss, env, ast);
-		ss->entry_point = sly_compile(ss, ast);
-		eval_closure(ss, ss->entry_point, SLY_NULL);
-		ss->file_path = old_file_path;
-		ss->cc->cscope->proto = old_proto;
-		ss->entry_point = old_entry_point;
+		require_module(ss, file_path, env);
 		provides = get_provides(ss, file_path);
 	}
 	sly_value scopes = syntax_scopes(car(s));
@@ -617,6 +856,12 @@ expand_include(Sly_State *ss, sly_value s, UNUSED_ATTR sly_value env)
 	char *old_file_path = ss->file_path;
 	ss->file_path = string_to_cstr(file_path);
 	sly_value ast = parse_file(ss, ss->file_path, &ss->source_code);
+	if (recording) {
+		vector_append(ss, recording->includes,
+					  cons(ss, file_path,
+						   string_from_managed_buffer(ss, ss->source_code,
+													  strlen(ss->source_code))));
+	}
 	add_scope_set(ss, ast, syntax_scopes(car(s)));
 	ss->file_path = old_file_path;
 	return ast;
@@ -759,6 +1004,7 @@ void
 sly_expand_init(Sly_State *ss, sly_value env)
 {
 	all_bindings = make_dictionary(ss);
+	module_keys = make_dictionary(ss);
 	core_forms = make_vector(ss, 0, CORE_FORM_COUNT);
 	core_scope = scope();
 	variable = gensym_from_cstr(ss, "var");